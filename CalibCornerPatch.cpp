@@ -8,6 +8,7 @@
 #include "OpenGL.h"
 
 #include "GCVD/image_interpolate.h"
+#include "PatchKernels.h"
 //#include "GCVD/Addedutils.h"
 #include <GL/gl.h>
 #include <GL/glut.h>
@@ -49,8 +50,9 @@ void CalibCornerPatch::MakeTemplateWithCurrentParams() {
         // obtaining the transformation that rotates and "distorts" the corner.
         cv::Mat_<float> m2Warp = mParams.m2Warp();
         // now, transform the purative template image into how it should look according to m2Warp and store in "imTwiceToBlue"...
-        CvUtils::transform<>(
-            mimSharedSourceTemplate, imTwiceToBlur, CvUtils::M2Inverse(m2Warp),
+        PatchKernels::WarpAffine(
+            mimSharedSourceTemplate, imTwiceToBlur,
+            cv::Matx<float, 2, 2>(CvUtils::M2Inverse(m2Warp)),
             0.5 * cv::Vec2f(mimSharedSourceTemplate.cols - 1,
                             mimSharedSourceTemplate.rows - 1),
             0.5 * cv::Vec2f(imTwiceToBlur.cols - 1, imTwiceToBlur.rows - 1));
@@ -98,8 +100,9 @@ void CalibCornerPatch::MakeTemplateWithCurrentParams() {
             m2Warp(1, i) = sin(dAngle);
         };
 
-        CvUtils::transform<>(
-            mimSharedSourceTemplate, imTwiceToBlur, CvUtils::M2Inverse(m2Warp),
+        PatchKernels::WarpAffine(
+            mimSharedSourceTemplate, imTwiceToBlur,
+            cv::Matx<float, 2, 2>(CvUtils::M2Inverse(m2Warp)),
             0.5 * cv::Vec2f(mimSharedSourceTemplate.cols - 1,
                             mimSharedSourceTemplate.rows - 1),
             0.5 * cv::Vec2f(imTwiceToBlur.cols - 1, imTwiceToBlur.rows - 1));
@@ -128,18 +131,10 @@ void CalibCornerPatch::MakeTemplateWithCurrentParams() {
     }  // end the dof-for
 
     // Make the image of image gradients here too (while we have the bigger template to work from)
-    for (r = 0; r < mimGradients.rows; r++) {
-        float* bRowPtr = imToBlur.ptr<float>(r + nOffsetRow);
-        float* bRowPtr1 = imToBlur.ptr<float>(r + nOffsetRow + 1);
-        float* bRowPtr_1 = imToBlur.ptr<float>(r + nOffsetRow - 1);
-        cv::Vec<float, 2>* gRowPtr = mimGradients.ptr<cv::Vec<float, 2>>(r);
-        for (c = 0; c < mimGradients.cols; c++) {
-            gRowPtr[c][0] = 0.5 * (bRowPtr[c + nOffsetCol + 1] -
-                                   bRowPtr[c + nOffsetCol - 1]);
-            gRowPtr[c][1] =
-                0.5 * (bRowPtr1[c + nOffsetCol] - bRowPtr_1[c + nOffsetCol]);
-        }
-    }
+    PatchKernels::CentralGradients(
+        imToBlur.ptr<float>(nOffsetRow) + nOffsetCol, imToBlur.step,
+        mimGradients.rows, mimGradients.cols, 0.5f,
+        (float*)mimGradients.ptr<cv::Vec<float, 2>>(0), mimGradients.step);
 
 }  // and this concludes the creation of a template
 
@@ -128,8 +128,9 @@ void CameraCalibrator::Run() {
         cv::Mat imFrameRGB;
         cv::Mat_<uchar> imFrameBW;
 
-        // Grab new video frame...
-        mVideoSource.GetAndFillFrameBWandRGB(imFrameBW, imFrameRGB);
+        // Grab new video frame... (the calibrator has no use for its timestamp)
+        double dTimestamp;
+        mVideoSource.GetAndFillFrameBWandRGB(imFrameBW, imFrameRGB, dTimestamp);
 
         // Set up openGL. more comments in the following methods in GLWindow.h ...
         mGLWindow.SetupViewport();
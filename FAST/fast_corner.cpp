@@ -1,6 +1,8 @@
 #include "fast_corner.h"
 #include "nonmax_suppression.h"
 #include "prototypes.h"
+
+#include "../PatchKernels.h"
 //#include "cvd/config.h"
 
 //#include <cvd/byte.h>
@@ -69,17 +71,23 @@ void compute_fast_score_old(const cv::Mat_<uchar>& im,
         pointer_dir[i] = fast_pixel_ring[i].x + fast_pixel_ring[i].y * stride;
 
     scores.resize(corners.size());
+    if (corners.empty())
+        return;
 
+    // Same scores as old_style_corner_score, but in bulk with the SIMD scorer
+    vector<int> offsets(corners.size());
     for (unsigned int i = 0; i < corners.size(); i++)
-        scores[i] =
-            old_style_corner_score(im, corners[i], pointer_dir, barrier);
+        offsets[i] = corners[i].y * stride + corners[i].x;
+    PatchKernels::FASTRingScores(im.ptr<uchar>(), &offsets[0],
+                                 (int)corners.size(), pointer_dir, barrier,
+                                 &scores[0]);
 }
 
 void fast_nonmax(const cv::Mat_<uchar>& im, const vector<cv::Point2i>& corners,
                  int barrier, vector<cv::Point2i>& max_corners) {
     vector<int> scores;
     compute_fast_score_old(im, corners, barrier, scores);
-    nonmax_suppression(corners, scores, max_corners);
+    nonmax_suppression_image(im.size(), corners, scores, max_corners);
 }
 
 void fast_nonmax_with_scores(const cv::Mat_<uchar>& im,
@@ -87,7 +95,8 @@ void fast_nonmax_with_scores(const cv::Mat_<uchar>& im,
                              vector<pair<cv::Point2i, int> >& max_corners) {
     vector<int> scores;
     compute_fast_score_old(im, corners, barrier, scores);
-    nonmax_suppression_with_scores(corners, scores, max_corners);
+    nonmax_suppression_image_with_scores(im.size(), corners, scores,
+                                         max_corners);
 }
 
 }  // namespace FAST
\ No newline at end of file
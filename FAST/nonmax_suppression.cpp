@@ -5,6 +5,8 @@
 
 #include "prototypes.h"
 
+#include "../PatchKernels.h"
+
 using namespace std;
 
 namespace FAST {
@@ -143,6 +145,43 @@ struct collect_score {
     }
 };
 
+// Score image version of the above (non-strict). Every corner's score goes into an
+// otherwise zero image; a corner then survives iff the 3x3 max around it is its own
+// score. Non-corner pixels are zero, so they never beat a (non-negative) corner score.
+template <class ReturnType, class Collector>
+inline void nonmax_suppression_image_t(const cv::Size& size,
+                                       const vector<cv::Point2i>& corners,
+                                       const vector<int>& scores,
+                                       vector<ReturnType>& nonmax_corners) {
+    nonmax_corners.clear();
+    nonmax_corners.reserve(corners.size());
+
+    if (corners.size() < 1)
+        return;
+
+    cv::Mat_<short> imScores = cv::Mat_<short>::zeros(size);
+    for (unsigned int i = 0; i < corners.size(); i++)
+        imScores(corners[i]) = (short)scores[i];
+
+    vector<short> vRowMax(size.width);
+    const int sz = (int)corners.size();
+    int i = 0;
+    while (i < sz) {
+        // Filter the row of this run of corners (raster order: one row at a time)
+        int y = corners[i].y;
+        const short* pRow = imScores.ptr<short>(y);
+        const short* pAbove = y > 0 ? imScores.ptr<short>(y - 1) : pRow;
+        const short* pBelow =
+            y < size.height - 1 ? imScores.ptr<short>(y + 1) : pRow;
+        PatchKernels::Max3x3Row(pAbove, pRow, pBelow, size.width, &vRowMax[0]);
+
+        for (; i < sz && corners[i].y == y; i++)
+            if (vRowMax[corners[i].x] <= scores[i])
+                nonmax_corners.push_back(
+                    Collector::collect(corners[i], scores[i]));
+    }
+}
+
 // The callable functions
 void nonmax_suppression_strict(const vector<cv::Point2i>& corners,
                                const vector<int>& scores,
@@ -165,4 +204,20 @@ void nonmax_suppression_with_scores(
         corners, scores, nonmax_corners);
 }
 
+void nonmax_suppression_image(const cv::Size& size,
+                              const vector<cv::Point2i>& corners,
+                              const vector<int>& scores,
+                              vector<cv::Point2i>& nonmax_corners) {
+    nonmax_suppression_image_t<cv::Point2i, collect_pos>(size, corners, scores,
+                                                         nonmax_corners);
+}
+
+void nonmax_suppression_image_with_scores(
+    const cv::Size& size, const vector<cv::Point2i>& corners,
+    const vector<int>& scores,
+    vector<pair<cv::Point2i, int> >& nonmax_corners) {
+    nonmax_suppression_image_t<pair<cv::Point2i, int>, collect_score>(
+        size, corners, scores, nonmax_corners);
+}
+
 }  // namespace FAST
\ No newline at end of file
@@ -35,6 +35,29 @@ void nonmax_suppression_with_scores(
     const std::vector<cv::Point2i>& corners, const std::vector<int>& scores,
     std::vector<std::pair<cv::Point2i, int> >& max_corners);
 
+/**Perform nonmaximal suppression on a set of features, in a 3 by 3 window, through
+	   an image of the scores (the scores are written into an image of the given size
+	   and every row holding corners is 3x3-max filtered with SIMD compares).
+	   Non strict, and exactly the same result as nonmax_suppression(); this one is
+	   faster for the dense corner sets of FAST. The scores must be in [0, 32767].
+	@param size    The size of the image the corners were found in
+	@param corners The corner locations (in raster scan order)
+	@param scores  The corners' scores
+	@param max_corners The locally maximal corners.
+	*/
+void nonmax_suppression_image(const cv::Size& size,
+                              const std::vector<cv::Point2i>& corners,
+                              const std::vector<int>& scores,
+                              std::vector<cv::Point2i>& nmax_corners);
+
+/**As nonmax_suppression_image(), also returning the scores.
+	@param max_corners The locally maximal corners, and their scores.
+	*/
+void nonmax_suppression_image_with_scores(
+    const cv::Size& size, const std::vector<cv::Point2i>& corners,
+    const std::vector<int>& scores,
+    std::vector<std::pair<cv::Point2i, int> >& max_corners);
+
 }  // namespace FAST
 
 #endif
\ No newline at end of file
@@ -0,0 +1,71 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+#include "FrameArena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+// Everything is handed out at least this aligned (and the block is allocated so)
+static const size_t nBaseAlignment = 64;
+
+static void* AlignedAlloc(size_t nBytes, size_t nAlign = nBaseAlignment) {
+    void* p = NULL;
+    if (posix_memalign(&p, std::max(nAlign, nBaseAlignment), nBytes) != 0)
+        throw std::bad_alloc();
+    return p;
+}
+
+FrameArena::FrameArena(size_t nInitialBytes) {
+    mnBlockSize = nInitialBytes;
+    mpBlock = (char*)AlignedAlloc(mnBlockSize);
+    mnUsed = 0;
+    mnOverflowBytes = 0;
+}
+
+FrameArena::~FrameArena() {
+    for (unsigned int i = 0; i < mvpOverflow.size(); i++)
+        free(mvpOverflow[i]);
+    free(mpBlock);
+}
+
+void* FrameArena::Allocate(size_t nBytes, size_t nAlign) {
+    if (nAlign <= nBaseAlignment) {
+        size_t nStart = (mnUsed + nAlign - 1) & ~(nAlign - 1);
+        if (nStart + nBytes <= mnBlockSize) {
+            mnUsed = nStart + nBytes;
+            return mpBlock + nStart;
+        }
+    }
+    // Doesn't fit (or wants more alignment than the bump pointer can give
+    // without wasting the block): straight from the heap, until the next Reset.
+    void* p = AlignedAlloc(nBytes == 0 ? 1 : nBytes, nAlign);
+    mvpOverflow.push_back(p);
+    mnOverflowBytes += nBytes + std::max(nAlign, nBaseAlignment);
+    return p;
+}
+
+void FrameArena::Reset() {
+    if (!mvpOverflow.empty()) {
+        for (unsigned int i = 0; i < mvpOverflow.size(); i++)
+            free(mvpOverflow[i]);
+        mvpOverflow.clear();
+
+        // Grow to what the last frame needed in total, plus some head room
+        size_t nNeeded = mnUsed + mnOverflowBytes;
+        size_t nNewSize = mnBlockSize;
+        while (nNewSize < nNeeded + nNeeded / 4)
+            nNewSize *= 2;
+        if (nNewSize != mnBlockSize) {
+            free(mpBlock);
+            mnBlockSize = nNewSize;
+            mpBlock = (char*)AlignedAlloc(mnBlockSize);
+        }
+    }
+    mnUsed = 0;
+    mnOverflowBytes = 0;
+}
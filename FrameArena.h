@@ -0,0 +1,85 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+//
+// A bump allocator for data that live for one frame only.
+//
+// The tracker builds the same handful of scratch containers every frame (the
+// potentially visible set per level, the search and iteration sets, the squared
+// errors of the M-estimator) and throws them away at the end of the frame.
+// With a FrameArena these containers take their memory from one big block which
+// is simply rewound (Reset) at the start of the next frame: allocation is a pointer
+// bump, de-allocation is a no-op, and once the block has grown to what a frame
+// needs, steady-state tracking does no heap allocations for them at all.
+//
+// ArenaAllocator is a std allocator on top of a FrameArena and ArenaVector the
+// corresponding std::vector. Everything allocated from the arena must be gone (or
+// at least never touched again) before the next Reset. Not thread-safe.
+
+#ifndef __FRAME_ARENA_H
+#define __FRAME_ARENA_H
+
+#include <cstddef>
+#include <vector>
+
+class FrameArena {
+   public:
+    FrameArena(size_t nInitialBytes = 256 * 1024);
+    ~FrameArena();
+
+    // nBytes of memory aligned to nAlign (a power of two), valid until the next Reset.
+    void* Allocate(size_t nBytes, size_t nAlign);
+
+    // Forgets everything allocated so far. If the last frame overflowed the block,
+    // the block is re-allocated ONCE to fit all of it, so the next frame will not.
+    void Reset();
+
+    size_t Capacity() const { return mnBlockSize; }
+    size_t BytesUsed() const { return mnUsed + mnOverflowBytes; }
+
+   protected:
+    char* mpBlock;       // The block allocations are bumped off
+    size_t mnBlockSize;  // ... its size
+    size_t mnUsed;       // ... and how much of it has been handed out
+
+    // Requests that did not fit in the block this frame (freed on Reset)
+    std::vector<void*> mvpOverflow;
+    size_t mnOverflowBytes;
+
+    FrameArena(const FrameArena&);  // Not copyable
+    FrameArena& operator=(const FrameArena&);
+};
+
+template <class T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    ArenaAllocator(FrameArena& arena) : mpArena(&arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : mpArena(other.mpArena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(mpArena->Allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}  // Everything goes at once, on FrameArena::Reset
+
+    FrameArena* mpArena;
+};
+
+template <class T, class U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.mpArena == b.mpArena;
+}
+
+template <class T, class U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.mpArena != b.mpArena;
+}
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif
@@ -183,6 +183,17 @@ inline bool in_image_with_border(int row, int col, cv::Mat im, int bwidth,
            (col + bwidth < im.cols) && (row + bheight < im.rows);
 };
 
+// How far (in pixels) beyond its edges the pixels of im can be read: the narrowest
+// margin between im and the matrix it is a view (ROI) of. Zero if im is not a view.
+inline int readable_border(const cv::Mat& im) {
+    cv::Size wholeSize;
+    cv::Point ofs;
+    im.locateROI(wholeSize, ofs);
+    return std::min(std::min(ofs.x, ofs.y),
+                    std::min(wholeSize.width - ofs.x - im.cols,
+                             wholeSize.height - ofs.y - im.rows));
+};
+
 // 2x2 inverse!!!!!
 template <typename T>
 inline cv::Mat_<T> M2Inverse(const cv::Mat_<T>& m) {
@@ -7,12 +7,18 @@
 #include "KeyFrame.h"
 #include "FAST/fast_corner.h"
 #include "FAST/prototypes.h"
+#include "PatchKernels.h"
 #include "ShiTomasi.h"
 #include "SmallBlurryImage.h"
 
 #include "GCVD/Addedutils.h"
 #include "OpenCV.h"
 
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <thread>
+
 using namespace std;
 using namespace Persistence;
 using namespace FAST;
@@ -24,7 +30,8 @@ void KeyFrame::MakeKeyFrame_Lite(cv::Mat_<uchar>& im) {
     // mapmaker but not the tracker go in MakeKeyFrame_Rest();
 
     // First, copy out the image data to the pyramid's zero level
-    // (destination image data are automatically allocated).
+    // (into the padded level storage, which is only allocated on the first frame).
+    aLevels[0].AllocatePadded(im.rows, im.cols);
     im.copyTo(aLevels[0].im);
 
     // Now we are generating a pyramid by simply decimating (smaller image is not blurred)
@@ -34,9 +41,13 @@ void KeyFrame::MakeKeyFrame_Lite(cv::Mat_<uchar>& im) {
         Level& lev = aLevels[i];
         // Now obtaining the new level image as the decimated image of the previous level.
         // Note that he resizing should work even if the next level image data have not been allocated yet...
-        if (i != 0)
+        if (i != 0) {
+            lev.AllocatePadded(aLevels[i - 1].im.rows / 2,
+                               aLevels[i - 1].im.cols / 2);
             CvUtils::halfSample(aLevels[i - 1].im,
                                 lev.im);  // ALWAYS do this a la Rosten!!!!
+        }
+        lev.ReplicateGuard();
                                           // DERECATED:
         /*cv::resize(aLevels[i - 1].im, lev.im, 
       		 cv::Size2i(aLevels[i - 1].im.cols / 2, aLevels[i - 1].im.rows / 2)
@@ -45,39 +56,106 @@ void KeyFrame::MakeKeyFrame_Lite(cv::Mat_<uchar>& im) {
         // Now detecting FAST corners for the current level (i-th).
         // G.K. uses different threshold for each level. TODO: I don't know if that can be somehow improved..
         // The aim is to balance the different levels' relative feature densities.
+        lev.bGradientsCached = false;  // New pixels, so any old gradients are stale
+        lev.bImplaneCornersCached = false;  // ... and so are the un-projected corners
+        lev.vImplaneCorners.clear();
         lev.vCorners.clear();
+        lev.vCornerRowLUT.clear();
+        lev.bCornersDetected = false;  // ... and the corners (detected on demand)
         lev.vCandidates.clear();
         lev.vMaxCorners.clear();
-        int b;  // The FAST threshold
         switch (i) {
             case 0:
-                b = 10;
+                lev.nFASTThreshold = 10;
                 break;
             case 1:
-                b = 15;
+                lev.nFASTThreshold = 15;
                 break;
             case 2:
-                b = 15;
+                lev.nFASTThreshold = 15;
                 break;
             default:
-                b = 10;  // 10 for every level above-equal to 3 (if any that is...)
+                lev.nFASTThreshold =
+                    10;  // 10 for every level above-equal to 3 (if any that is...)
         }
+    }
 
-        // detect corners at this level and store in the respective corner list
-        FAST::fast_corner_detect_plain_10(lev.im, lev.vCorners, b);
+    // 0: detect the corners of all levels right away, as it used to be
+    static pvar3<int> pvnLazyCorners("Tracker.LazyCornerDetection", 1, SILENT);
+    if (!*pvnLazyCorners)
+        DetectAllCorners();
+}
 
-        // Generate row look-up-table for the FAST corner points: this speeds up
-        // finding close-by corner points later on.
-        // Given that FAST corners are scanned row-wise, I am not sure what the following code accomplishes...
-        // It appears that corners are ordered in terms of their row (but that is anticipated given the way FAST works...)
-        unsigned int v = 0;
-        lev.vCornerRowLUT.clear();
-        for (int r = 0; r < lev.im.rows; r++) {
+void KeyFrame::DetectAllCorners() {
+    for (int i = 0; i < LEVELS; i++)
+        aLevels[i].DetectCorners();
+}
+
+void Level::DetectCorners() {
+    if (bCornersDetected)
+        return;
+
+    // detect corners at this level and store in the respective corner list
+    vCorners.clear();
+    FAST::fast_corner_detect_plain_10(im, vCorners, nFASTThreshold);
 
-            while (v < lev.vCorners.size() && r > lev.vCorners[v].y)
-                v++;
-            lev.vCornerRowLUT.push_back(v);
+    // Generate row look-up-table for the FAST corner points: this speeds up
+    // finding close-by corner points later on.
+    // Given that FAST corners are scanned row-wise, I am not sure what the following code accomplishes...
+    // It appears that corners are ordered in terms of their row (but that is anticipated given the way FAST works...)
+    unsigned int v = 0;
+    vCornerRowLUT.clear();
+    for (int r = 0; r < im.rows; r++) {
+
+        while (v < vCorners.size() && r > vCorners[v].y)
+            v++;
+        vCornerRowLUT.push_back(v);
+    }
+    bCornersDetected = true;
+}
+
+// The per-level part of MakeKeyFrame_Rest: maximal FAST corners and the Candidates among them.
+// Levels share nothing, so this runs on all levels at once.
+static void MakeLevelCandidates(Level& lev, double dMinSTScore,
+                                bool bWholeLevel) {
+    // .. find those FAST corners which are maximal..
+    fast_nonmax(lev.im, lev.vCorners, 10, lev.vMaxCorners);
+    // .. and then calculate the Shi-Tomasi scores of those, and keep the ones with
+    // a suitably high score as Candidates, i.e. points which the mapmaker will attempt
+    // to make new map points out of.
+
+    // The mapmaker builds sub-pixel templates from map keyframe levels all the time,
+    // so give every level its gradients now (before anyone else sees the keyframe);
+    // they also feed the whole-level Shi-Tomasi scores below.
+    lev.MakeGradients();
+
+    ShiTomasiScorer scorer;
+    if (bWholeLevel)
+        scorer.Prepare(lev.imGradX, lev.imGradY, 3);
+
+    vector<cv::Point2i>::iterator iCorner;
+    for (iCorner = lev.vMaxCorners.begin(); iCorner != lev.vMaxCorners.end();
+         iCorner++) {
+
+        if (!CvUtils::in_image_with_border(iCorner->y, iCorner->x, lev.im, 10,
+                                           10))
+            continue;
+        // find Shi-Tomasi score in small patches of 6 pixels (-3 to +3)
+        double dSTScore = bWholeLevel
+                              ? scorer.ScoreAtPoint(*iCorner)
+                              : FindShiTomasiScoreAtPoint(lev.im, 3, *iCorner);
+
+        // if the score is above minimum (70),
+        // we need to consider this mappoint as candidate.
+        // Hence, put in the list of candidates in this level..
+        if (dSTScore > dMinSTScore) {
+
+            Candidate c;
+            c.irLevelPos = *iCorner;
+            c.dSTScore = dSTScore;
+            lev.vCandidates.push_back(c);
         }
+        //cout <<"DEBUG: "<<lev.vCandidates.size()<<" pushed back in make_keyframe_Rest!"<<endl;
     }
 }
 
@@ -87,44 +165,43 @@ void KeyFrame::MakeKeyFrame_Rest() {
     // creation of the relocaliser's SmallBlurryImage.
     static pvar3<double> pvdCandidateMinSTScore(
         "MapMaker.CandidateMinShiTomasiScore", 70, SILENT);
+    // 1: score whole levels at once from the level gradients (same scores, less work
+    // per corner); 0: score every maximal corner separately
+    static pvar3<int> pvnWholeLevelSTScores("MapMaker.WholeLevelShiTomasi", 1,
+                                            SILENT);
+    // 1: process the pyramid levels in parallel (one thread per level above zero)
+    static pvar3<int> pvnParallelLevels("MapMaker.ParallelKeyFrameLevels", 1,
+                                        SILENT);
+
+    double dMinSTScore = *pvdCandidateMinSTScore;
+    bool bWholeLevel = *pvnWholeLevelSTScores != 0;
+
+    // The tracker only detects corners on the levels it needed (see
+    // Level::DetectCorners); the candidates need every level's.
+    DetectAllCorners();
 
     // Now look into all levels for maximal FAST corners
-    // that can be "Candidate" mappoints
-    for (int l = 0; l < LEVELS; l++) {
-
-        Level& lev = aLevels[l];
-        // .. find those FAST corners which are maximal..
-        fast_nonmax(lev.im, lev.vCorners, 10, lev.vMaxCorners);
-        // .. and then calculate the Shi-Tomasi scores of those, and keep the ones with
-        // a suitably high score as Candidates, i.e. points which the mapmaker will attempt
-        // to make new map points out of.
-
-        vector<cv::Point2i>::iterator iCorner;
-        for (iCorner = lev.vMaxCorners.begin();
-             iCorner != lev.vMaxCorners.end(); iCorner++) {
-
-            if (!CvUtils::in_image_with_border(iCorner->y, iCorner->x, lev.im,
-                                               10, 10))
-                continue;
-            // find Shi-Tomasi score in small patches of 6 pixels (-3 to +3)
-            double dSTScore = FindShiTomasiScoreAtPoint(lev.im, 3, *iCorner);
-
-            // if the score is above minimum (70),
-            // we need to consider this mappoint as candidate.
-            // Hence, put in the list of candidates in this level..
-            if (dSTScore > *pvdCandidateMinSTScore) {
-
-                Candidate c;
-                c.irLevelPos = *iCorner;
-                c.dSTScore = dSTScore;
-                lev.vCandidates.push_back(c);
-            }
-            //cout <<"DEBUG: "<<lev.vCandidates.size()<<" pushed back in make_keyframe_Rest!"<<endl;
-        }
-    }
+    // that can be "Candidate" mappoints. Level zero has three times as many pixels as
+    // all the others together, so it stays on this thread while the others get one each.
+    if (*pvnParallelLevels) {
+        std::vector<std::thread> vLevelThreads;
+        for (int l = 1; l < LEVELS; l++)
+            vLevelThreads.push_back(std::thread(MakeLevelCandidates,
+                                                std::ref(aLevels[l]),
+                                                dMinSTScore, bWholeLevel));
+        MakeLevelCandidates(aLevels[0], dMinSTScore, bWholeLevel);
+        for (unsigned int i = 0; i < vLevelThreads.size(); i++)
+            vLevelThreads[i].join();
+    } else
+        for (int l = 0; l < LEVELS; l++)
+            MakeLevelCandidates(aLevels[l], dMinSTScore, bWholeLevel);
 
     // Also, make a SmallBlurryImage of the keyframe: The relocaliser uses these.
-    pSBI = new SmallBlurryImage(*this);
+    // (A recycled keyframe may already have one, which is simply re-made.)
+    if (pSBI)
+        pSBI->MakeFromKF(*this);
+    else
+        pSBI = new SmallBlurryImage(*this);
 
     // Relocaliser also wants the jacobians..
     pSBI->MakeGradients();
@@ -132,17 +209,103 @@ void KeyFrame::MakeKeyFrame_Rest() {
 
 // The keyframe struct is quite happy with default operator=, but Level needs its own
 Level& Level::operator=(const Level& rhs) {
-    // Operator= should physically copy pixels:
-
+    // Operator= should physically copy pixels (into our own padded storage):
+    AllocatePadded(rhs.im.rows, rhs.im.cols);
     rhs.im.copyTo(im);
+    ReplicateGuard();
 
     vCorners = rhs.vCorners;
     vMaxCorners = rhs.vMaxCorners;
     vCornerRowLUT = rhs.vCornerRowLUT;
+    bCornersDetected = rhs.bCornersDetected;
+    nFASTThreshold = rhs.nFASTThreshold;
+
+    // The gradients are cheap enough to recompute if anyone asks for them
+    bGradientsCached = false;
 
     return *this;
 }
 
+void Level::MakeGradients() {
+    if (bGradientsCached)
+        return;
+
+    imGradX.create(im.rows, im.cols);
+    imGradY.create(im.rows, im.cols);
+    PatchKernels::CentralGradients(im.data, im.step, im.rows, im.cols,
+                                   imGradX.ptr<short>(), imGradY.ptr<short>(),
+                                   imGradX.step);
+    bGradientsCached = true;
+}
+
+void Level::AllocatePadded(int nRows, int nCols) {
+    if (im.rows == nRows && im.cols == nCols && !imPadded.empty() &&
+        im.data == imPadded.ptr(LEVEL_GUARD) + LEVEL_GUARD)
+        return;
+
+    const int nPaddedRows = nRows + 2 * LEVEL_GUARD;
+    const int nPaddedCols = nCols + 2 * LEVEL_GUARD;
+    // Whole cache lines per row, plus one more so that the first row can be moved
+    // onto a cache line boundary whatever alignment the allocator gave us.
+    const int nStep = (nPaddedCols + 63) / 64 * 64 + 64;
+    cv::Mat_<uchar> imRaw(nPaddedRows, nStep);
+    const int nMisalignment = (int)((size_t)imRaw.data % 64);
+    const int nOffset = nMisalignment == 0 ? 0 : 64 - nMisalignment;
+
+    imPadded = imRaw(cv::Rect(nOffset, 0, nPaddedCols, nPaddedRows));
+    im = imPadded(cv::Rect(LEVEL_GUARD, LEVEL_GUARD, nCols, nRows));
+    bGradientsCached = false;
+}
+
+void Level::ReplicateGuard() {
+    assert(im.data == imPadded.ptr(LEVEL_GUARD) + LEVEL_GUARD);
+
+    // Left and right of every image row...
+    for (int r = 0; r < im.rows; r++) {
+        uchar* pRow = imPadded.ptr(r + LEVEL_GUARD);
+        memset(pRow, pRow[LEVEL_GUARD], LEVEL_GUARD);
+        memset(pRow + LEVEL_GUARD + im.cols, pRow[LEVEL_GUARD + im.cols - 1],
+               LEVEL_GUARD);
+    }
+    // ... and then the (now complete) first and last rows above and below.
+    const int nLastRow = LEVEL_GUARD + im.rows - 1;
+    for (int r = 0; r < LEVEL_GUARD; r++) {
+        memcpy(imPadded.ptr(r), imPadded.ptr(LEVEL_GUARD), imPadded.cols);
+        memcpy(imPadded.ptr(nLastRow + 1 + r), imPadded.ptr(nLastRow),
+               imPadded.cols);
+    }
+}
+
+KeyFrame::Ptr KeyFramePool::Acquire() {
+    for (unsigned int i = 0; i < mvpKeyFrames.size(); i++) {
+        KeyFrame::Ptr& pKF = mvpKeyFrames[i];
+        if (pKF.use_count() != 1)  // Still in use elsewhere
+            continue;
+
+        // Wipe whatever the last frame left behind; the per-level data are
+        // cleared (keeping their storage) by MakeKeyFrame_Lite.
+        pKF->se3CfromW = SE3<>();
+        pKF->bFixed = false;
+        pKF->mMeasurements.clear();
+        pKF->dSceneDepthMean = 1.0;
+        pKF->dSceneDepthSigma = 1.0;
+        return pKF;
+    }
+
+    KeyFrame::Ptr pKF(new KeyFrame());
+    if (mvpKeyFrames.size() < mnCapacity)
+        mvpKeyFrames.push_back(pKF);
+    return pKF;
+}
+
+void KeyFramePool::Release(const KeyFrame::Ptr& pKF) {
+    for (unsigned int i = 0; i < mvpKeyFrames.size(); i++)
+        if (mvpKeyFrames[i] == pKF) {
+            mvpKeyFrames.erase(mvpKeyFrames.begin() + i);
+            return;
+        }
+}
+
 // -------------------------------------------------------------
 // Some useful globals defined in LevelHelpers.h live here:
 cv::Vec3f gavLevelColors[LEVELS];
@@ -34,7 +34,19 @@ using namespace RigidTransforms;
 struct MapPoint;
 class SmallBlurryImage;
 
+// Number of pyramid levels of every frame. A build option (PTAM_PYRAMID_LEVELS in
+// CMakeLists.txt) since the levels are a fixed array; high resolution cameras want
+// more of them. How far down the tracker goes is a run-time setting (Tracker.BaseLevel).
+#ifndef LEVELS
 #define LEVELS 4
+#endif
+static_assert(LEVELS >= 4, "SmallBlurryImage is made from pyramid level 3");
+
+// Width (in pixels) of the border of replicated edge pixels kept around every pyramid
+// level image. It is wider than any patch read around a pixel of the level, so patch
+// kernels may run right up to the image edges without bounds checks; and being a multiple
+// of 32 it keeps every row of the level image 32-byte aligned (see Level::AllocatePadded).
+#define LEVEL_GUARD 32
 
 // Candidate: a feature in an image which could be made into a map point
 struct Candidate {
@@ -62,14 +74,27 @@ struct KFMeasurement {
 // Each keyframe is made of LEVELS pyramid levels, stored in struct Level.
 // This contains image data and corner points.
 struct Level {
-    inline Level() { bImplaneCornersCached = false; };
-
-    cv::Mat_<uchar> im;                 // The pyramid level pixels
+    inline Level() {
+        bImplaneCornersCached = false;
+        bGradientsCached = false;
+        bCornersDetected = false;
+        nFASTThreshold = 10;
+    };
+
+    cv::Mat_<uchar> im;                 // The pyramid level pixels (a view into imPadded)
+    cv::Mat_<uchar> imPadded;  // im plus LEVEL_GUARD pixels of replicated border all around
     std::vector<cv::Point2i> vCorners;  // All FAST corners on this level
     std::vector<int>
         vCornerRowLUT;  // Row-index into the FAST corners, speeds up access
     std::vector<cv::Point2i> vMaxCorners;  // The maximal FAST corners
 
+    // The FAST corners (and their row LUT) are only detected when first needed, so a
+    // tracker frame pays just for the levels it searches; keyframes get them all
+    // (KeyFrame::DetectAllCorners). Anything reading vCorners calls DetectCorners first.
+    bool bCornersDetected;
+    int nFASTThreshold;     // Set by MakeKeyFrame_Lite
+    void DetectCorners();  // Does nothing if the corners are already there
+
     Level& operator=(const Level& rhs);
 
     std::vector<Candidate>
@@ -79,6 +104,22 @@ struct Level {
         bImplaneCornersCached;  // Also keep image-plane (z=1) positions of FAST corners to speed up epipolar search
     std::vector<cv::Vec2f>
         vImplaneCorners;  // Corner points un-projected into z=1-plane coordinates
+
+    // Central-difference gradients of im (I(x+1) - I(x-1), I(y+1) - I(y-1), i.e. WITHOUT the 0.5 factor;
+    // zero on the image border). They are only computed on demand (MakeGradients) and then shared
+    // by everything that needs image derivatives at this level (sub-pixel templates, Shi-Tomasi scores).
+    bool bGradientsCached;
+    cv::Mat_<short> imGradX;
+    cv::Mat_<short> imGradY;
+    void MakeGradients();  // Does nothing if the gradients are already there
+
+    // (Re-)allocates the level storage for an nRows x nCols image: imPadded gets the guard
+    // border and 64-byte aligned rows whose stride is a whole number of cache lines, and
+    // im becomes the view of its interior. Does nothing if im already is such a view of that size.
+    void AllocatePadded(int nRows, int nCols);
+    // Fills the guard border of imPadded with copies of the nearest pixels of im.
+    // Must be called whenever the pixels of im change.
+    void ReplicateGuard();
 };
 
 // The actual KeyFrame struct. The map contains of a bunch of these. However, the tracker uses this
@@ -109,6 +150,7 @@ struct KeyFrame {
         // keyframe data structures with everything that's needed by the tracker..
     void
     MakeKeyFrame_Rest();  // ... while this calculates the rest of the data which the mapmaker needs.
+    void DetectAllCorners();  // FAST corners on every level (see Level::DetectCorners)
 
     double dSceneDepthMean;  // Hacky heuristics to improve epipolar search.
     double dSceneDepthSigma;
@@ -116,6 +158,26 @@ struct KeyFrame {
     SmallBlurryImage* pSBI;  // The relocaliser uses this
 };
 
+// The tracker turns EVERY frame into a KeyFrame, and most of these are thrown away a frame
+// later. KeyFramePool recycles them instead: a pooled KeyFrame that nobody but the pool
+// still refers to is handed out again, so its pyramid storage, corner vectors and row LUTs
+// (and all their capacity) are reused rather than freed and re-allocated on every frame.
+// A KeyFrame that goes into the map is Release()-d: ownership passes to the MapMaker
+// and the pool forgets about it. Not thread-safe; the pool belongs to the tracker thread.
+class KeyFramePool {
+   public:
+    KeyFramePool(unsigned int nCapacity = 8) : mnCapacity(nCapacity){};
+
+    // A KeyFrame ready for MakeKeyFrame_Lite (recycled if possible, new otherwise)
+    KeyFrame::Ptr Acquire();
+    // Hands pKF over to whoever else holds it; the pool will never recycle it.
+    void Release(const KeyFrame::Ptr& pKF);
+
+   protected:
+    unsigned int mnCapacity;  // How many KeyFrames the pool holds on to at most
+    std::vector<KeyFrame::Ptr> mvpKeyFrames;
+};
+
 typedef std::map<std::shared_ptr<MapPoint>, KFMeasurement>::iterator
     meas_it;  // For convenience, and to work around an emacs paren-matching bug
 
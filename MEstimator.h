@@ -5,17 +5,21 @@
 //
 // Defines various MEstimators which can be used by the Tracker and
 // the Bundle adjuster. Not that some of the inputs are squared
-// quantities!
+// quantities! FindSigmaSquared takes vectors with any allocator (e.g. the tracker's
+// per-frame arena, see FrameArena.h).
 
 #ifndef __MESTIMATOR_H
 #define __MESTIMATOR_H
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <vector>
 
 struct Tukey {
-    inline static double FindSigmaSquared(std::vector<double>& vdErrorSquared);
+    template <class Alloc>
+    inline static double FindSigmaSquared(
+        std::vector<double, Alloc>& vdErrorSquared);
     inline static double SquareRootWeight(double dErrorSquared,
                                           double dSigmaSquared);
     inline static double Weight(double dErrorSquared, double dSigmaSquared);
@@ -24,7 +28,9 @@ struct Tukey {
 };
 
 struct Cauchy {
-    inline static double FindSigmaSquared(std::vector<double>& vdErrorSquared);
+    template <class Alloc>
+    inline static double FindSigmaSquared(
+        std::vector<double, Alloc>& vdErrorSquared);
     inline static double SquareRootWeight(double dErrorSquared,
                                           double dSigmaSquared);
     inline static double Weight(double dErrorSquared, double dSigmaSquared);
@@ -33,7 +39,9 @@ struct Cauchy {
 };
 
 struct Huber {
-    inline static double FindSigmaSquared(std::vector<double>& vdErrorSquared);
+    template <class Alloc>
+    inline static double FindSigmaSquared(
+        std::vector<double, Alloc>& vdErrorSquared);
     inline static double SquareRootWeight(double dErrorSquared,
                                           double dSigmaSquared);
     inline static double Weight(double dErrorSquared, double dSigmaSquared);
@@ -42,7 +50,9 @@ struct Huber {
 };
 
 struct LeastSquares {
-    inline static double FindSigmaSquared(std::vector<double>& vdErrorSquared);
+    template <class Alloc>
+    inline static double FindSigmaSquared(
+        std::vector<double, Alloc>& vdErrorSquared);
     inline static double SquareRootWeight(double dErrorSquared,
                                           double dSigmaSquared);
     inline static double Weight(double dErrorSquared, double dSigmaSquared);
@@ -73,7 +83,9 @@ inline double Tukey::ObjectiveScore(double dErrorSquared,
     return (1.0 - d * d * d);
 }
 
-inline double Tukey::FindSigmaSquared(std::vector<double>& vdErrorSquared) {
+template <class Alloc>
+inline double Tukey::FindSigmaSquared(
+    std::vector<double, Alloc>& vdErrorSquared) {
     double dSigmaSquared;
     assert(vdErrorSquared.size() > 0);
     std::sort(vdErrorSquared.begin(), vdErrorSquared.end());
@@ -104,7 +116,9 @@ inline double Cauchy::ObjectiveScore(double dErrorSquared,
     return log(1.0 + dErrorSquared / dSigmaSquared);
 }
 
-inline double Cauchy::FindSigmaSquared(std::vector<double>& vdErrorSquared) {
+template <class Alloc>
+inline double Cauchy::FindSigmaSquared(
+    std::vector<double, Alloc>& vdErrorSquared) {
     double dSigmaSquared;
     assert(vdErrorSquared.size() > 0);
     std::sort(vdErrorSquared.begin(), vdErrorSquared.end());
@@ -144,7 +158,9 @@ inline double Huber::ObjectiveScore(double dErrorSquared,
     }
 }
 
-inline double Huber::FindSigmaSquared(std::vector<double>& vdErrorSquared) {
+template <class Alloc>
+inline double Huber::FindSigmaSquared(
+    std::vector<double, Alloc>& vdErrorSquared) {
     double dSigmaSquared;
     assert(vdErrorSquared.size() > 0);
     std::sort(vdErrorSquared.begin(), vdErrorSquared.end());
@@ -175,8 +191,9 @@ inline double LeastSquares::ObjectiveScore(double dErrorSquared,
     return dErrorSquared;
 }
 
+template <class Alloc>
 inline double LeastSquares::FindSigmaSquared(
-    std::vector<double>& vdErrorSquared) {
+    std::vector<double, Alloc>& vdErrorSquared) {
     if (vdErrorSquared.size() == 0)
         return 0.0;
     double dSum = 0.0;
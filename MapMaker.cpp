@@ -13,6 +13,7 @@
 #include "Persistence/instances.h"
 
 #include <algorithm>
+#include <chrono>
 #include <fstream>
 
 #include <iostream>
@@ -34,8 +35,14 @@ MapMaker::MapMaker(Map& m, const ATANCamera& cam) : mMap(m), mCamera(cam) {
     pthread = NULL;            // must be NULL the first time it is invoked...
     mbResetRequested = false;  // no reset yet from the tracker....
     flag_IsStopped = true;     // stopped for now....
+    mnKeyFramesFinishing = 0;
+    mnKeyFrameQueueEpoch = 0;
+    mbFinisherStopRequested = false;
     Reset();
 
+    // The keyframe finisher runs for as long as the mapmaker exists
+    pFinisherThread.reset(new std::thread(&MapMaker::FinishKeyFrames, this));
+
     start();  // This class USED TO BE a CVD::thread (that inherited Runnable, etc. etc)
         // Now start() simply instantiates a thread object and sets the appropriate flags
     GUI.RegisterCommand("SaveMap", GUICommandCallBack, this);
@@ -70,7 +77,13 @@ void MapMaker::Reset() {
     mMap.vpKeyFrames
         .clear();  // TODO: actually erase old keyframes - we'll see... no need for now...
 
-    mvpKeyFrameQueue.clear();  // TODO: actually erase old keyframes - Noneed...
+    {
+        // Keyframes still with the finisher belong to the old map; it drops them.
+        std::lock_guard<std::mutex> lock(mKeyFrameQueueMutex);
+        mqKeyFramesToFinish.clear();
+        mvpKeyFrameQueue.clear();  // TODO: actually erase old keyframes - Noneed...
+        mnKeyFrameQueueEpoch++;
+    }
 
     mbBundleRunning = false;
     mbBundleConverged_Full = true;
@@ -119,14 +132,15 @@ void MapMaker::run() {
             continue;
 
         // From here on, mapmaker does various map-maintenance jobs in a certain priority
-        // Hierarchy. For example, if there's a new key-frame to be added (QueueSize() is >0)
-        // then that takes high priority.
+        // Hierarchy. For example, if there's a new key-frame to be added (ReadyQueueSize() is >0)
+        // then that takes high priority. Keyframes still with the finisher don't count yet:
+        // the low-priority work carries on meanwhile.
 
         CHECK_RESET;
 
         cout << "DEBUG: Adjusting recent " << endl;
         // Should we run local bundle adjustment?
-        if (!mbBundleConverged_Recent && QueueSize() == 0) {
+        if (!mbBundleConverged_Recent && ReadyQueueSize() == 0) {
             BundleAdjustRecent();
             //HandleBadPoints();
         }
@@ -134,14 +148,14 @@ void MapMaker::run() {
         CHECK_RESET;
         cout << "DEBUG: Attempting to refind newlymade" << endl;
         // Are there any newly-made map points which need more s from older key-frames?
-        if (mbBundleConverged_Recent && QueueSize() == 0)
+        if (mbBundleConverged_Recent && ReadyQueueSize() == 0)
             ReFindNewlyMade();
 
         CHECK_RESET;
         cout << "DEBUG: Now Bundle adjusting ALL." << endl;
         // Run global bundle adjustment?
         if (mbBundleConverged_Recent && !mbBundleConverged_Full &&
-            QueueSize() == 0) {
+            ReadyQueueSize() == 0) {
             BundleAdjustAll();
             //HandleBadPoints();
         }
@@ -150,7 +164,7 @@ void MapMaker::run() {
         cout << "DEBUG: Refinding from Failure Queue. " << endl;
         // Very low priorty: re-find measurements marked as outliers
         if (mbBundleConverged_Recent && mbBundleConverged_Full &&
-            rand() % 20 == 0 && QueueSize() == 0)
+            rand() % 20 == 0 && ReadyQueueSize() == 0)
             ReFindFromFailureQueue();
         //cout <<"DEBUG: handling bad points."<<endl;
         CHECK_RESET;
@@ -160,8 +174,19 @@ void MapMaker::run() {
         CHECK_RESET;
         cout << "DEBUG: Adding Keyframe from top of queue." << endl;
         // Any new key-frames to be added?
-        if (QueueSize() > 0)
+        if (ReadyQueueSize() > 0)
             AddKeyFrameFromTopOfQueue();  // Integrate into map data struct, and process
+        else if (QueueSize() > 0 && mbBundleConverged_Recent &&
+                 mbBundleConverged_Full) {
+            // Nothing left to do but wait for the finisher. Resets and stops only raise
+            // flags, hence the timeout.
+            std::unique_lock<std::mutex> lock(mKeyFrameQueueMutex);
+            mcvKeyFrameFinished.wait_for(
+                lock, std::chrono::milliseconds(20), [this] {
+                    return !mvpKeyFrameQueue.empty() || mbResetRequested ||
+                           flag_StopRequest;
+                });
+        }
     }
 
     flag_IsStopped = true;  // leaving the main loop function
@@ -243,6 +268,12 @@ MapMaker::~MapMaker() {
         cout << "Waiting for mapmaker to exit the main loop.." << endl;
         pthread->join();
     }
+    {
+        std::lock_guard<std::mutex> lock(mKeyFrameQueueMutex);
+        mbFinisherStopRequested = true;
+    }
+    mcvKeyFramesToFinish.notify_one();
+    pFinisherThread->join();
     cout << "Mapmaker destroyed..." << endl;
 
     //delete pthread;
@@ -500,7 +531,7 @@ cv::Vec<float, 3> MapMaker::ReconstructPoint2Views(
   //
   // Btw, we need a PatchFinder to refine (or possiblty reject a few points)
   // to sub-pixel accuracy.
-  PatchFinder finder;
+  PatchFinder<> finder;
 
   for(unsigned int i=0; i<vMatches.size(); i++) {
       // NOTE!!! "_NEC" postfix stands for : "Normalized Euclidean Coordinates"
@@ -775,20 +806,71 @@ void MapMaker::ApplyGlobalScaleToMap(double dScale) {
 void MapMaker::AddKeyFrame(KeyFrame::Ptr pKF) {
     pKF->pSBI =
         NULL;  // Mapmaker uses a different SBI than the tracker, so will re-gen its own
-    mvpKeyFrameQueue.push_back(pKF);
-    if (mbBundleRunning)  // Tell the mapmaker to stop doing low-priority stuff and concentrate on this KF first.
-        mbBundleAbortRequested = true;
+    {
+        // Off to the finisher first (see FinishKeyFrames)
+        std::lock_guard<std::mutex> lock(mKeyFrameQueueMutex);
+        mqKeyFramesToFinish.push_back(pKF);
+    }
+    mcvKeyFramesToFinish.notify_one();
+    // The mapmaker keeps bundle adjusting until the finisher is done with it
+}
+
+int MapMaker::QueueSize() {
+    std::lock_guard<std::mutex> lock(mKeyFrameQueueMutex);
+    return (int)(mqKeyFramesToFinish.size() + mnKeyFramesFinishing +
+                 mvpKeyFrameQueue.size());
+}
+
+int MapMaker::ReadyQueueSize() {
+    std::lock_guard<std::mutex> lock(mKeyFrameQueueMutex);
+    return (int)mvpKeyFrameQueue.size();
+}
+
+// The finisher thread: takes the keyframes in the order the tracker handed them over,
+// does everything the tracker did not (MakeKeyFrame_Rest: non-max suppression, candidates,
+// gradients, SBI) and puts them on the mapmaker's queue.
+void MapMaker::FinishKeyFrames() {
+    std::unique_lock<std::mutex> lock(mKeyFrameQueueMutex);
+    while (true) {
+        mcvKeyFramesToFinish.wait(lock, [this] {
+            return mbFinisherStopRequested || !mqKeyFramesToFinish.empty();
+        });
+        if (mbFinisherStopRequested)
+            return;
+
+        KeyFrame::Ptr pKF = mqKeyFramesToFinish.front();
+        mqKeyFramesToFinish.pop_front();
+        int nEpoch = mnKeyFrameQueueEpoch;
+        mnKeyFramesFinishing++;
+
+        lock.unlock();
+        pKF->MakeKeyFrame_Rest();
+        lock.lock();
+
+        mnKeyFramesFinishing--;
+        if (nEpoch == mnKeyFrameQueueEpoch) {  // i.e., no reset in the meantime
+            mvpKeyFrameQueue.push_back(pKF);
+            mcvKeyFrameFinished.notify_one();
+            if (mbBundleRunning)  // Tell the mapmaker to stop doing low-priority stuff and concentrate on this KF first.
+                mbBundleAbortRequested = true;
+        }
+    }
 }
 
 // Mapmaker's code to handle incoming key-frames.
 void MapMaker::AddKeyFrameFromTopOfQueue() {
     cout << "DEBUG: Adding KF from Top of Queue" << endl;
-    if (mvpKeyFrameQueue.size() == 0)
-        return;
-
-    KeyFrame::Ptr pKF = mvpKeyFrameQueue[0];
-    mvpKeyFrameQueue.erase(mvpKeyFrameQueue.begin());
-    pKF->MakeKeyFrame_Rest();
+    KeyFrame::Ptr pKF;
+    {
+        // Keyframes still being finished are not there yet; we'll be back soon.
+        std::lock_guard<std::mutex> lock(mKeyFrameQueueMutex);
+        if (mvpKeyFrameQueue.size() == 0)
+            return;
+
+        pKF = mvpKeyFrameQueue[0];
+        mvpKeyFrameQueue.erase(mvpKeyFrameQueue.begin());
+    }
+    // MakeKeyFrame_Rest() has already been done by the finisher
     mMap.vpKeyFrames.push_back(pKF);
     // Any measurements? Update the relevant point's measurement counter status map
     for (meas_it ipMP_Meas = pKF->mMeasurements.begin();
@@ -801,10 +883,10 @@ void MapMaker::AddKeyFrameFromTopOfQueue() {
     // And maybe we missed some - this now adds to the map itself, too.
     ReFindInSingleKeyFrame(pKF);
 
-    AddSomeMapPoints(3);  // .. and add more map points by epipolar search.
-    AddSomeMapPoints(0);
-    AddSomeMapPoints(1);
-    AddSomeMapPoints(2);
+    // .. and add more map points by epipolar search, coarsest level first.
+    AddSomeMapPoints(LEVELS - 1);
+    for (int l = 0; l < LEVELS - 1; l++)
+        AddSomeMapPoints(l);
 
     mbBundleConverged_Full = false;
     mbBundleConverged_Recent = false;
@@ -952,7 +1034,7 @@ bool MapMaker::AddPointEpipolar(KeyFrame::Ptr pKFSrc, KeyFrame::Ptr pKFTarget,
         dMaxLen = 2.0;
 
     // Find current-frame corners which might match this
-    PatchFinder Finder;
+    PatchFinder<> Finder;
     Finder.MakeTemplateCoarseNoWarp(pKFSrc, nLevel, irLevelPos);
     if (Finder.TemplateBad())
         return false;
@@ -977,11 +1059,13 @@ bool MapMaker::AddPointEpipolar(KeyFrame::Ptr pKFSrc, KeyFrame::Ptr pKFTarget,
         pKFTarget->aLevels[nLevel].bImplaneCornersCached = true;
     }
 
-    int nBest = -1;
-    int nBestZMSSD = Finder.mnMaxSSD + 1;
     double dMaxDistDiff = mCamera.OnePixelDist() * (4.0 + 1.0 * nLevelScale);
     double dMaxDistSq = dMaxDistDiff * dMaxDistDiff;
 
+    // Corners along the epipolar line (and their indices); they are all scored in one go
+    mvEpiCorners.clear();
+    mvEpiCornerIndices.clear();
+
     for (unsigned int i = 0; i < vv2Corners.size();
          i++) {  // over all corners in target img..
 
@@ -993,17 +1077,17 @@ bool MapMaker::AddPointEpipolar(KeyFrame::Ptr pKFSrc, KeyFrame::Ptr pKFTarget,
             continue;  // skip if not far enough along line
         if (v2Im.dot(v2AlongProjectedLine) > dMaxLen)
             continue;  // or too far
-        int nZMSSD = Finder.ZMSSDAtPoint(pKFTarget->aLevels[nLevel].im, vIR[i]);
-
-        if (nZMSSD < nBestZMSSD) {
-
-            nBest = i;
-            nBestZMSSD = nZMSSD;
-        }
+        mvEpiCorners.push_back(vIR[i]);
+        mvEpiCornerIndices.push_back(i);
     }
 
-    if (nBest == -1)
+    int nBestZMSSD, nSecondBestZMSSD;
+    int nBest = Finder.ZMSSDAtPoints(pKFTarget->aLevels[nLevel].im, mvEpiCorners,
+                                     nBestZMSSD, nSecondBestZMSSD);
+
+    if (nBest == -1 || nBestZMSSD > Finder.mnMaxSSD)
         return false;  // Nothing found.
+    nBest = mvEpiCornerIndices[nBest];
 
     //  Found a likely candidate along epipolar ray!!!!
 
@@ -1076,6 +1160,8 @@ bool MapMaker::AddPointEpipolar(KeyFrame::Ptr pKFSrc, KeyFrame::Ptr pKFTarget,
     // These translation will be necessary to work-out local affine distortion in a subsequent
     // tracked location of the feature in another KF.
     pNew->RefreshPixelVectors();
+    // Keep a copy of the source pixels with the point, for template warping
+    pNew->CacheSourcePatch();
 
     // register the mappoint in the map
     mMap.vpPoints.push_back(pNew);
@@ -1507,7 +1593,7 @@ bool MapMaker::ReFind_Common(KeyFrame::Ptr pKF, MapPoint::Ptr pMP) {
         pMP->pMMData->sNeverRetryKFs.count(pKF))
         return false;
 
-    static PatchFinder Finder;
+    static PatchFinder<> Finder;
     // get the Map point in the KFs camera coodinate frame (this was delivered in a silver platter by the tracker)
     cv::Vec<float, 3> v3Cam = pKF->se3CfromW * pMP->v3WorldPos;
 
@@ -1640,7 +1726,7 @@ void MapMaker::ReFindNewlyMade() {
     int nFound = 0;
     int nBad = 0;
 
-    while (!mqNewQueue.empty() && mvpKeyFrameQueue.size() == 0) {
+    while (!mqNewQueue.empty() && ReadyQueueSize() == 0) {
 
         MapPoint::Ptr pNew = mqNewQueue.front();
         mqNewQueue.pop();
@@ -17,6 +17,9 @@
 #include "KeyFrame.h"
 #include "Map.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <queue>
 
 #include <thread>
@@ -61,9 +64,7 @@ class MapMaker {
         KeyFrame::Ptr k);  // Add a key-frame to the map. Called by the tracker.
     void RequestReset();   // Request that the we reset. Called by the tracker.
     bool ResetDone();      // Returns true if the has been done.
-    int QueueSize() {
-        return mvpKeyFrameQueue.size();
-    }  // How many KFs in the queue waiting to be added?
+    int QueueSize();  // How many KFs (finished or not) are waiting to be added?
     bool NeedNewKeyFrame(
         KeyFrame::Ptr
             kCurrent);  // Is it a good camera pose to add another KeyFrame?
@@ -82,6 +83,22 @@ class MapMaker {
     bool flag_StopRequest;  // this flag tells the thread to stop
     bool flag_IsStopped;    // indicates whether the mapmaker is running pr not
 
+    // Keyframe finishing stage: a second thread runs MakeKeyFrame_Rest on every keyframe
+    // as soon as the tracker hands it over, so the mapmaker only ever dequeues
+    // keyframes which are ready to be integrated.
+    void FinishKeyFrames();  // The finisher thread code lives here
+    std::shared_ptr<std::thread> pFinisherThread;
+    std::mutex
+        mKeyFrameQueueMutex;  // Guards both keyframe queues and the counters below
+    std::condition_variable mcvKeyFramesToFinish;  // Wakes up the finisher
+    std::condition_variable mcvKeyFrameFinished;  // Wakes up the mapmaker
+    std::deque<KeyFrame::Ptr>
+        mqKeyFramesToFinish;   // Handed over by the tracker, not finished yet
+    int mnKeyFramesFinishing;  // Taken by the finisher, not in mvpKeyFrameQueue yet
+    int mnKeyFrameQueueEpoch;  // Bumped by Reset(): keyframes finished for an older map are dropped
+    bool mbFinisherStopRequested;
+    int ReadyQueueSize();  // How many finished KFs are waiting to be added?
+
     Map& mMap;  // The map
     ATANCamera
         mCamera;  // Same as the tracker's camera: N.B. not a reference variable!
@@ -140,12 +157,16 @@ class MapMaker {
 
     // Member variables:
     std::vector<KeyFrame::Ptr>
-        mvpKeyFrameQueue;  // Queue of keyframes from the tracker waiting to be processed
+        mvpKeyFrameQueue;  // Queue of finished keyframes waiting to be processed
     std::vector<std::pair<KeyFrame::Ptr, std::shared_ptr<MapPoint> > >
         mvFailureQueue;  // Queue of failed observations to re-find
     std::queue<std::shared_ptr<MapPoint> >
         mqNewQueue;  // Queue of newly-made map points to re-find in other KeyFrames
 
+    // Scratch space for AddPointEpipolar (kept to avoid re-allocations)
+    std::vector<cv::Point2i> mvEpiCorners;  // Corners along the epipolar line
+    std::vector<int> mvEpiCornerIndices;    // Their indices in the corner list
+
     double
         mdWiggleScale;  // Metric distance between the first two KeyFrames (copied from GVar)
                         // This sets the scale of the map
@@ -253,7 +274,7 @@ bool MapMaker::InitFromStereo(
     //
     // Btw, we need a PatchFinder to refine (or possibly reject a few points)
     // to sub-pixel accuracy.
-    PatchFinder finder;
+    PatchFinder<> finder;
 
     for (unsigned int i = 0; i < vMatches.size(); i++) {
         // NOTE!!! "_NEC" postfix stands for : "Normalized Euclidean Coordinates"
@@ -290,6 +311,7 @@ bool MapMaker::InitFromStereo(
         p->v3OneRightFromCenter_NEC =
             CvUtils::normalize(p->v3OneRightFromCenter_NEC);
         p->RefreshPixelVectors();
+        p->CacheSourcePatch();
 
         // ************ The following does subpixel refinement ofthe feature location ****************
         //
@@ -408,12 +430,11 @@ bool MapMaker::InitFromStereo(
 
     // add points from the 1st pyramid level (epipolar search)
     AddSomeMapPoints(0);
-    // add points from the 4th pyramid level (epipolar search)
-    AddSomeMapPoints(3);
-    // add points from the 3d pyramid level (epipolar search)
-    AddSomeMapPoints(1);
-    // add points from the 2nd pyramid level (epipolar search)
-    AddSomeMapPoints(2);
+    // add points from the coarsest pyramid level (epipolar search)
+    AddSomeMapPoints(LEVELS - 1);
+    // add points from the levels in between (epipolar search)
+    for (int l = 1; l < LEVELS - 1; l++)
+        AddSomeMapPoints(l);
 
     mbBundleConverged_Full = false;
     mbBundleConverged_Recent = false;
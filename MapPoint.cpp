@@ -79,3 +79,16 @@ void MapPoint::RefreshPixelVectors() {
     v3PixelGoRight_W = Rt * (v3OneRightOnPlane_C - v3CenterOnPlane_C);
     v3PixelGoDown_W = Rt * (v3OneDownOnPlane_C - v3CenterOnPlane_C);
 }
+
+void MapPoint::CacheSourcePatch() {
+    const cv::Mat_<uchar>& im = pPatchSourceKF->aLevels[nSourceLevel].im;
+    cv::Rect irWanted(irCenter.x - nSourcePatchSize / 2,
+                      irCenter.y - nSourcePatchSize / 2, nSourcePatchSize,
+                      nSourcePatchSize);
+    irSourcePatchRect = irWanted & cv::Rect(0, 0, im.cols, im.rows);
+    if (irSourcePatchRect.area() == 0)
+        return;
+
+    cv::Mat_<uchar> imPatch = SourcePatch();
+    im(irSourcePatchRect).copyTo(imPatch);  // Same size, so straight into aSourcePatch
+}
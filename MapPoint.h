@@ -47,6 +47,19 @@ struct MapPoint {
     cv::Point2i
         irCenter;  // This is in level-coords in the source pyramid level
 
+    // The point's own copy of the source level pixels around irCenter (clipped to the level image).
+    // Warping the point's template (PatchFinder::MakeTemplateCoarseCont) reads these few contiguous
+    // bytes instead of rows scattered all over the source keyframe's image, which only it
+    // falls back to when the warped template reaches beyond the copy.
+    static const int nSourcePatchSize = 32;
+    unsigned char aSourcePatch[nSourcePatchSize][nSourcePatchSize];
+    cv::Rect irSourcePatchRect;  // The region copied, in source level coords (empty: no copy)
+    void CacheSourcePatch();  // Makes the copy; needs pPatchSourceKF, nSourceLevel and irCenter
+    inline cv::Mat_<uchar> SourcePatch() {  // Header for the copy (no copying)
+        return cv::Mat_<uchar>(irSourcePatchRect.height, irSourcePatchRect.width,
+                               &aSourcePatch[0][0], nSourcePatchSize);
+    }
+
     // What follows next is a bunch of intermediate vectors - they all lead up
     // to being able to calculate v3PixelGo{Down,Right}_W, which the PatchFinder
     // needs for patch warping!
@@ -5,6 +5,7 @@
 // Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
 
 #include "MiniPatch.h"
+#include "PatchKernels.h"
 
 using namespace std;
 using namespace cv;
@@ -17,25 +18,9 @@ inline int MiniPatch::SSDAtPoint(cv::Mat_<uchar>& im, const cv::Point2i& ir) {
 
     cv::Point2i irImgBase(ir.x - mnHalfPatchSize, ir.y - mnHalfPatchSize);
 
-    int nRows = mimOrigPatch.rows;
-    int nCols = mimOrigPatch.cols;
-    uchar* imagepointer;
-    uchar* templatepointer;
-    int nDiff;
-    int nSumSqDiff = 0;
-    for (int nRow = 0; nRow < nRows; nRow++) {
-
-        imagepointer = im.ptr<uchar>(irImgBase.y + nRow, irImgBase.x);
-        templatepointer = mimOrigPatch.ptr<uchar>(nRow);
-
-        for (int nCol = 0; nCol < nCols; nCol++) {
-
-            nDiff = imagepointer[nCol] - templatepointer[nCol];
-            nSumSqDiff += nDiff * nDiff;
-        }
-    }
-
-    return nSumSqDiff;
+    return PatchKernels::SSD(im.ptr<uchar>(irImgBase.y, irImgBase.x), im.step,
+                             mimOrigPatch.data, mimOrigPatch.step,
+                             mimOrigPatch.rows, mimOrigPatch.cols);
 }
 
 // Find a patch by searching at FAST corners in an input image
@@ -10,32 +10,49 @@
 #include "GCVD/Addedutils.h"
 #include "GCVD/image_interpolate.h"
 
-// This stuff is ghenerally available these days. GNU has it, I guess MSVC has it as well...
-#if USE_XMMINTRIN
-#include <xmmintrin.h>
-#endif
+#include "PatchKernels.h"
+
+#include "Persistence/instances.h"
+
+#include <cstring>
 
 using namespace std;
-// Note that the patchfinder sets-up an 8x8 patch by default which is a brand new empty thing....
-PatchFinder::PatchFinder(int nPatchSize)
-    : mimTemplate(cv::Mat_<uchar>(nPatchSize, nPatchSize)) {
+using namespace Persistence;
+
+// Out-of-class definitions of the compile-time geometry (in case anything binds them to a reference)
+template <int N>
+constexpr int PatchFinder<N>::nPatchSize;
+template <int N>
+constexpr int PatchFinder<N>::nHalfSize;
+template <int N>
+constexpr int PatchFinder<N>::nSubPixBorder;
+template <int N>
+constexpr int PatchFinder<N>::nInterior;
+template <int N>
+constexpr int PatchFinder<N>::nSubPixStride;
+
+// The template geometry lives in the type; the template itself is a brand new empty thing....
+template <int N>
+PatchFinder<N>::PatchFinder() {
 
-    mnPatchSize = nPatchSize;
     // Just for the aid of anyone trying to decipher the code,
-    // REMEMBER! mirCenter is simply HALF the size the of the Patch!!!!!
-    mirCenter = cv::Point2i(nPatchSize / 2, nPatchSize / 2);
+    // REMEMBER! The template center (nHalfSize) is simply HALF the size the of the Patch!!!!!
     int nMaxSSDPerPixel =
         500;  // TODO: Find nominal values and make it persistent!
-    mnMaxSSD = mnPatchSize * mnPatchSize * nMaxSSDPerPixel;
+    mnMaxSSD = nPatchSize * nPatchSize * nMaxSSDPerPixel;
     // Initialize sthe warping matrix cache.
     mm2LastWarpMatrix = 9999.9 * cv::Matx<float, 2, 2>::eye();
     mpLastTemplateMapPoint = NULL;
+    mnLastTemplateAge = 0;
+    mnTemplateSourceLevel = 0;
 }
 
 // Find the warping matrix and search level
 // m2CamDerivs：地图点投影关于归一化平面点的导数
-int PatchFinder::CalcSearchLevelAndWarpMatrix(
-    MapPoint::Ptr pMP, SE3<> se3CFromW, cv::Matx<float, 2, 2>& m2CamDerivs) {
+template <int N>
+int PatchFinder<N>::CalcSearchLevelAndWarpMatrix(
+    MapPoint::Ptr pMP, SE3<> se3CFromW, cv::Matx<float, 2, 2>& m2CamDerivs,
+    int nMinLevel) {
     // Calc point pos in new view camera frame
     // Slightly dumb that we re-calculate this here when the tracker's already done this!
     // 地图点投影到当前帧，并获取逆深度
@@ -158,13 +175,19 @@ int PatchFinder::CalcSearchLevelAndWarpMatrix(
     if (dDet > 3 || dDet < 0.25) {
         mbTemplateBad = true;
         return -1;
-    } else
-        return mnSearchLevel;
+    }
+
+    // Reduced resolution: the template is simply made at the coarser level's scale
+    // (all positions stay in level-zero coordinates, so nothing else changes).
+    if (mnSearchLevel < nMinLevel)
+        mnSearchLevel = std::min(nMinLevel, LEVELS - 1);
+    return mnSearchLevel;
 }
 
 // This is just a convenience function wich caluclates the warp matrix and generates
 // the template all in one call.
-void PatchFinder::MakeTemplateCoarse(
+template <int N>
+void PatchFinder<N>::MakeTemplateCoarse(
     MapPoint::Ptr pMP, SE3<> se3CFromW,
     cv::Matx<float, 2, 2>& m2CamDerivs /*2x2*/) {
 
@@ -177,7 +200,9 @@ void PatchFinder::MakeTemplateCoarse(
 
 // This function generates the warped search template.
 // NOTE! Should NOT be called if the inverse Warping matrix is singular (i.e., mbTemplateBad == true) !!
-void PatchFinder::MakeTemplateCoarseCont(MapPoint::Ptr pMP) {
+// Returns true if the template made last time was kept.
+template <int N>
+bool PatchFinder<N>::MakeTemplateCoarseCont(MapPoint::Ptr pMP) {
     // Get the warping matrix appropriate for use with CVD::transform...
 
     // 产生源关键帧到当前帧的映射，目的是抵消仿射变换的影响，以正确匹配特征点邻域
@@ -190,8 +215,14 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint::Ptr pMP) {
 
     // Optimisation: Don't re-gen the coarse template if it's going to be substantially the
     // same as was made last time. This saves time when the camera is not moving. For this,
-    // check that (a) this patchfinder is still working on the same map point and (b) the
-    // warping matrix has not changed much.
+    // check that (a) this patchfinder is still working on the same map point, (b) the
+    // warping matrix has not drifted too far from the one the template was made with and
+    // (c) the template has not been reused too many times already (if there's a limit).
+    static pvar3<double> gvdReuseTolerance(
+        "PatchFinder.TemplateReuseTolerance", 0.07,
+        SILENT);  // 0.07 sort of works out as half a pixel displacement in src img
+    static pvar3<int> gvnReuseMaxAge("PatchFinder.TemplateReuseMaxAge", 0,
+                                     SILENT);  // 0: no limit
 
     // 是否需要更新匹配模板
     bool bNeedToRefreshTemplate = false;
@@ -200,19 +231,24 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint::Ptr pMP) {
     if (pMP != mpLastTemplateMapPoint)
         bNeedToRefreshTemplate = true;
 
+    if (*gvnReuseMaxAge > 0 && mnLastTemplateAge >= *gvnReuseMaxAge)
+        bNeedToRefreshTemplate = true;
+
     // Still the same map point? Then compare warping matrix..
+    const double dRefreshLimit = *gvdReuseTolerance;
     for (int i = 0; !bNeedToRefreshTemplate && i < 2; i++) {
 
         //Vector<2> v2Diff = m2.T()[i] - mm2LastWarpMatrix.T()[i];
         cv::Vec<float, 2> v2Diff(m2(0, i) - mm2LastWarpMatrix(0, i),
                                  m2(1, i) - mm2LastWarpMatrix(1, i));
-        const double dRefreshLimit =
-            0.07;  // Sort of works out as half a pixel displacement in src img
         if (v2Diff[0] * v2Diff[0] + v2Diff[1] * v2Diff[1] >
             dRefreshLimit * dRefreshLimit)
             bNeedToRefreshTemplate = true;
     }
 
+    if (!bNeedToRefreshTemplate)
+        mnLastTemplateAge++;
+
     // Need to regen template? Then go ahead.
     if (bNeedToRefreshTemplate) {
 
@@ -221,12 +257,27 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint::Ptr pMP) {
 
         // 执行仿射变换
         // mimTemplate 是变换后的模板
-        nOutside = CvUtils::transform(
-            pMP->pPatchSourceKF->aLevels[pMP->nSourceLevel].im, mimTemplate, m2,
-            cv::Vec<float, 2>(pMP->irCenter.x, pMP->irCenter.y),
-            cv::Vec<float, 2>(
-                mirCenter.x,
-                mirCenter.y));  // 模板中心，[8x8]和[11x11]的patch中心肯定不一样
+        cv::Mat_<uchar> imTemplate = TemplateImage();
+        static pvar3<int> gvnUseSourcePatch("PatchFinder.UseSourcePatchCache",
+                                            1, SILENT);
+        nOutside = 1;
+        // Warp from the point's own copy of its source pixels if it has one...
+        if (*gvnUseSourcePatch && pMP->irSourcePatchRect.area() > 0) {
+            const cv::Rect& irRect = pMP->irSourcePatchRect;
+            nOutside = PatchKernels::WarpAffine(
+                pMP->SourcePatch(), imTemplate, m2,
+                cv::Vec<float, 2>(pMP->irCenter.x - irRect.x,
+                                  pMP->irCenter.y - irRect.y),
+                cv::Vec<float, 2>(nHalfSize, nHalfSize));
+        }
+        // ... and from the source keyframe if not, or if the warp needs more than the copy.
+        if (nOutside)
+            nOutside = PatchKernels::WarpAffine(
+                pMP->pPatchSourceKF->aLevels[pMP->nSourceLevel].im, imTemplate,
+                m2, cv::Vec<float, 2>(pMP->irCenter.x, pMP->irCenter.y),
+                cv::Vec<float, 2>(
+                    nHalfSize,
+                    nHalfSize));  // 模板中心，[8x8]和[11x11]的patch中心肯定不一样
 
         // nOutside记录了经过仿射变换后，超过图像范围的数量，理论上应该为0才行
         if (nOutside)
@@ -234,19 +285,25 @@ void PatchFinder::MakeTemplateCoarseCont(MapPoint::Ptr pMP) {
         else
             mbTemplateBad = false;
 
+        // Warped pixels: no level gradients to borrow
+        mpTemplateSourceKF.reset();
+
         MakeTemplateSums();
 
         // Store the parameters which allow us to determine if we need to re-calculate
         // the patch next time round.
         mpLastTemplateMapPoint = pMP;
         mm2LastWarpMatrix = m2;
+        mnLastTemplateAge = 0;
     }
+    return !bNeedToRefreshTemplate;
 }
 
 // This makes a template without warping.
 // It basically copies the mage patch around the feature position
 // into the template image ("mimTemplate").
-void PatchFinder::MakeTemplateCoarseNoWarp(KeyFrame::Ptr pKF, int nLevel,
+template <int N>
+void PatchFinder<N>::MakeTemplateCoarseNoWarp(KeyFrame::Ptr pKF, int nLevel,
                                            cv::Point2i irLevelPos) {
 
     mnSearchLevel = nLevel;
@@ -254,56 +311,50 @@ void PatchFinder::MakeTemplateCoarseNoWarp(KeyFrame::Ptr pKF, int nLevel,
     cv::Mat_<uchar> im =
         pKF->aLevels[nLevel].im;  // n.b. This is a reference assignment ...
     if (!CvUtils::in_image_with_border(irLevelPos.y, irLevelPos.x, im,
-                                       mnPatchSize / 2 + 1,
-                                       mnPatchSize / 2 + 1)) {
+                                       nSubPixBorder, nSubPixBorder)) {
 
         mbTemplateBad = true;
         return;
     }
     mbTemplateBad = false;
 
-    // So now copying im from (irLevelPose - mirCenter) onto mimTemplate
+    // So now copying im from (irLevelPose - template center) onto mimTemplate
     // which should give us the lower-right quadrant of im inside mimTemplate
-    int nOffsetRow = irLevelPos.y - mirCenter.y,
-        nOffsetCol = irLevelPos.x - mirCenter.x;
+    int nOffsetRow = irLevelPos.y - nHalfSize,
+        nOffsetCol = irLevelPos.x - nHalfSize;
     assert(nOffsetRow >= 0 && nOffsetCol >= 0 &&
-           "irLevelPos - mirCenter DID not give positive stuff back! Look me "
+           "irLevelPos - template center DID not give positive stuff back! Look me "
            "up in MakeTemplateCoarseNoWarp");
 
     // 获取关键帧的模板
-    im(cv::Range(nOffsetRow, nOffsetRow + mimTemplate.rows),
-       cv::Range(nOffsetCol, nOffsetCol + mimTemplate.cols))
-        .copyTo(mimTemplate);
+    for (int r = 0; r < N; r++)
+        memcpy(mimTemplate[r], im.ptr<uchar>(nOffsetRow + r) + nOffsetCol, N);
+
+    // Remember where the pixels came from, so that prepSubPixGNStep can use the level gradients
+    mpTemplateSourceKF = pKF;
+    // ... and that this is no longer the last warped template
+    mpLastTemplateMapPoint = NULL;
+    mnTemplateSourceLevel = nLevel;
+    mirTemplateSourceTopLeft = cv::Point2i(nOffsetCol, nOffsetRow);
 
     // just compute sum and squared sum...
     MakeTemplateSums();
 }
 
 // Convenient wrapper for the above
-void PatchFinder::MakeTemplateCoarseNoWarp(MapPoint::Ptr pMP) {
+template <int N>
+void PatchFinder<N>::MakeTemplateCoarseNoWarp(MapPoint::Ptr pMP) {
     MakeTemplateCoarseNoWarp(pMP->pPatchSourceKF, pMP->nSourceLevel,
                              pMP->irCenter);
 }
 
 // Finds the sum, and sum-squared, of template pixels. These sums are used
 // to calculate the ZMSSD.
-inline void PatchFinder::MakeTemplateSums() {
-    int nSum = 0;
-    int nSumSq = 0;
-    int r, c;
-    for (r = 0; r < mimTemplate.rows; r++) {
-
-        uchar* pTempImRow = mimTemplate.ptr<uchar>(r);
-
-        for (c = 0; c < mimTemplate.cols; c++) {
-            int imbyte = pTempImRow[c];
-            nSum += imbyte;
-            nSumSq += imbyte * imbyte;
-        }
-    }
+template <int N>
+inline void PatchFinder<N>::MakeTemplateSums() {
     // 预计算关键帧地图点patch块的像素和，因为后续计算与当前帧的SSD要用
-    mnTemplateSum = nSum;
-    mnTemplateSumSq = nSumSq;
+    PatchKernels::PatchSums(&mimTemplate[0][0], N, N, N, mnTemplateSum,
+                            mnTemplateSumSq);
 }
 
 // One of the main functions of the class! Looks at the appropriate level of
@@ -311,7 +362,8 @@ inline void PatchFinder::MakeTemplateSums() {
 // which are within radius nRange of the center. (Params are supplied in Level0
 // coords.) Returns true on patch found.
 
-bool PatchFinder::FindPatchCoarse(cv::Vec<float, 2> v2Pos, KeyFrame::Ptr pKF,
+template <int N>
+bool PatchFinder<N>::FindPatchCoarse(cv::Vec<float, 2> v2Pos, KeyFrame::Ptr pKF,
                                   unsigned int nRange) {
 
     mbFound = false;
@@ -339,6 +391,7 @@ bool PatchFinder::FindPatchCoarse(cv::Vec<float, 2> v2Pos, KeyFrame::Ptr pKF,
     // 注意：不要被变量名pKF迷惑，因为PTAM没有普通帧的概念，
     // 这里的pKF就是普通帧
     Level& L = pKF->aLevels[mnSearchLevel];
+    L.DetectCorners();  // First search on this level of this frame?
 
     // Some bounds checks on the bounding box..
     if (nTop < 0)
@@ -364,8 +417,7 @@ bool PatchFinder::FindPatchCoarse(cv::Vec<float, 2> v2Pos, KeyFrame::Ptr pKF,
         // or at the bottom row (inclusive - hence , +1) in "nBottomPlusOne"/
         iLastCorner = L.vCorners.begin() + L.vCornerRowLUT[nBottomPlusOne];
 
-    cv::Point2i irBest;           // Best match so far
-    int nBestSSD = mnMaxSSD + 1;  // Best score so far is beyond the max allowed
+    mvCandidates.clear();
 
     // 遍历匹配范围内所有的Fast角点
     for (; iCorner < iLastCorner; iCorner++) {  // For each corner ...
@@ -381,22 +433,18 @@ bool PatchFinder::FindPatchCoarse(cv::Vec<float, 2> v2Pos, KeyFrame::Ptr pKF,
             nRange * nRange)
             continue;
 
-        // Great! Corner is good so far...
-        int nSSD;
-        // Now find tghe zero mean Sum of Squared Differences
-        // 计算SSD，传入当前帧的图像，以及当前帧参与匹配的角点作为中心
-        nSSD = ZMSSDAtPoint(L.im, *iCorner);
-        //cout <<"DEBUG: Patchfinder distance of "<<*iCorner<<" from level image of size "<< L.im.size()<<" is : "<<nSSD<<endl;
-        if (nSSD < nBestSSD) {  // Best yet?
-
-            irBest = *iCorner;
-            nBestSSD = nSSD;
-        }
+        // Great! Corner is good so far... keep it for scoring.
+        mvCandidates.push_back(*iCorner);
     }  // done looping over corners
 
-    if (nBestSSD < mnMaxSSD) {  // Found a valid match?
+    // Now find the zero mean Sum of Squared Differences of all the candidates at once
+    // 计算SSD，传入当前帧的图像，以及当前帧参与匹配的角点作为中心
+    int nBestSSD, nSecondBestSSD;
+    int nBest = ZMSSDAtPoints(L.im, mvCandidates, nBestSSD, nSecondBestSSD);
+
+    if (nBest >= 0 && nBestSSD < mnMaxSSD) {  // Found a valid match?
 
-        mv2CoarsePos = LevelZeroPos(irBest, mnSearchLevel);
+        mv2CoarsePos = LevelZeroPos(mvCandidates[nBest], mnSearchLevel);
         mbFound = true;
     } else
         mbFound = false;
@@ -409,29 +457,56 @@ bool PatchFinder::FindPatchCoarse(cv::Vec<float, 2> v2Pos, KeyFrame::Ptr pKF,
 // in some given pyramid image. The LS vector is [tx; ty; theta; offset]
 // whete [tx, ty] is the 2D translation, theta is the rotation angle and offset (dubbed mean in the code) is
 // a DC offset variable aimed at making the fitting more adaptive.
-void PatchFinder::prepSubPixGNStep() {
+template <int N>
+void PatchFinder<N>::prepSubPixGNStep() {
 
-    mimJacs.create(mimTemplate.rows - 2, mimTemplate.cols - 2);
+    // The planes only cover the (N-2)x(N-2) interior of the template;
+    // the padding must be zero for the kernel
+    memset(mafJacX, 0, sizeof(mafJacX));
+    memset(mafJacY, 0, sizeof(mafJacY));
+    memset(mafJacMask, 0, sizeof(mafJacMask));
+    memset(mafSubPixTemplate, 0, sizeof(mafSubPixTemplate));
 
     float s =
         1.0;  // global LS scaler. I am setting it to 1.0 for now to avoid further entanglements...
 
     cv::Matx<float, 3, 3> m3JtJ = cv::Matx<float, 3, 3>::
         zeros();  // Information matrix / Cumulative Gram-matrix of the pixel gradients.
+    // A copied template has the very same interior gradients as its source level,
+    // and those are (lazily) computed only once per level.
+    Level* pSourceLevel = NULL;
+    if (mpTemplateSourceKF) {
+        pSourceLevel = &mpTemplateSourceKF->aLevels[mnTemplateSourceLevel];
+        pSourceLevel->MakeGradients();
+    }
+
     int r, c;
-    for (r = 1; r < mnPatchSize - 1; r++) {
+    for (r = 1; r < N - 1; r++) {
         // pointers to current, previous and next row of mimTemplate
-        uchar* pTempImRow0 = mimTemplate.ptr<uchar>(r);
-        uchar* pTempImRow_1 = mimTemplate.ptr<uchar>(r - 1);
-        uchar* pTempImRow1 = mimTemplate.ptr<uchar>(r + 1);
-        // pointer to the r-1 row of the gradient image
-        cv::Vec<float, 3>* gRowptr = mimJacs.ptr<cv::Vec<float, 3> >(r - 1);
-
-        for (c = 1; c < mnPatchSize - 1; c++) {
+        const uchar* pTempImRow0 = mimTemplate[r];
+        const uchar* pTempImRow_1 = mimTemplate[r - 1];
+        const uchar* pTempImRow1 = mimTemplate[r + 1];
+        // ... or of the level gradients under row r of the template
+        const short *pGradXRow = NULL, *pGradYRow = NULL;
+        if (pSourceLevel) {
+            pGradXRow =
+                pSourceLevel->imGradX.ptr<short>(mirTemplateSourceTopLeft.y + r) +
+                mirTemplateSourceTopLeft.x;
+            pGradYRow =
+                pSourceLevel->imGradY.ptr<short>(mirTemplateSourceTopLeft.y + r) +
+                mirTemplateSourceTopLeft.x;
+        }
+        for (c = 1; c < N - 1; c++) {
 
             // standard difference image gradient...
-            cv::Vec3f v3Grad(0.5 * (pTempImRow0[c + 1] - pTempImRow0[c - 1]),
-                             0.5 * (pTempImRow1[c] - pTempImRow_1[c]), 1.0);
+            cv::Vec3f v3Grad(0, 0, 1.0);
+            if (pSourceLevel) {
+                v3Grad[0] = 0.5 * pGradXRow[c];
+                v3Grad[1] = 0.5 * pGradYRow[c];
+            } else {
+                v3Grad[0] = 0.5 * (pTempImRow0[c + 1] - pTempImRow0[c - 1]);
+                v3Grad[1] = 0.5 * (pTempImRow1[c] - pTempImRow_1[c]);
+            }
 
             // populate upper triagle of m3JtJ with the gradient gram-matrix
             m3JtJ(0, 0) += v3Grad[0] * v3Grad[0] / s;
@@ -440,7 +515,12 @@ void PatchFinder::prepSubPixGNStep() {
             m3JtJ(1, 1) += v3Grad[1] * v3Grad[1] / s;
             m3JtJ(1, 2) += v3Grad[1] * v3Grad[2] / s;
             m3JtJ(2, 2) += v3Grad[2] * v3Grad[2] / s;
-            gRowptr[c - 1] = (1 / s) * v3Grad;  // store the scaled gradient
+            // store the scaled gradient
+            // (the planes start at template pixel (1, 1))
+            mafJacX[r - 1][c - 1] = v3Grad[0] / s;
+            mafJacY[r - 1][c - 1] = v3Grad[1] / s;
+            mafJacMask[r - 1][c - 1] = v3Grad[2] / s;
+            mafSubPixTemplate[r - 1][c - 1] = pTempImRow0[c];
         }
     }
     // filling-in the lower triangle of m3JtJ
@@ -484,7 +564,8 @@ void PatchFinder::prepSubPixGNStep() {
 // Run G-N position refinement until converrgence (or timeout). Since it should never have
 // to travel more than a pixel's distance, set a max number of iterations;
 // if this is exceeded, consider the IC to have failed.
-bool PatchFinder::IterateSubPixToConvergence(KeyFrame::Ptr pKF, int nMaxIts) {
+template <int N>
+bool PatchFinder<N>::IterateSubPixToConvergence(KeyFrame::Ptr pKF, int nMaxIts) {
     const double dConvLimit = 0.03;
     bool bConverged = false;
     int nIts;
@@ -496,7 +577,7 @@ bool PatchFinder::IterateSubPixToConvergence(KeyFrame::Ptr pKF, int nMaxIts) {
             return false;  // should not happen
 
         if (dUpdateSquared < dConvLimit * dConvLimit)
-            return true;  // unacceptable perturbation
+            return true;  // converged; no need for any more iterations
     }
 
     return false;
@@ -519,7 +600,8 @@ bool PatchFinder::IterateSubPixToConvergence(KeyFrame::Ptr pKF, int nMaxIts) {
 
 // So, IterateSubpix simply does a single G-N step in adjusting the TL corner of the patch
 // Furthermore, it updates the respective estimate in the 0-th level.
-double PatchFinder::IterateSubPix(KeyFrame::Ptr pKF) {
+template <int N>
+double PatchFinder<N>::IterateSubPix(KeyFrame::Ptr pKF) {
     // Store the position of the feature at the current search level.
     // in orther words, "LevelNPose" simply returns the coordinates of an image point
     // at the pyramidal level specified.
@@ -535,20 +617,17 @@ double PatchFinder::IterateSubPix(KeyFrame::Ptr pKF) {
     if (!CvUtils::in_image_with_border(std::round(v2Center[1]),  // row
                                        std::round(v2Center[0]),  // col
                                        im,
-                                       mnPatchSize / 2 + 1,  // width
-                                       mnPatchSize / 2 + 1)  // height
+                                       nSubPixBorder,  // width
+                                       nSubPixBorder)  // height
     )
         return -1.0;  // Negative return value indicates off edge of image
 
     // NOTE:
     //       a) v2Center : Is the position of the point in the current search level (computed above using "LevelNPos()".
-    //       b) mirCenter: IS the CENTER of the Patch, i.e. (mnPatchSize /2 , mnPatchSize/2)!
+    //       b) nHalfSize: IS the CENTER of the Patch, i.e. (N / 2 , N / 2)!
     //
     // So, v2Base ios essentially subpixel coordinates for the UPPER-LEFT corner of the patch !!!!
-    cv::Vec2f v2Base(v2Center[0] - mirCenter.x, v2Center[1] - mirCenter.y);
-
-    // information vector as J'*error accumulator.
-    cv::Vec<float, 3> v3Accum(0, 0, 0);
+    cv::Vec2f v2Base(v2Center[0] - nHalfSize, v2Center[1] - nHalfSize);
 
     // Each template pixel will be compared to an (bilinearly) interpolated target pixel
     // The target value is made using bilinear interpolation as the weighted sum
@@ -570,39 +649,17 @@ double PatchFinder::IterateSubPix(KeyFrame::Ptr pKF) {
 
     cv::Point2i i2Base((int)v2Base[0], (int)v2Base[1]);
 
-    // Loop over template image
-    //unsigned long nRowOffset = kf.aLevels[mnSearchLevel].im.ptr<uchar>(1,0) - kf.aLevels[mnSearchLevel].im.ptr<uchar>(0,0);
-    //unsigned long int nRowOffset = (unsigned long int)kf.aLevels[mnSearchLevel].im.step;
-    int c, r;
-    uchar *pImPatchRow,
-        *pImPatchRow1,  // level patch current and next row pointers for the in the Image
-        *pTempImRow;              // template image row pointer
-    cv::Vec<float, 3>* pGradRow;  // gradient image row pointer
-    // ok, loop
-    for (r = 1; r < mnPatchSize - 1; r++) {
-
-        //pTopLeftPixel = &im[::ir(v2Base) + ImageRef(1,ir.y)]; // n.b. the x=1 offset, as with y
-
-        pImPatchRow = im.ptr<uchar>(i2Base.y + r, i2Base.x);
-        pImPatchRow1 = im.ptr<uchar>(i2Base.y + r + 1, i2Base.x);
-
-        pGradRow = mimJacs.ptr<cv::Vec<float, 3> >(r - 1);
-
-        pTempImRow = mimTemplate.ptr<uchar>(r);
-
-        for (c = 1; c < mnPatchSize - 1; c++) {
-
-            // Interpolate the pixel as a weighted average: fmixTL * p(r, c)   +   fmixTR * p(r, c+1) +
-            //                                             fmixLL * p(r+1, c) +   fmixLR * p(r + 1, c + 1)
-            float fPixel =
-                fMixTL * pImPatchRow[c] + fMixTR * pImPatchRow[c + 1] +
-                fMixBL * pImPatchRow1[c] + fMixBR * pImPatchRow1[c + 1];
-
-            // Update JT*d now...
-            double error = fPixel - pTempImRow[c] + mdMeanDiff;
-            v3Accum += error * pGradRow[c - 1];
-        }
-    }
+    // Loop over the template interior. The kernel starts at the image pixel under
+    // template pixel (1, 1); the border check above guarantees that each row can be
+    // read up to column N + 1 of the patch, i.e. N + 1 pixels on.
+    const float afMix[4] = {fMixTL, fMixTR, fMixBL, fMixBR};
+    float afAccum[3];
+    PatchKernels::SubPixAccumulate(
+        im.ptr<uchar>(i2Base.y + 1, i2Base.x + 1), im.step, N + 1,
+        &mafSubPixTemplate[0][0], &mafJacX[0][0], &mafJacY[0][0],
+        &mafJacMask[0][0], nSubPixStride, nInterior, nInterior,
+        afMix, (float)mdMeanDiff, afAccum);
+    cv::Vec<float, 3> v3Accum(afAccum[0], afAccum[1], afAccum[2]);
 
     // Compute the petrurbation in the TL corner coorindates
     // (not forgetting that we also obtain a perturbation in the DC offset as well)
@@ -618,199 +675,64 @@ double PatchFinder::IterateSubPix(KeyFrame::Ptr pKF) {
 }
 
 /////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////
-//
-//
-//              ZMSSDatpoint, which is SSE optimised, follows
 //
-// The top version is the SSE version for 8x8 patches. It is compiled
-// only if CVD_HAVE_XMMINTRIN is true, also you need to give your
-// compiler the appropriate flags (e.g. -march=core2 -msse3 for g++.)
-// The standard c++ version, which is about half as quick (not a disaster
-// by any means) is below.
+//   ZMSSDAtPoint. The actual arithmetic lives in PatchKernels, which
+//   picks the SSE2/SSSE3/AVX2 (or plain c++) version at run-time.
+//   8x8 templates (the default) take a dedicated unrolled path.
+//   The kernels are one-pass and need the pre-calculated template sums.
 //
-// The 8x8 SSE version looks long because it has been unrolled,
-// it just does the same thing eight times. Both versions are one-pass
-// and need pre-calculated template sums and sum-squares.
-//
-/////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////
 
-#if USE_XMMINTRIN
-// Horizontal sum of uint16s stored in an XMM register
-inline int SumXMM_16(__m128i& target) {
-    unsigned short int sums_store[8];
-    _mm_storeu_si128((__m128i*)sums_store, target);
-    return sums_store[0] + sums_store[1] + sums_store[2] + sums_store[3] +
-           sums_store[4] + sums_store[5] + sums_store[6] + sums_store[7];
-}
-// Horizontal sum of uint32s stored in an XMM register
-inline int SumXMM_32(__m128i& target) {
-    unsigned int sums_store[4];
-    _mm_storeu_si128((__m128i*)sums_store, target);
-    return sums_store[0] + sums_store[1] + sums_store[2] + sums_store[3];
-}
-#endif
-
 // Calculate the Zero-mean SSD of the coarse patch and a target imate at a specific
 // point.
-int PatchFinder::ZMSSDAtPoint(const cv::Mat_<uchar>& im,
+template <int N>
+int PatchFinder<N>::ZMSSDAtPoint(const cv::Mat_<uchar>& im,
                               const cv::Point2i& ir) {
 
-    if (!CvUtils::in_image_with_border(ir.y, ir.x, im, mirCenter.x,
-                                       mirCenter.y))
+    // Pyramid levels carry a guard border of replicated pixels (see LEVEL_GUARD), so the
+    // patch may hang over the image edges as far as that border reaches.
+    const int nBorder = std::max(nHalfSize - CvUtils::readable_border(im), 0);
+    if (!CvUtils::in_image_with_border(ir.y, ir.x, im, nBorder, nBorder))
         return mnMaxSSD + 1;
 
-    cv::Point2i irImgBase(
-        ir.x - mirCenter.x,
-        ir.y - mirCenter.y);  // just the TL corner in the image
-    uchar* imagepointer;
-    uchar* templatepointer;
-
-    int nImageSumSq = 0;
-    int nImageSum = 0;
-    int nCrossSum = 0;
-
-#if USE_XMMINTRIN
-    if (mnPatchSize == 8) {
-        long unsigned int imagepointerincrement;
-
-        __m128i xImageAsEightBytes;
-        __m128i xImageAsWords;
-        __m128i xTemplateAsEightBytes;
-        __m128i xTemplateAsWords;
-        __m128i xZero;
-        __m128i xImageSums;    // These sums are 8xuint16
-        __m128i xImageSqSums;  // These sums are 4xint32
-        __m128i xCrossSums;    // These sums are 4xint32
-        __m128i xProduct;
-
-        xImageSums = _mm_setzero_si128();
-        xImageSqSums = _mm_setzero_si128();
-        xCrossSums = _mm_setzero_si128();
-        xZero = _mm_setzero_si128();
-
-        //imagepointer = &im[irImgBase + ImageRef(0,0)];
-        imagepointer = im.ptr<uchar>(irImgBase.y, irImgBase.x);
-        //templatepointer = &mimTemplate[ImageRef(0,0)];
-        templatepointer = mimTemplate.ptr<uchar>(0, 0);
-        //imagepointerincrement = &im[irImgBase + ImageRef(0,1)] - imagepointer;
-        imagepointerincrement =
-            im.ptr<uchar>(irImgBase.y + 1, irImgBase.x) - imagepointer;
-
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        imagepointer += imagepointerincrement;
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsEightBytes = _mm_load_si128((__m128i*)templatepointer);
-        templatepointer += 16;
-        xTemplateAsWords = _mm_unpacklo_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        imagepointer += imagepointerincrement;
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsWords = _mm_unpackhi_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        imagepointer += imagepointerincrement;
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsEightBytes = _mm_load_si128((__m128i*)templatepointer);
-        templatepointer += 16;
-        xTemplateAsWords = _mm_unpacklo_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        imagepointer += imagepointerincrement;
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsWords = _mm_unpackhi_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        imagepointer += imagepointerincrement;
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsEightBytes = _mm_load_si128((__m128i*)templatepointer);
-        templatepointer += 16;
-        xTemplateAsWords = _mm_unpacklo_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        imagepointer += imagepointerincrement;
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsWords = _mm_unpackhi_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        imagepointer += imagepointerincrement;
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsEightBytes = _mm_load_si128((__m128i*)templatepointer);
-        templatepointer += 16;
-        xTemplateAsWords = _mm_unpacklo_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-        xImageAsEightBytes = _mm_loadl_epi64((__m128i*)imagepointer);
-        xImageAsWords = _mm_unpacklo_epi8(xImageAsEightBytes, xZero);
-        xImageSums = _mm_adds_epu16(xImageAsWords, xImageSums);
-        xProduct = _mm_madd_epi16(xImageAsWords, xImageAsWords);
-        xImageSqSums = _mm_add_epi32(xProduct, xImageSqSums);
-        xTemplateAsWords = _mm_unpackhi_epi8(xTemplateAsEightBytes, xZero);
-        xProduct = _mm_madd_epi16(xImageAsWords, xTemplateAsWords);
-        xCrossSums = _mm_add_epi32(xProduct, xCrossSums);
-
-        nImageSum = SumXMM_16(xImageSums);
-        nCrossSum = SumXMM_32(xCrossSums);
-        nImageSumSq = SumXMM_32(xImageSqSums);
-    } else
-#endif
-    {
-        for (int nRow = 0; nRow < mnPatchSize; nRow++) {
-
-            //imagepointer = &im[irImgBase + ImageRef(0,nRow)];
-            // im是当前帧的图像块
-            imagepointer = im.data + (irImgBase.y + nRow) * im.step +
-                           irImgBase.x /* * elemSize() */;
-
-            //templatepointer = &mimTemplate[ImageRef(0,nRow)];
-            // mimTemplate是关键帧地图点邻域经仿射变换到当前帧的模板
-            templatepointer = mimTemplate.data + nRow * mimTemplate.step;
-            for (int nCol = 0; nCol < mnPatchSize; nCol++) {
-
-                int n = imagepointer[nCol];
-                nImageSum += n;
-                nImageSumSq += n * n;
-                nCrossSum += n * templatepointer[nCol];
-            }
-        }
-    }
+    // just the TL corner in the image
+    const uchar* imagepointer =
+        im.data + (ir.y - nHalfSize) * im.step + (ir.x - nHalfSize);
 
-    int SA = mnTemplateSum;
-    int SB = nImageSum;
     // 返回源关键帧模板与当前帧对应点的匹配SSD值
-    int N = mnPatchSize * mnPatchSize;
-    return ((2 * SA * SB - SA * SA - SB * SB) / N + nImageSumSq +
-            mnTemplateSumSq - 2 * nCrossSum);
+    return PatchKernels::ZMSSD(imagepointer, im.step, &mimTemplate[0][0], N,
+                               N, mnTemplateSum,
+                               mnTemplateSumSq);
+}
+
+// Batched version of the above: the candidates which are far enough from the
+// border are gathered and handed to the kernel in one go.
+template <int N>
+int PatchFinder<N>::ZMSSDAtPoints(const cv::Mat_<uchar>& im,
+                               const vector<cv::Point2i>& vCenters,
+                               int& nBestSSD, int& nSecondBestSSD) {
+    mvCandidatePtrs.clear();
+    mvCandidateIndices.clear();
+    // As in ZMSSDAtPoint, the guard border of a pyramid level relaxes the bounds check
+    const int nBorder = std::max(nHalfSize - CvUtils::readable_border(im), 0);
+    for (unsigned int i = 0; i < vCenters.size(); i++) {
+
+        const cv::Point2i& ir = vCenters[i];
+        if (!CvUtils::in_image_with_border(ir.y, ir.x, im, nBorder, nBorder))
+            continue;
+
+        mvCandidatePtrs.push_back(im.data + (ir.y - nHalfSize) * im.step +
+                                  (ir.x - nHalfSize));
+        mvCandidateIndices.push_back(i);
+    }
+
+    int nBest = PatchKernels::ZMSSDBatch(
+        mvCandidatePtrs.data(), (int)mvCandidatePtrs.size(), im.step,
+        &mimTemplate[0][0], N, N, mnTemplateSum,
+        mnTemplateSumSq, nBestSSD, nSecondBestSSD);
+
+    return nBest < 0 ? -1 : mvCandidateIndices[nBest];
 }
+
+// The production template size (see PatchFinder.h)
+template class PatchFinder<8>;
@@ -31,9 +31,12 @@
 //
 // The patch finder uses zero-mean SSD as its difference metric.
 //
-// Although PatchFinder can use arbitrary-sized search templates (it's determined
-// at construction), the use of 8x8 pixel templates (the default) is highly
-// recommended, as the coarse search for this size is SSE-optimised.
+// PatchFinder is a template on the size N of its NxN search templates, so that the
+// template, the sub-pixel Jacobians and every loop over them are sized at compile time
+// (no heap-allocated matrices per tracked point). Only PatchFinder<8>, the default,
+// is instantiated (in PatchFinder.cpp); 8x8 is highly recommended anyway, as the
+// coarse search for this size has its own unrolled SIMD kernel (see PatchKernels.h).
+// Any other size needs its own explicit instantiation.
 
 #ifndef __PATCHFINDER_H
 #define __PATCHFINDER_H
@@ -47,11 +50,20 @@
 
 using namespace RigidTransforms;
 
+template <int N = 8>
 class PatchFinder {
 
    public:
-    // Constructor defines size of search patch.
-    PatchFinder(int nPatchSize = 8);
+    // Compile-time template geometry
+    static constexpr int nPatchSize = N;  // Size of one side of the matching template.
+    static constexpr int nHalfSize = N / 2;  // The template center (both coordinates)
+    static constexpr int nSubPixBorder =
+        N / 2 + 1;  // Image border the sub-pixel step needs around the center
+    static constexpr int nInterior = N - 2;  // Side of the sub-pixel (interior) block
+    static constexpr int nSubPixStride =
+        (nInterior + 7) / 8 * 8;  // Floats per sub-pixel plane row (SIMD padding)
+
+    PatchFinder();
 
     // Step 1 Function.
     // This calculates the warping matrix appropriate for observing point p
@@ -59,18 +71,21 @@ class PatchFinder {
     // projection derivates at level zero for the point's projection in the new view.
     // It also calculates which pyramid level we should search in, and this is
     // returned as an int. Negative level returned denotes an inappropriate
-    // transformation.
+    // transformation. Points that would be searched below nMinLevel are searched
+    // at nMinLevel instead (with a correspondingly shrunk template).
     int CalcSearchLevelAndWarpMatrix(MapPoint::Ptr p, SE3<> se3CFromW,
-                                     cv::Matx<float, 2, 2>& m2CamDerivs);
+                                     cv::Matx<float, 2, 2>& m2CamDerivs,
+                                     int nMinLevel = 0);
     inline int GetLevel() { return mnSearchLevel; }
     inline int GetLevelScale() { return LevelScale(mnSearchLevel); }
 
     // Step 2 Functions
     // Generates the NxN search template either from the pre-calculated warping matrix,
     // or an identity transformation.
-    void MakeTemplateCoarseCont(
+    bool MakeTemplateCoarseCont(
         MapPoint::Ptr
             p);  // If the warping matrix has already been pre-calced, use this.
+                 // Returns true if it kept the last template (no warping needed).
     void MakeTemplateCoarse(
         MapPoint::Ptr p, SE3<> se3CFromW,
         cv::Matx<float, 2, 2>& m2CamDerivs);  // This also calculates the warp.
@@ -96,6 +111,12 @@ class PatchFinder {
     int ZMSSDAtPoint(
         const cv::Mat_<uchar>& im,
         const cv::Point2i& ir);  // This evaluates the score at one location
+    // This evaluates the score at many locations in one go (the template is
+    // loaded once). Returns the index in vCenters of the best one, or -1 if none could
+    // be scored; the best and second-best scores are returned for ratio tests.
+    int ZMSSDAtPoints(const cv::Mat_<uchar>& im,
+                      const std::vector<cv::Point2i>& vCenters, int& nBestSSD,
+                      int& nSecondBestSSD);
     // Results from step 3:
     // All positions are in the scale of level 0.
     inline cv::Point2i GetCoarsePos() {
@@ -131,16 +152,37 @@ class PatchFinder {
     int mnMaxSSD;  // This is the max ZMSSD for a valid match. It's set in the constructor.
 
    protected:
-    int mnPatchSize;  // Size of one side of the matching template.
-
     // Some values stored for the coarse template:
     int mnTemplateSum;    // Cached pixel-sum of the coarse template
     int mnTemplateSumSq;  // Cached pixel-squared sum of the coarse template
     inline void MakeTemplateSums();  // Calculate above values
 
-    cv::Mat_<uchar> mimTemplate;  // The matching template
-    cv::Mat_<cv::Vec<float, 3> >
-        mimJacs;  // Inverse composition jacobians; stored as floats to save a bit of space.
+    // The matching template, and an OpenCV header for it (no copy, no allocation)
+    alignas(16) uchar mimTemplate[N][N];
+    inline cv::Mat_<uchar> TemplateImage() {
+        return cv::Mat_<uchar>(N, N, &mimTemplate[0][0]);
+    }
+
+    // When the template is a plain copy of keyframe pixels (MakeTemplateCoarseNoWarp),
+    // the level it came from and the template's top-left pixel in it; prepSubPixGNStep
+    // then reads the level's cached gradients instead of differencing the template.
+    // NULL for warped templates.
+    std::shared_ptr<KeyFrame> mpTemplateSourceKF;
+    int mnTemplateSourceLevel;
+    cv::Point2i mirTemplateSourceTopLeft;
+
+    // Scratch space for the batched search (kept to avoid re-allocations)
+    std::vector<cv::Point2i> mvCandidates;        // Corners worth scoring
+    std::vector<const uchar*> mvCandidatePtrs;    // Their patch top-left pixels
+    std::vector<int> mvCandidateIndices;          // Their indices in the input
+    // Inverse composition jacobians; stored as floats to save a bit of space.
+    // One plane per component (the third, DC offset, component is always 1 and its
+    // plane is just a mask) padded with zeros to nSubPixStride for the SIMD kernel.
+    // The template interior is kept in the same float layout.
+    alignas(16) float mafJacX[nInterior][nSubPixStride];
+    alignas(16) float mafJacY[nInterior][nSubPixStride];
+    alignas(16) float mafJacMask[nInterior][nSubPixStride];
+    alignas(16) float mafSubPixTemplate[nInterior][nSubPixStride];
 
     cv::Matx<float, 2, 2> mm2WarpInverse;  // 2x2 Warping matrix
     int mnSearchLevel;                     // Search level in input pyramid
@@ -155,8 +197,6 @@ class PatchFinder {
         // I am using it as cache inside "FindPatchCoarse" for the actual predicted position.
     cv::Vec2f
         mv2CoarsePos;  // In the scale of level 0; hence the use of vector rather than cv::Point2i
-    cv::Point2i
-        mirCenter;  // Quantized location of the center pixel of the NxN pixel template
     bool mbFound;        // Was the patch found?
     bool mbTemplateBad;  // Error during template generation?
 
@@ -165,6 +205,7 @@ class PatchFinder {
         mpLastTemplateMapPoint;  // Which was the last map point this PatchFinder used?
     cv::Matx<float, 2, 2>
         mm2LastWarpMatrix;  // What was the last 2x2 warp matrix this PatchFinder used?
+    int mnLastTemplateAge;  // How many times in a row that template has been reused
 };
 
 #endif
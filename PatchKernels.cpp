@@ -0,0 +1,1689 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+#include "PatchKernels.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PATCHKERNELS_X86 1
+#include <immintrin.h>
+#else
+#define PATCHKERNELS_X86 0
+#endif
+
+namespace PatchKernels {
+
+/////////////////////////////////////////////////////////////////////
+//
+//              Reference (plain c++) kernels
+//
+/////////////////////////////////////////////////////////////////////
+
+static void CrossSumsScalar(const unsigned char* pImage, size_t nImageStep,
+                            const unsigned char* pTemplate,
+                            size_t nTemplateStep, int nRows, int nCols,
+                            int& nImageSum, int& nImageSumSq, int& nCrossSum) {
+    nImageSum = nImageSumSq = nCrossSum = 0;
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pTRow = pTemplate + r * nTemplateStep;
+        for (int c = 0; c < nCols; c++) {
+            int n = pImRow[c];
+            nImageSum += n;
+            nImageSumSq += n * n;
+            nCrossSum += n * pTRow[c];
+        }
+    }
+}
+
+static int SSDScalar(const unsigned char* pImage, size_t nImageStep,
+                     const unsigned char* pTemplate, size_t nTemplateStep,
+                     int nRows, int nCols) {
+    int nSumSqDiff = 0;
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pTRow = pTemplate + r * nTemplateStep;
+        for (int c = 0; c < nCols; c++) {
+            int nDiff = pImRow[c] - pTRow[c];
+            nSumSqDiff += nDiff * nDiff;
+        }
+    }
+    return nSumSqDiff;
+}
+
+static void CrossSumsBatchScalar(const unsigned char* const* ppImage,
+                                 int nCandidates, size_t nImageStep,
+                                 const unsigned char* pTemplate,
+                                 size_t nTemplateStep, int nRows, int nCols,
+                                 int* pnImageSum, int* pnImageSumSq,
+                                 int* pnCrossSum) {
+    for (int i = 0; i < nCandidates; i++)
+        CrossSumsScalar(ppImage[i], nImageStep, pTemplate, nTemplateStep, nRows,
+                        nCols, pnImageSum[i], pnImageSumSq[i], pnCrossSum[i]);
+}
+
+// NOTE: A single accumulator, pixel by pixel in row order (as SmallBlurryImage::ZMSSD
+//       always did). The SIMD versions only compute the squares in parallel and add
+//       them in this very order, so the result does not depend on the instruction set.
+static double SSDFloatScalar(const float* pA, size_t nAStep, const float* pB,
+                             size_t nBStep, int nRows, int nCols) {
+    double dSSD = 0.0;
+    for (int r = 0; r < nRows; r++) {
+        const float* pARow = (const float*)((const char*)pA + r * nAStep);
+        const float* pBRow = (const float*)((const char*)pB + r * nBStep);
+        for (int c = 0; c < nCols; c++) {
+            double dDiff = pARow[c] - pBRow[c];
+            dSSD += dDiff * dDiff;
+        }
+    }
+    return dSSD;
+}
+
+// Columns [nFirstCol, nCols) of the sub-pixel accumulation, one pixel at a time
+static inline void SubPixAccumulateColumns(
+    const unsigned char* pImage, size_t nImageStep, const float* pTemplate,
+    const float* pJacX, const float* pJacY, int nPlaneStride, int nRows,
+    int nFirstCol, int nCols, const float afMix[4], float fMeanDiff,
+    float afAccum[3]) {
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pImRow1 = pImRow + nImageStep;
+        const int nPlaneOffset = r * nPlaneStride;
+        for (int c = nFirstCol; c < nCols; c++) {
+            float fPixel = afMix[0] * pImRow[c] + afMix[1] * pImRow[c + 1] +
+                           afMix[2] * pImRow1[c] + afMix[3] * pImRow1[c + 1];
+            float fError = fPixel - pTemplate[nPlaneOffset + c] + fMeanDiff;
+            afAccum[0] += fError * pJacX[nPlaneOffset + c];
+            afAccum[1] += fError * pJacY[nPlaneOffset + c];
+            afAccum[2] += fError;
+        }
+    }
+}
+
+static void SubPixAccumulateScalar(const unsigned char* pImage,
+                                   size_t nImageStep, int nImageReadable,
+                                   const float* pTemplate, const float* pJacX,
+                                   const float* pJacY, const float* pMask,
+                                   int nPlaneStride, int nRows, int nCols,
+                                   const float afMix[4], float fMeanDiff,
+                                   float afAccum[3]) {
+    afAccum[0] = afAccum[1] = afAccum[2] = 0;
+    SubPixAccumulateColumns(pImage, nImageStep, pTemplate, pJacX, pJacY,
+                            nPlaneStride, nRows, 0, nCols, afMix, fMeanDiff,
+                            afAccum);
+}
+
+// Interior columns [nFirstCol, nCols - 1) of one gradient row
+static inline void GradientRowColumns(const unsigned char* pRow,
+                                      size_t nStep, int nFirstCol, int nCols,
+                                      short* pGradXRow, short* pGradYRow) {
+    for (int c = nFirstCol; c < nCols - 1; c++) {
+        pGradXRow[c] = (short)(pRow[c + 1] - pRow[c - 1]);
+        pGradYRow[c] = (short)(pRow[c + nStep] - pRow[(ptrdiff_t)c - (ptrdiff_t)nStep]);
+    }
+}
+
+// Zeroes the image border of the gradient images
+static void ZeroGradientBorder(int nRows, int nCols, short* pGradX,
+                               short* pGradY, size_t nGradStep) {
+    for (int r = 0; r < nRows; r++) {
+        short* pGradXRow = (short*)((char*)pGradX + r * nGradStep);
+        short* pGradYRow = (short*)((char*)pGradY + r * nGradStep);
+        if (r == 0 || r == nRows - 1) {
+            memset(pGradXRow, 0, nCols * sizeof(short));
+            memset(pGradYRow, 0, nCols * sizeof(short));
+        } else {
+            pGradXRow[0] = pGradYRow[0] = 0;
+            pGradXRow[nCols - 1] = pGradYRow[nCols - 1] = 0;
+        }
+    }
+}
+
+static void CentralGradientsScalar(const unsigned char* pImage, size_t nStep,
+                                   int nRows, int nCols, short* pGradX,
+                                   short* pGradY, size_t nGradStep) {
+    ZeroGradientBorder(nRows, nCols, pGradX, pGradY, nGradStep);
+    for (int r = 1; r < nRows - 1; r++)
+        GradientRowColumns(pImage + r * nStep, nStep, 1, nCols,
+                           (short*)((char*)pGradX + r * nGradStep),
+                           (short*)((char*)pGradY + r * nGradStep));
+}
+
+// Columns [nFirstCol, nCols) of one float gradient row
+static inline void FloatGradientRowColumns(const float* pRow, size_t nStep,
+                                           int nFirstCol, int nCols,
+                                           float fScale, float* pGradRow) {
+    const float* pRowUp = (const float*)((const char*)pRow - nStep);
+    const float* pRowDown = (const float*)((const char*)pRow + nStep);
+    for (int c = nFirstCol; c < nCols; c++) {
+        pGradRow[2 * c] = fScale * (pRow[c + 1] - pRow[c - 1]);
+        pGradRow[2 * c + 1] = fScale * (pRowDown[c] - pRowUp[c]);
+    }
+}
+
+static void FloatGradientsScalar(const float* pImage, size_t nStep, int nRows,
+                                 int nCols, float fScale, float* pGrad,
+                                 size_t nGradStep) {
+    for (int r = 0; r < nRows; r++)
+        FloatGradientRowColumns(
+            (const float*)((const char*)pImage + r * nStep), nStep, 0, nCols,
+            fScale, (float*)((char*)pGrad + r * nGradStep));
+}
+
+// Columns [nFirstCol, nCols) of one row of gradient products, added to
+// (nSign = 1) or subtracted from (nSign = -1) the column accumulators
+static inline void AddProductsColumns(const short* pGradX, const short* pGradY,
+                                      int nFirstCol, int nCols, int nSign,
+                                      int* pAccXX, int* pAccYY, int* pAccXY) {
+    for (int c = nFirstCol; c < nCols; c++) {
+        int nX = pGradX[c], nY = pGradY[c];
+        pAccXX[c] += nSign * nX * nX;
+        pAccYY[c] += nSign * nY * nY;
+        pAccXY[c] += nSign * nX * nY;
+    }
+}
+
+static void AddProductsScalar(const short* pGradX, const short* pGradY,
+                              int nCols, int nSign, int* pAccXX, int* pAccYY,
+                              int* pAccXY) {
+    AddProductsColumns(pGradX, pGradY, 0, nCols, nSign, pAccXX, pAccYY,
+                       pAccXY);
+}
+
+// Box sums of columns [nFirstCol, nCols - nHalfBoxSize) of one accumulator row
+static inline void BoxRowColumns(const int* pAcc, int nFirstCol, int nCols,
+                                 int nHalfBoxSize, int* pOut) {
+    for (int c = nFirstCol; c < nCols - nHalfBoxSize; c++) {
+        int nSum = 0;
+        for (int k = -nHalfBoxSize; k <= nHalfBoxSize; k++)
+            nSum += pAcc[c + k];
+        pOut[c] = nSum;
+    }
+}
+
+static void BoxRowScalar(const int* pAcc, int nCols, int nHalfBoxSize,
+                         int* pOut) {
+    BoxRowColumns(pAcc, nHalfBoxSize, nCols, nHalfBoxSize, pOut);
+}
+
+// The whole-image driver; the per-row work goes through the given (SIMD) kernels.
+// Sums are kept per column over a sliding band of rows, then boxed along each row.
+static void StructureTensorSumsWith(
+    void (*AddProducts)(const short*, const short*, int, int, int*, int*,
+                        int*),
+    void (*BoxRow)(const int*, int, int, int*), const short* pGradX,
+    const short* pGradY, size_t nGradStep, int nRows, int nCols,
+    int nHalfBoxSize, int* pSumXX, int* pSumYY, int* pSumXY,
+    size_t nSumStep) {
+    const int nBox = 2 * nHalfBoxSize + 1;
+    // Everything the box does not fit around is zero
+    for (int r = 0; r < nRows; r++) {
+        memset((char*)pSumXX + r * nSumStep, 0, nCols * sizeof(int));
+        memset((char*)pSumYY + r * nSumStep, 0, nCols * sizeof(int));
+        memset((char*)pSumXY + r * nSumStep, 0, nCols * sizeof(int));
+    }
+    if (nRows < nBox || nCols < nBox)
+        return;
+
+    std::vector<int> vAcc(3 * nCols, 0);
+    int* pAccXX = &vAcc[0];
+    int* pAccYY = pAccXX + nCols;
+    int* pAccXY = pAccYY + nCols;
+#define GRAD_ROW(pGrad, r) \
+    ((const short*)((const char*)(pGrad) + (size_t)(r) * nGradStep))
+#define SUM_ROW(pSum, r) ((int*)((char*)(pSum) + (size_t)(r) * nSumStep))
+    for (int r = 0; r < nBox - 1; r++)
+        AddProducts(GRAD_ROW(pGradX, r), GRAD_ROW(pGradY, r), nCols, 1, pAccXX,
+                    pAccYY, pAccXY);
+    for (int r = nHalfBoxSize; r < nRows - nHalfBoxSize; r++) {
+        // Slide the band down: row r + h comes in, row r - h - 1 goes out
+        AddProducts(GRAD_ROW(pGradX, r + nHalfBoxSize),
+                    GRAD_ROW(pGradY, r + nHalfBoxSize), nCols, 1, pAccXX,
+                    pAccYY, pAccXY);
+        if (r > nHalfBoxSize)
+            AddProducts(GRAD_ROW(pGradX, r - nHalfBoxSize - 1),
+                        GRAD_ROW(pGradY, r - nHalfBoxSize - 1), nCols, -1,
+                        pAccXX, pAccYY, pAccXY);
+        BoxRow(pAccXX, nCols, nHalfBoxSize, SUM_ROW(pSumXX, r));
+        BoxRow(pAccYY, nCols, nHalfBoxSize, SUM_ROW(pSumYY, r));
+        BoxRow(pAccXY, nCols, nHalfBoxSize, SUM_ROW(pSumXY, r));
+    }
+#undef GRAD_ROW
+#undef SUM_ROW
+}
+
+// The "old style" FAST score of one corner: the sums of how far the 16 ring pixels
+// are above (centre + barrier) and below (centre - barrier); the larger one wins
+static inline int FASTRingScore(const unsigned char* pCenter,
+                                const int* pnRingOffsets, int nBarrier) {
+    int cb = *pCenter + nBarrier;
+    int c_b = *pCenter - nBarrier;
+    int sp = 0, sn = 0;
+    for (int i = 0; i < 16; i++) {
+        int p = pCenter[pnRingOffsets[i]];
+        if (p > cb)
+            sp += p - cb;
+        else if (p < c_b)
+            sn += c_b - p;
+    }
+    return sp > sn ? sp : sn;
+}
+
+static void FASTRingScoresScalar(const unsigned char* pImage,
+                                 const int* pnCornerOffsets, int nCorners,
+                                 const int* pnRingOffsets, int nBarrier,
+                                 int* pnScores) {
+    for (int i = 0; i < nCorners; i++)
+        pnScores[i] = FASTRingScore(pImage + pnCornerOffsets[i], pnRingOffsets,
+                                    nBarrier);
+}
+
+// Columns [nFirstCol, nLastCol) of a 3x3 max row
+static inline void Max3x3Columns(const short* pAbove, const short* pRow,
+                                 const short* pBelow, int nFirstCol,
+                                 int nLastCol, int nCols, short* pOut) {
+    for (int c = nFirstCol; c < nLastCol; c++) {
+        short nMax = SHRT_MIN;
+        for (int k = std::max(c - 1, 0); k <= std::min(c + 1, nCols - 1); k++)
+            nMax = std::max(nMax, std::max(pRow[k], std::max(pAbove[k], pBelow[k])));
+        pOut[c] = nMax;
+    }
+}
+
+static void Max3x3RowScalar(const short* pAbove, const short* pRow,
+                            const short* pBelow, int nCols, short* pOut) {
+    Max3x3Columns(pAbove, pRow, pBelow, 0, nCols, nCols, pOut);
+}
+
+// One bilinear sample at a 16.16 fixed point position (weights rounded to 1/128)
+static inline unsigned char SampleFixed(const unsigned char* pImage,
+                                        size_t nStep, int x, int y) {
+    const unsigned char* p = pImage + (size_t)(y >> 16) * nStep + (x >> 16);
+    int wx = ((x & 0xFFFF) + 256) >> 9;
+    int wy = ((y & 0xFFFF) + 256) >> 9;
+    int nTop = p[0] * (128 - wx) + p[1] * wx;
+    int nBottom = p[nStep] * (128 - wx) + p[nStep + 1] * wx;
+    return (unsigned char)((nTop * (128 - wy) + nBottom * wy + (1 << 13)) >> 14);
+}
+
+static inline float SampleFixed(const float* pImage, size_t nStep, int x,
+                                int y) {
+    const float* p =
+        (const float*)((const char*)pImage + (size_t)(y >> 16) * nStep) +
+        (x >> 16);
+    const float* q = (const float*)((const char*)p + nStep);
+    float fx = (x & 0xFFFF) * (1.0f / 65536);
+    float fy = (y & 0xFFFF) * (1.0f / 65536);
+    return (1 - fy) * ((1 - fx) * p[0] + fx * p[1]) +
+           fy * ((1 - fx) * q[0] + fx * q[1]);
+}
+
+// Columns [nFirstCol, nCols) of one warped row starting at (nRowX, nRowY)
+template <typename T>
+static inline void AffineWarpColumns(const T* pImage, size_t nImageStep,
+                                     int nRowX, int nRowY,
+                                     const int anAcross[2], int nFirstCol,
+                                     int nCols, T* pOutRow) {
+    for (int c = nFirstCol; c < nCols; c++)
+        pOutRow[c] = SampleFixed(pImage, nImageStep, nRowX + c * anAcross[0],
+                                 nRowY + c * anAcross[1]);
+}
+
+template <typename T>
+static void AffineWarpScalar(const T* pImage, size_t nImageStep,
+                             const int anOrigin[2], const int anAcross[2],
+                             const int anDown[2], int nRows, int nCols,
+                             T* pOut, size_t nOutStep) {
+    for (int r = 0; r < nRows; r++)
+        AffineWarpColumns(pImage, nImageStep, anOrigin[0] + r * anDown[0],
+                          anOrigin[1] + r * anDown[1], anAcross, 0, nCols,
+                          (T*)((char*)pOut + r * nOutStep));
+}
+
+#if PATCHKERNELS_X86
+
+/////////////////////////////////////////////////////////////////////
+//
+//              SSE2 / SSSE3 kernels
+//
+// SSSE3 does not give us anything useful for 8-bit products of unsigned
+// pixels (maddubs saturates), so the SSSE3 versions only differ in
+// using horizontal adds for the final reductions.
+//
+/////////////////////////////////////////////////////////////////////
+
+__attribute__((target("sse2"))) static inline int HSum32_SSE2(__m128i x) {
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+
+__attribute__((target("ssse3"))) static inline int HSum32_SSSE3(__m128i x) {
+    x = _mm_hadd_epi32(x, x);
+    x = _mm_hadd_epi32(x, x);
+    return _mm_cvtsi128_si32(x);
+}
+
+// Sum of the two 64-bit halves produced by _mm_sad_epu8
+__attribute__((target("sse2"))) static inline int HSumSAD(__m128i x) {
+    return _mm_cvtsi128_si32(x) + _mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+}
+
+// Accumulates 16 image/template bytes into the three sums
+__attribute__((target("sse2"))) static inline void CrossSumsBlock16(
+    __m128i xImage, __m128i xTemplate, __m128i& xSum, __m128i& xSumSq,
+    __m128i& xCross) {
+    const __m128i xZero = _mm_setzero_si128();
+    xSum = _mm_add_epi64(xSum, _mm_sad_epu8(xImage, xZero));
+
+    __m128i xImLo = _mm_unpacklo_epi8(xImage, xZero);
+    __m128i xImHi = _mm_unpackhi_epi8(xImage, xZero);
+    __m128i xTLo = _mm_unpacklo_epi8(xTemplate, xZero);
+    __m128i xTHi = _mm_unpackhi_epi8(xTemplate, xZero);
+
+    xSumSq = _mm_add_epi32(xSumSq, _mm_madd_epi16(xImLo, xImLo));
+    xSumSq = _mm_add_epi32(xSumSq, _mm_madd_epi16(xImHi, xImHi));
+    xCross = _mm_add_epi32(xCross, _mm_madd_epi16(xImLo, xTLo));
+    xCross = _mm_add_epi32(xCross, _mm_madd_epi16(xImHi, xTHi));
+}
+
+// Two 8-byte rows packed in one register
+__attribute__((target("sse2"))) static inline __m128i LoadTwoRows8(
+    const unsigned char* p, size_t nStep) {
+    return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)p),
+                              _mm_loadl_epi64((const __m128i*)(p + nStep)));
+}
+
+// Running SSE sums (vector lanes plus the scalar column tails)
+struct CrossSumsSSE {
+    __m128i xSum, xSumSq, xCross;
+    int nTailSum, nTailSumSq, nTailCross;
+};
+
+__attribute__((target("sse2"))) static inline void AccumulateCrossSums_SSE(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    CrossSumsSSE& s) {
+    s.xSum = s.xSumSq = s.xCross = _mm_setzero_si128();
+    s.nTailSum = s.nTailSumSq = s.nTailCross = 0;
+
+    if (nRows == 8 && nCols == 8) {
+        // two rows per register, four times.
+        for (int r = 0; r < 8; r += 2)
+            CrossSumsBlock16(
+                LoadTwoRows8(pImage + r * nImageStep, nImageStep),
+                LoadTwoRows8(pTemplate + r * nTemplateStep, nTemplateStep),
+                s.xSum, s.xSumSq, s.xCross);
+        return;
+    }
+
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pTRow = pTemplate + r * nTemplateStep;
+        int c = 0;
+        for (; c + 16 <= nCols; c += 16)
+            CrossSumsBlock16(_mm_loadu_si128((const __m128i*)(pImRow + c)),
+                             _mm_loadu_si128((const __m128i*)(pTRow + c)),
+                             s.xSum, s.xSumSq, s.xCross);
+        // The upper 8 bytes are zero, so they add nothing to any of the sums
+        for (; c + 8 <= nCols; c += 8)
+            CrossSumsBlock16(_mm_loadl_epi64((const __m128i*)(pImRow + c)),
+                             _mm_loadl_epi64((const __m128i*)(pTRow + c)),
+                             s.xSum, s.xSumSq, s.xCross);
+        for (; c < nCols; c++) {
+            int n = pImRow[c];
+            s.nTailSum += n;
+            s.nTailSumSq += n * n;
+            s.nTailCross += n * pTRow[c];
+        }
+    }
+}
+
+// Squared differences of 16 byte pairs (|a - b| through saturated subtractions)
+__attribute__((target("sse2"))) static inline void SSDBlock16(__m128i xA,
+                                                              __m128i xB,
+                                                              __m128i& xAcc) {
+    const __m128i xZero = _mm_setzero_si128();
+    __m128i xAbsDiff =
+        _mm_or_si128(_mm_subs_epu8(xA, xB), _mm_subs_epu8(xB, xA));
+    __m128i xLo = _mm_unpacklo_epi8(xAbsDiff, xZero);
+    __m128i xHi = _mm_unpackhi_epi8(xAbsDiff, xZero);
+    xAcc = _mm_add_epi32(xAcc, _mm_madd_epi16(xLo, xLo));
+    xAcc = _mm_add_epi32(xAcc, _mm_madd_epi16(xHi, xHi));
+}
+
+// Returns the vector accumulator; the scalar column tails go in nTail
+__attribute__((target("sse2"))) static inline __m128i AccumulateSSD_SSE(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    int& nTail) {
+    __m128i xAcc = _mm_setzero_si128();
+    nTail = 0;
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pTRow = pTemplate + r * nTemplateStep;
+        int c = 0;
+        for (; c + 16 <= nCols; c += 16)
+            SSDBlock16(_mm_loadu_si128((const __m128i*)(pImRow + c)),
+                       _mm_loadu_si128((const __m128i*)(pTRow + c)), xAcc);
+        for (; c + 8 <= nCols; c += 8)
+            SSDBlock16(_mm_loadl_epi64((const __m128i*)(pImRow + c)),
+                       _mm_loadl_epi64((const __m128i*)(pTRow + c)), xAcc);
+        for (; c < nCols; c++) {
+            int nDiff = pImRow[c] - pTRow[c];
+            nTail += nDiff * nDiff;
+        }
+    }
+    return xAcc;
+}
+
+__attribute__((target("sse2"))) static double SSDFloat_SSE2(
+    const float* pA, size_t nAStep, const float* pB, size_t nBStep, int nRows,
+    int nCols) {
+    double dSSD = 0.0;
+    double adSq[4];
+    for (int r = 0; r < nRows; r++) {
+        const float* pARow = (const float*)((const char*)pA + r * nAStep);
+        const float* pBRow = (const float*)((const char*)pB + r * nBStep);
+        int c = 0;
+        for (; c + 4 <= nCols; c += 4) {
+            __m128 xDiff =
+                _mm_sub_ps(_mm_loadu_ps(pARow + c), _mm_loadu_ps(pBRow + c));
+            __m128d xD01 = _mm_cvtps_pd(xDiff);
+            __m128d xD23 = _mm_cvtps_pd(_mm_movehl_ps(xDiff, xDiff));
+            _mm_storeu_pd(adSq, _mm_mul_pd(xD01, xD01));
+            _mm_storeu_pd(adSq + 2, _mm_mul_pd(xD23, xD23));
+            // In order, as the reference loop adds them
+            dSSD += adSq[0];
+            dSSD += adSq[1];
+            dSSD += adSq[2];
+            dSSD += adSq[3];
+        }
+        for (; c < nCols; c++) {
+            double dDiff = pARow[c] - pBRow[c];
+            dSSD += dDiff * dDiff;
+        }
+    }
+    return dSSD;
+}
+
+// Lane sums of four registers at once: returns [sum(a), sum(b), sum(c), sum(d)]
+__attribute__((target("sse2"))) static inline __m128i Reduce4_SSE2(
+    __m128i a, __m128i b, __m128i c, __m128i d) {
+    __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(a, b),
+                                _mm_unpackhi_epi32(a, b));  // a02 b02 a13 b13
+    __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(c, d),
+                                _mm_unpackhi_epi32(c, d));  // c02 d02 c13 d13
+    return _mm_add_epi32(_mm_unpacklo_epi64(s01, s23),
+                         _mm_unpackhi_epi64(s01, s23));
+}
+
+__attribute__((target("ssse3"))) static inline __m128i Reduce4_SSSE3(
+    __m128i a, __m128i b, __m128i c, __m128i d) {
+    return _mm_hadd_epi32(_mm_hadd_epi32(a, b), _mm_hadd_epi32(c, d));
+}
+
+// The 8x8 template as words: rows (0,1), (2,3), (4,5), (6,7) in lo/hi halves
+struct Template8x8SSE {
+    __m128i axLo[4], axHi[4];
+};
+
+__attribute__((target("sse2"))) static inline void LoadTemplate8x8_SSE(
+    const unsigned char* pTemplate, size_t nTemplateStep, Template8x8SSE& t) {
+    const __m128i xZero = _mm_setzero_si128();
+    for (int i = 0; i < 4; i++) {
+        __m128i xT = LoadTwoRows8(pTemplate + 2 * i * nTemplateStep,
+                                  nTemplateStep);
+        t.axLo[i] = _mm_unpacklo_epi8(xT, xZero);
+        t.axHi[i] = _mm_unpackhi_epi8(xT, xZero);
+    }
+}
+
+// Cross sums of the (resident) 8x8 template against four candidates. The
+// sums are left in the vector lanes; the image sums are SAD lanes, whose upper
+// 32 bits are always zero, so they reduce just like the others.
+__attribute__((target("sse2"))) static inline void AccumulateBatch8x8_SSE(
+    const unsigned char* const* ppImage, size_t nImageStep,
+    const Template8x8SSE& t, __m128i axSum[4], __m128i axSumSq[4],
+    __m128i axCross[4]) {
+    const __m128i xZero = _mm_setzero_si128();
+    for (int k = 0; k < 4; k++) {
+        __m128i xSum = _mm_setzero_si128();
+        __m128i xSumSq = _mm_setzero_si128();
+        __m128i xCross = _mm_setzero_si128();
+        for (int i = 0; i < 4; i++) {
+            __m128i xIm = LoadTwoRows8(ppImage[k] + 2 * i * nImageStep,
+                                       nImageStep);
+            xSum = _mm_add_epi64(xSum, _mm_sad_epu8(xIm, xZero));
+            __m128i xImLo = _mm_unpacklo_epi8(xIm, xZero);
+            __m128i xImHi = _mm_unpackhi_epi8(xIm, xZero);
+            xSumSq = _mm_add_epi32(xSumSq, _mm_madd_epi16(xImLo, xImLo));
+            xSumSq = _mm_add_epi32(xSumSq, _mm_madd_epi16(xImHi, xImHi));
+            xCross = _mm_add_epi32(xCross, _mm_madd_epi16(xImLo, t.axLo[i]));
+            xCross = _mm_add_epi32(xCross, _mm_madd_epi16(xImHi, t.axHi[i]));
+        }
+        axSum[k] = xSum;
+        axSumSq[k] = xSumSq;
+        axCross[k] = xCross;
+    }
+}
+
+// Points to four candidates starting at i; a short last group repeats its
+// final candidate (those results are simply not stored).
+static inline int GatherFour(const unsigned char* const* ppImage,
+                             int nCandidates, int i,
+                             const unsigned char* apFour[4]) {
+    int nValid = nCandidates - i < 4 ? nCandidates - i : 4;
+    for (int k = 0; k < 4; k++)
+        apFour[k] = ppImage[i + (k < nValid ? k : nValid - 1)];
+    return nValid;
+}
+
+static inline void StoreFour(const int* anFour, int nValid, int* pnDest) {
+    for (int k = 0; k < nValid; k++)
+        pnDest[k] = anFour[k];
+}
+
+// Four image pixels as floats
+__attribute__((target("sse2"))) static inline __m128 LoadFour_SSE2(
+    const unsigned char* p) {
+    int nFour;
+    memcpy(&nFour, p, 4);
+    const __m128i xZero = _mm_setzero_si128();
+    __m128i xWords = _mm_unpacklo_epi8(_mm_cvtsi32_si128(nFour), xZero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(xWords, xZero));
+}
+
+__attribute__((target("sse2"))) static inline float HSumPS_SSE2(__m128 x) {
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(x);
+}
+
+// Four columns per step. The padded columns have zero Jacobians and mask, so they
+// add nothing; only the columns which would read past nImageReadable are left
+// to the scalar loop.
+__attribute__((target("sse2"))) static void SubPixAccumulate_SSE2(
+    const unsigned char* pImage, size_t nImageStep, int nImageReadable,
+    const float* pTemplate, const float* pJacX, const float* pJacY,
+    const float* pMask, int nPlaneStride, int nRows, int nCols,
+    const float afMix[4], float fMeanDiff, float afAccum[3]) {
+    const __m128 xTL = _mm_set1_ps(afMix[0]), xTR = _mm_set1_ps(afMix[1]);
+    const __m128 xBL = _mm_set1_ps(afMix[2]), xBR = _mm_set1_ps(afMix[3]);
+    const __m128 xMeanDiff = _mm_set1_ps(fMeanDiff);
+    __m128 xAccX = _mm_setzero_ps(), xAccY = _mm_setzero_ps(),
+           xAccE = _mm_setzero_ps();
+
+    int nSIMDCols = 0;
+    while (nSIMDCols < nCols && nSIMDCols + 4 < nImageReadable)
+        nSIMDCols += 4;
+
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pImRow1 = pImRow + nImageStep;
+        const int nPlaneOffset = r * nPlaneStride;
+        for (int c = 0; c < nSIMDCols; c += 4) {
+            __m128 xPixel = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(xTL, LoadFour_SSE2(pImRow + c)),
+                           _mm_mul_ps(xTR, LoadFour_SSE2(pImRow + c + 1))),
+                _mm_add_ps(_mm_mul_ps(xBL, LoadFour_SSE2(pImRow1 + c)),
+                           _mm_mul_ps(xBR, LoadFour_SSE2(pImRow1 + c + 1))));
+            __m128 xError = _mm_add_ps(
+                _mm_sub_ps(xPixel, _mm_loadu_ps(pTemplate + nPlaneOffset + c)),
+                xMeanDiff);
+            xAccX = _mm_add_ps(
+                xAccX,
+                _mm_mul_ps(xError, _mm_loadu_ps(pJacX + nPlaneOffset + c)));
+            xAccY = _mm_add_ps(
+                xAccY,
+                _mm_mul_ps(xError, _mm_loadu_ps(pJacY + nPlaneOffset + c)));
+            xAccE = _mm_add_ps(
+                xAccE,
+                _mm_mul_ps(xError, _mm_loadu_ps(pMask + nPlaneOffset + c)));
+        }
+    }
+    afAccum[0] = HSumPS_SSE2(xAccX);
+    afAccum[1] = HSumPS_SSE2(xAccY);
+    afAccum[2] = HSumPS_SSE2(xAccE);
+    if (nSIMDCols < nCols)
+        SubPixAccumulateColumns(pImage, nImageStep, pTemplate, pJacX, pJacY,
+                                nPlaneStride, nRows, nSIMDCols, nCols, afMix,
+                                fMeanDiff, afAccum);
+}
+
+__attribute__((target("sse2"))) static void CentralGradients_SSE2(
+    const unsigned char* pImage, size_t nStep, int nRows, int nCols,
+    short* pGradX, short* pGradY, size_t nGradStep) {
+    ZeroGradientBorder(nRows, nCols, pGradX, pGradY, nGradStep);
+    const __m128i xZero = _mm_setzero_si128();
+    for (int r = 1; r < nRows - 1; r++) {
+        const unsigned char* pRow = pImage + r * nStep;
+        short* pGradXRow = (short*)((char*)pGradX + r * nGradStep);
+        short* pGradYRow = (short*)((char*)pGradY + r * nGradStep);
+        int c = 1;
+        // 8 pixels per step; the loads reach one pixel further right
+        for (; c + 9 <= nCols; c += 8) {
+            __m128i xLeft = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i*)(pRow + c - 1)), xZero);
+            __m128i xRight = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i*)(pRow + c + 1)), xZero);
+            __m128i xUp = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i*)(pRow + c - nStep)), xZero);
+            __m128i xDown = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i*)(pRow + c + nStep)), xZero);
+            _mm_storeu_si128((__m128i*)(pGradXRow + c),
+                             _mm_sub_epi16(xRight, xLeft));
+            _mm_storeu_si128((__m128i*)(pGradYRow + c),
+                             _mm_sub_epi16(xDown, xUp));
+        }
+        GradientRowColumns(pRow, nStep, c, nCols, pGradXRow, pGradYRow);
+    }
+}
+
+__attribute__((target("sse2"))) static void FloatGradients_SSE2(
+    const float* pImage, size_t nStep, int nRows, int nCols, float fScale,
+    float* pGrad, size_t nGradStep) {
+    const __m128 xScale = _mm_set1_ps(fScale);
+    for (int r = 0; r < nRows; r++) {
+        const float* pRow = (const float*)((const char*)pImage + r * nStep);
+        const float* pRowUp = (const float*)((const char*)pRow - nStep);
+        const float* pRowDown = (const float*)((const char*)pRow + nStep);
+        float* pGradRow = (float*)((char*)pGrad + r * nGradStep);
+        int c = 0;
+        for (; c + 4 <= nCols; c += 4) {
+            __m128 xDx = _mm_mul_ps(xScale, _mm_sub_ps(_mm_loadu_ps(pRow + c + 1),
+                                                       _mm_loadu_ps(pRow + c - 1)));
+            __m128 xDy = _mm_mul_ps(xScale, _mm_sub_ps(_mm_loadu_ps(pRowDown + c),
+                                                       _mm_loadu_ps(pRowUp + c)));
+            _mm_storeu_ps(pGradRow + 2 * c, _mm_unpacklo_ps(xDx, xDy));
+            _mm_storeu_ps(pGradRow + 2 * c + 4, _mm_unpackhi_ps(xDx, xDy));
+        }
+        FloatGradientRowColumns(pRow, nStep, c, nCols, fScale, pGradRow);
+    }
+}
+
+// gx * gx, gy * gy and gx * gy of 8 gradient pairs as 32-bit lanes (low and
+// high four). The gradients are interleaved with zeros, so that madd gives
+// exactly one product per lane.
+__attribute__((target("sse2"))) static inline void AddProducts8_SSE2(
+    __m128i xX, __m128i xY, int nSign, int* pAccXX, int* pAccYY,
+    int* pAccXY) {
+    const __m128i xZero = _mm_setzero_si128();
+    __m128i axX[2] = {_mm_unpacklo_epi16(xX, xZero),
+                      _mm_unpackhi_epi16(xX, xZero)};
+    __m128i axY[2] = {_mm_unpacklo_epi16(xY, xZero),
+                      _mm_unpackhi_epi16(xY, xZero)};
+    for (int h = 0; h < 2; h++) {
+        __m128i xXX = _mm_madd_epi16(axX[h], axX[h]);
+        __m128i xYY = _mm_madd_epi16(axY[h], axY[h]);
+        __m128i xXY = _mm_madd_epi16(axX[h], axY[h]);
+        __m128i* pXX = (__m128i*)(pAccXX + 4 * h);
+        __m128i* pYY = (__m128i*)(pAccYY + 4 * h);
+        __m128i* pXY = (__m128i*)(pAccXY + 4 * h);
+        if (nSign > 0) {
+            _mm_storeu_si128(pXX, _mm_add_epi32(_mm_loadu_si128(pXX), xXX));
+            _mm_storeu_si128(pYY, _mm_add_epi32(_mm_loadu_si128(pYY), xYY));
+            _mm_storeu_si128(pXY, _mm_add_epi32(_mm_loadu_si128(pXY), xXY));
+        } else {
+            _mm_storeu_si128(pXX, _mm_sub_epi32(_mm_loadu_si128(pXX), xXX));
+            _mm_storeu_si128(pYY, _mm_sub_epi32(_mm_loadu_si128(pYY), xYY));
+            _mm_storeu_si128(pXY, _mm_sub_epi32(_mm_loadu_si128(pXY), xXY));
+        }
+    }
+}
+
+__attribute__((target("sse2"))) static void AddProducts_SSE2(
+    const short* pGradX, const short* pGradY, int nCols, int nSign,
+    int* pAccXX, int* pAccYY, int* pAccXY) {
+    int c = 0;
+    for (; c + 8 <= nCols; c += 8)
+        AddProducts8_SSE2(_mm_loadu_si128((const __m128i*)(pGradX + c)),
+                          _mm_loadu_si128((const __m128i*)(pGradY + c)), nSign,
+                          pAccXX + c, pAccYY + c, pAccXY + c);
+    AddProductsColumns(pGradX, pGradY, c, nCols, nSign, pAccXX, pAccYY,
+                       pAccXY);
+}
+
+__attribute__((target("sse2"))) static void BoxRow_SSE2(const int* pAcc,
+                                                        int nCols,
+                                                        int nHalfBoxSize,
+                                                        int* pOut) {
+    int c = nHalfBoxSize;
+    for (; c + 4 <= nCols - nHalfBoxSize; c += 4) {
+        __m128i xSum = _mm_loadu_si128((const __m128i*)(pAcc + c - nHalfBoxSize));
+        for (int k = 1 - nHalfBoxSize; k <= nHalfBoxSize; k++)
+            xSum = _mm_add_epi32(xSum,
+                                 _mm_loadu_si128((const __m128i*)(pAcc + c + k)));
+        _mm_storeu_si128((__m128i*)(pOut + c), xSum);
+    }
+    BoxRowColumns(pAcc, c, nCols, nHalfBoxSize, pOut);
+}
+
+// The ring is gathered into one register; saturating differences against the
+// (clamped) thresholds are then exactly the positive terms of both sums.
+__attribute__((target("sse2"))) static void FASTRingScores_SSE2(
+    const unsigned char* pImage, const int* pnCornerOffsets, int nCorners,
+    const int* pnRingOffsets, int nBarrier, int* pnScores) {
+    // With a negative barrier a pixel can be both above and below; keep the reference
+    if (nBarrier < 0) {
+        FASTRingScoresScalar(pImage, pnCornerOffsets, nCorners, pnRingOffsets,
+                             nBarrier, pnScores);
+        return;
+    }
+    const __m128i xZero = _mm_setzero_si128();
+    for (int i = 0; i < nCorners; i++) {
+        const unsigned char* pCenter = pImage + pnCornerOffsets[i];
+        alignas(16) unsigned char aRing[16];
+        for (int k = 0; k < 16; k++)
+            aRing[k] = pCenter[pnRingOffsets[k]];
+        __m128i xRing = _mm_load_si128((const __m128i*)aRing);
+        int cb = std::min(*pCenter + nBarrier, 255);
+        int c_b = std::max(*pCenter - nBarrier, 0);
+        __m128i xSp = _mm_sad_epu8(
+            _mm_subs_epu8(xRing, _mm_set1_epi8((char)cb)), xZero);
+        __m128i xSn = _mm_sad_epu8(
+            _mm_subs_epu8(_mm_set1_epi8((char)c_b), xRing), xZero);
+        int sp = _mm_cvtsi128_si32(xSp) + _mm_extract_epi16(xSp, 4);
+        int sn = _mm_cvtsi128_si32(xSn) + _mm_extract_epi16(xSn, 4);
+        pnScores[i] = sp > sn ? sp : sn;
+    }
+}
+
+__attribute__((target("sse2"))) static void Max3x3Row_SSE2(
+    const short* pAbove, const short* pRow, const short* pBelow, int nCols,
+    short* pOut) {
+    if (nCols < 2) {
+        Max3x3Columns(pAbove, pRow, pBelow, 0, nCols, nCols, pOut);
+        return;
+    }
+    Max3x3Columns(pAbove, pRow, pBelow, 0, 1, nCols, pOut);
+    int c = 1;
+    // 8 columns per step; the loads reach one column either side
+    for (; c + 9 <= nCols; c += 8) {
+        __m128i xMax = _mm_setzero_si128();
+        for (int k = -1; k <= 1; k++) {
+            __m128i xCol = _mm_max_epi16(
+                _mm_loadu_si128((const __m128i*)(pRow + c + k)),
+                _mm_max_epi16(_mm_loadu_si128((const __m128i*)(pAbove + c + k)),
+                              _mm_loadu_si128((const __m128i*)(pBelow + c + k))));
+            xMax = k == -1 ? xCol : _mm_max_epi16(xMax, xCol);
+        }
+        _mm_storeu_si128((__m128i*)(pOut + c), xMax);
+    }
+    Max3x3Columns(pAbove, pRow, pBelow, c, nCols, nCols, pOut);
+}
+
+// The warp positions are computed four lanes at a time; the four pixels of each
+// sample are fetched one by one (there are no byte gathers), and the blend is done
+// eight 8-bit samples (or four float samples) at a time.
+__attribute__((target("sse2"))) static void AffineWarp_SSE2(
+    const unsigned char* pImage, size_t nImageStep, const int anOrigin[2],
+    const int anAcross[2], const int anDown[2], int nRows, int nCols,
+    unsigned char* pOut, size_t nOutStep) {
+    const __m128i xAcrossX = _mm_setr_epi32(0, anAcross[0], 2 * anAcross[0],
+                                            3 * anAcross[0]);
+    const __m128i xAcrossY = _mm_setr_epi32(0, anAcross[1], 2 * anAcross[1],
+                                            3 * anAcross[1]);
+    const __m128i xFourX = _mm_set1_epi32(4 * anAcross[0]);
+    const __m128i xFourY = _mm_set1_epi32(4 * anAcross[1]);
+    const __m128i xFractionMask = _mm_set1_epi32(0xFFFF);
+    const __m128i xHalfWeight = _mm_set1_epi32(256);
+    const __m128i x128 = _mm_set1_epi32(128);
+    const __m128i xRound = _mm_set1_epi32(1 << 13);
+    const __m128i xZero = _mm_setzero_si128();
+
+    for (int r = 0; r < nRows; r++) {
+        const int nRowX = anOrigin[0] + r * anDown[0];
+        const int nRowY = anOrigin[1] + r * anDown[1];
+        unsigned char* pOutRow = pOut + r * nOutStep;
+        int c = 0;
+        for (; c + 8 <= nCols; c += 8) {
+            __m128i axX[2], axY[2];
+            axX[0] = _mm_add_epi32(_mm_set1_epi32(nRowX + c * anAcross[0]),
+                                   xAcrossX);
+            axY[0] = _mm_add_epi32(_mm_set1_epi32(nRowY + c * anAcross[1]),
+                                   xAcrossY);
+            axX[1] = _mm_add_epi32(axX[0], xFourX);
+            axY[1] = _mm_add_epi32(axY[0], xFourY);
+
+            alignas(16) int anX[8], anY[8];
+            _mm_store_si128((__m128i*)anX, axX[0]);
+            _mm_store_si128((__m128i*)(anX + 4), axX[1]);
+            _mm_store_si128((__m128i*)anY, axY[0]);
+            _mm_store_si128((__m128i*)(anY + 4), axY[1]);
+            // Left and right neighbours of each sample, on its row and the row below
+            alignas(16) unsigned short anTop[8], anBottom[8];
+            for (int k = 0; k < 8; k++) {
+                const unsigned char* p =
+                    pImage + (size_t)(anY[k] >> 16) * nImageStep +
+                    (anX[k] >> 16);
+                memcpy(anTop + k, p, 2);
+                memcpy(anBottom + k, p + nImageStep, 2);
+            }
+            const __m128i xTop = _mm_load_si128((const __m128i*)anTop);
+            const __m128i xBottom = _mm_load_si128((const __m128i*)anBottom);
+
+            __m128i axValue[2];
+            for (int h = 0; h < 2; h++) {
+                // (left, right) word pairs of four samples...
+                __m128i xTopPairs = h == 0 ? _mm_unpacklo_epi8(xTop, xZero)
+                                           : _mm_unpackhi_epi8(xTop, xZero);
+                __m128i xBottomPairs = h == 0
+                                           ? _mm_unpacklo_epi8(xBottom, xZero)
+                                           : _mm_unpackhi_epi8(xBottom, xZero);
+                // ... against (128 - wx, wx) word pairs
+                __m128i xWX = _mm_srli_epi32(
+                    _mm_add_epi32(_mm_and_si128(axX[h], xFractionMask),
+                                  xHalfWeight),
+                    9);
+                __m128i xWY = _mm_srli_epi32(
+                    _mm_add_epi32(_mm_and_si128(axY[h], xFractionMask),
+                                  xHalfWeight),
+                    9);
+                __m128i xWXPairs = _mm_or_si128(_mm_sub_epi32(x128, xWX),
+                                                _mm_slli_epi32(xWX, 16));
+                __m128i xWYPairs = _mm_or_si128(_mm_sub_epi32(x128, xWY),
+                                                _mm_slli_epi32(xWY, 16));
+                __m128i xTopValue = _mm_madd_epi16(xTopPairs, xWXPairs);
+                __m128i xBottomValue = _mm_madd_epi16(xBottomPairs, xWXPairs);
+                // Both are at most 255 * 128, so they pair up as words for the
+                // vertical blend
+                __m128i xValue = _mm_madd_epi16(
+                    _mm_or_si128(xTopValue, _mm_slli_epi32(xBottomValue, 16)),
+                    xWYPairs);
+                axValue[h] = _mm_srai_epi32(_mm_add_epi32(xValue, xRound), 14);
+            }
+            __m128i xWords = _mm_packs_epi32(axValue[0], axValue[1]);
+            _mm_storel_epi64((__m128i*)(pOutRow + c),
+                             _mm_packus_epi16(xWords, xWords));
+        }
+        AffineWarpColumns(pImage, nImageStep, nRowX, nRowY, anAcross, c, nCols,
+                          pOutRow);
+    }
+}
+
+__attribute__((target("sse2"))) static void AffineWarpFloat_SSE2(
+    const float* pImage, size_t nImageStep, const int anOrigin[2],
+    const int anAcross[2], const int anDown[2], int nRows, int nCols,
+    float* pOut, size_t nOutStep) {
+    const __m128i xAcrossX = _mm_setr_epi32(0, anAcross[0], 2 * anAcross[0],
+                                            3 * anAcross[0]);
+    const __m128i xAcrossY = _mm_setr_epi32(0, anAcross[1], 2 * anAcross[1],
+                                            3 * anAcross[1]);
+    const __m128i xFractionMask = _mm_set1_epi32(0xFFFF);
+    const __m128 xScale = _mm_set1_ps(1.0f / 65536);
+    const __m128 xOne = _mm_set1_ps(1.0f);
+
+    for (int r = 0; r < nRows; r++) {
+        const int nRowX = anOrigin[0] + r * anDown[0];
+        const int nRowY = anOrigin[1] + r * anDown[1];
+        float* pOutRow = (float*)((char*)pOut + r * nOutStep);
+        int c = 0;
+        for (; c + 4 <= nCols; c += 4) {
+            __m128i xX = _mm_add_epi32(
+                _mm_set1_epi32(nRowX + c * anAcross[0]), xAcrossX);
+            __m128i xY = _mm_add_epi32(
+                _mm_set1_epi32(nRowY + c * anAcross[1]), xAcrossY);
+
+            alignas(16) int anX[4], anY[4];
+            _mm_store_si128((__m128i*)anX, xX);
+            _mm_store_si128((__m128i*)anY, xY);
+            alignas(16) float afTL[4], afTR[4], afBL[4], afBR[4];
+            for (int k = 0; k < 4; k++) {
+                const float* p = (const float*)((const char*)pImage +
+                                                (size_t)(anY[k] >> 16) *
+                                                    nImageStep) +
+                                 (anX[k] >> 16);
+                const float* q = (const float*)((const char*)p + nImageStep);
+                afTL[k] = p[0];
+                afTR[k] = p[1];
+                afBL[k] = q[0];
+                afBR[k] = q[1];
+            }
+
+            __m128 xFX = _mm_mul_ps(
+                _mm_cvtepi32_ps(_mm_and_si128(xX, xFractionMask)), xScale);
+            __m128 xFY = _mm_mul_ps(
+                _mm_cvtepi32_ps(_mm_and_si128(xY, xFractionMask)), xScale);
+            __m128 xGX = _mm_sub_ps(xOne, xFX);
+            __m128 xTop = _mm_add_ps(_mm_mul_ps(xGX, _mm_load_ps(afTL)),
+                                     _mm_mul_ps(xFX, _mm_load_ps(afTR)));
+            __m128 xBottom = _mm_add_ps(_mm_mul_ps(xGX, _mm_load_ps(afBL)),
+                                        _mm_mul_ps(xFX, _mm_load_ps(afBR)));
+            _mm_storeu_ps(pOutRow + c,
+                          _mm_add_ps(_mm_mul_ps(_mm_sub_ps(xOne, xFY), xTop),
+                                     _mm_mul_ps(xFY, xBottom)));
+        }
+        AffineWarpColumns(pImage, nImageStep, nRowX, nRowY, anAcross, c, nCols,
+                          pOutRow);
+    }
+}
+
+// Entry points for the dispatch table
+__attribute__((target("sse2"))) static void CrossSums_SSE2(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    int& nImageSum, int& nImageSumSq, int& nCrossSum) {
+    CrossSumsSSE s;
+    AccumulateCrossSums_SSE(pImage, nImageStep, pTemplate, nTemplateStep,
+                            nRows, nCols, s);
+    nImageSum = HSumSAD(s.xSum) + s.nTailSum;
+    nImageSumSq = HSum32_SSE2(s.xSumSq) + s.nTailSumSq;
+    nCrossSum = HSum32_SSE2(s.xCross) + s.nTailCross;
+}
+
+__attribute__((target("ssse3"))) static void CrossSums_SSSE3(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    int& nImageSum, int& nImageSumSq, int& nCrossSum) {
+    CrossSumsSSE s;
+    AccumulateCrossSums_SSE(pImage, nImageStep, pTemplate, nTemplateStep,
+                            nRows, nCols, s);
+    nImageSum = HSumSAD(s.xSum) + s.nTailSum;
+    nImageSumSq = HSum32_SSSE3(s.xSumSq) + s.nTailSumSq;
+    nCrossSum = HSum32_SSSE3(s.xCross) + s.nTailCross;
+}
+
+__attribute__((target("sse2"))) static int SSD_SSE2(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows,
+    int nCols) {
+    int nTail;
+    __m128i xAcc = AccumulateSSD_SSE(pImage, nImageStep, pTemplate,
+                                     nTemplateStep, nRows, nCols, nTail);
+    return HSum32_SSE2(xAcc) + nTail;
+}
+
+__attribute__((target("ssse3"))) static int SSD_SSSE3(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows,
+    int nCols) {
+    int nTail;
+    __m128i xAcc = AccumulateSSD_SSE(pImage, nImageStep, pTemplate,
+                                     nTemplateStep, nRows, nCols, nTail);
+    return HSum32_SSSE3(xAcc) + nTail;
+}
+
+__attribute__((target("sse2"))) static void CrossSumsBatch_SSE2(
+    const unsigned char* const* ppImage, int nCandidates, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    int* pnImageSum, int* pnImageSumSq, int* pnCrossSum) {
+    if (nRows != 8 || nCols != 8) {
+        for (int i = 0; i < nCandidates; i++)
+            CrossSums_SSE2(ppImage[i], nImageStep, pTemplate, nTemplateStep,
+                           nRows, nCols, pnImageSum[i], pnImageSumSq[i],
+                           pnCrossSum[i]);
+        return;
+    }
+    Template8x8SSE t;
+    LoadTemplate8x8_SSE(pTemplate, nTemplateStep, t);
+    __m128i axSum[4], axSumSq[4], axCross[4];
+    int anFour[4];
+    const unsigned char* apFour[4];
+    for (int i = 0; i < nCandidates; i += 4) {
+        int nValid = GatherFour(ppImage, nCandidates, i, apFour);
+        AccumulateBatch8x8_SSE(apFour, nImageStep, t, axSum, axSumSq, axCross);
+        _mm_storeu_si128((__m128i*)anFour, Reduce4_SSE2(axSum[0], axSum[1],
+                                                        axSum[2], axSum[3]));
+        StoreFour(anFour, nValid, pnImageSum + i);
+        _mm_storeu_si128((__m128i*)anFour,
+                         Reduce4_SSE2(axSumSq[0], axSumSq[1], axSumSq[2],
+                                      axSumSq[3]));
+        StoreFour(anFour, nValid, pnImageSumSq + i);
+        _mm_storeu_si128((__m128i*)anFour,
+                         Reduce4_SSE2(axCross[0], axCross[1], axCross[2],
+                                      axCross[3]));
+        StoreFour(anFour, nValid, pnCrossSum + i);
+    }
+}
+
+__attribute__((target("ssse3"))) static void CrossSumsBatch_SSSE3(
+    const unsigned char* const* ppImage, int nCandidates, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    int* pnImageSum, int* pnImageSumSq, int* pnCrossSum) {
+    if (nRows != 8 || nCols != 8) {
+        for (int i = 0; i < nCandidates; i++)
+            CrossSums_SSSE3(ppImage[i], nImageStep, pTemplate, nTemplateStep,
+                            nRows, nCols, pnImageSum[i], pnImageSumSq[i],
+                            pnCrossSum[i]);
+        return;
+    }
+    Template8x8SSE t;
+    LoadTemplate8x8_SSE(pTemplate, nTemplateStep, t);
+    __m128i axSum[4], axSumSq[4], axCross[4];
+    int anFour[4];
+    const unsigned char* apFour[4];
+    for (int i = 0; i < nCandidates; i += 4) {
+        int nValid = GatherFour(ppImage, nCandidates, i, apFour);
+        AccumulateBatch8x8_SSE(apFour, nImageStep, t, axSum, axSumSq, axCross);
+        _mm_storeu_si128((__m128i*)anFour, Reduce4_SSSE3(axSum[0], axSum[1],
+                                                         axSum[2], axSum[3]));
+        StoreFour(anFour, nValid, pnImageSum + i);
+        _mm_storeu_si128((__m128i*)anFour,
+                         Reduce4_SSSE3(axSumSq[0], axSumSq[1], axSumSq[2],
+                                       axSumSq[3]));
+        StoreFour(anFour, nValid, pnImageSumSq + i);
+        _mm_storeu_si128((__m128i*)anFour,
+                         Reduce4_SSSE3(axCross[0], axCross[1], axCross[2],
+                                       axCross[3]));
+        StoreFour(anFour, nValid, pnCrossSum + i);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+//              AVX2 kernels
+//
+// Pixels are widened to 16 words per register; image sums are done
+// with a madd against ones so that all three sums stay in int32 lanes.
+//
+/////////////////////////////////////////////////////////////////////
+
+__attribute__((target("avx2"))) static inline int HSum32_AVX2(__m256i x) {
+    __m128i xHalf =
+        _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    xHalf = _mm_hadd_epi32(xHalf, xHalf);
+    xHalf = _mm_hadd_epi32(xHalf, xHalf);
+    return _mm_cvtsi128_si32(xHalf);
+}
+
+// Accumulates 16 image/template pixels (already widened to words)
+__attribute__((target("avx2"))) static inline void CrossSumsBlock16_AVX2(
+    __m256i yImage, __m256i yTemplate, __m256i& ySum, __m256i& ySumSq,
+    __m256i& yCross) {
+    const __m256i yOnes = _mm256_set1_epi16(1);
+    ySum = _mm256_add_epi32(ySum, _mm256_madd_epi16(yImage, yOnes));
+    ySumSq = _mm256_add_epi32(ySumSq, _mm256_madd_epi16(yImage, yImage));
+    yCross = _mm256_add_epi32(yCross, _mm256_madd_epi16(yImage, yTemplate));
+}
+
+__attribute__((target("avx2"))) static void CrossSums_AVX2(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    int& nImageSum, int& nImageSumSq, int& nCrossSum) {
+    __m256i ySum = _mm256_setzero_si256();
+    __m256i ySumSq = _mm256_setzero_si256();
+    __m256i yCross = _mm256_setzero_si256();
+
+    if (nRows == 8 && nCols == 8) {
+        // two rows per register, four times.
+        for (int r = 0; r < 8; r += 2)
+            CrossSumsBlock16_AVX2(
+                _mm256_cvtepu8_epi16(
+                    LoadTwoRows8(pImage + r * nImageStep, nImageStep)),
+                _mm256_cvtepu8_epi16(
+                    LoadTwoRows8(pTemplate + r * nTemplateStep, nTemplateStep)),
+                ySum, ySumSq, yCross);
+        nImageSum = HSum32_AVX2(ySum);
+        nImageSumSq = HSum32_AVX2(ySumSq);
+        nCrossSum = HSum32_AVX2(yCross);
+        return;
+    }
+
+    int nTailSum = 0, nTailSumSq = 0, nTailCross = 0;
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pTRow = pTemplate + r * nTemplateStep;
+        int c = 0;
+        for (; c + 16 <= nCols; c += 16)
+            CrossSumsBlock16_AVX2(
+                _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128((const __m128i*)(pImRow + c))),
+                _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128((const __m128i*)(pTRow + c))),
+                ySum, ySumSq, yCross);
+        // Eight more pixels; the upper words are zero
+        for (; c + 8 <= nCols; c += 8)
+            CrossSumsBlock16_AVX2(
+                _mm256_cvtepu8_epi16(
+                    _mm_loadl_epi64((const __m128i*)(pImRow + c))),
+                _mm256_cvtepu8_epi16(
+                    _mm_loadl_epi64((const __m128i*)(pTRow + c))),
+                ySum, ySumSq, yCross);
+        for (; c < nCols; c++) {
+            int n = pImRow[c];
+            nTailSum += n;
+            nTailSumSq += n * n;
+            nTailCross += n * pTRow[c];
+        }
+    }
+    nImageSum = HSum32_AVX2(ySum) + nTailSum;
+    nImageSumSq = HSum32_AVX2(ySumSq) + nTailSumSq;
+    nCrossSum = HSum32_AVX2(yCross) + nTailCross;
+}
+
+__attribute__((target("avx2"))) static int SSD_AVX2(
+    const unsigned char* pImage, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows,
+    int nCols) {
+    __m256i yAcc = _mm256_setzero_si256();
+    int nTail = 0;
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pTRow = pTemplate + r * nTemplateStep;
+        int c = 0;
+        for (; c + 16 <= nCols; c += 16) {
+            __m256i yDiff = _mm256_sub_epi16(
+                _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128((const __m128i*)(pImRow + c))),
+                _mm256_cvtepu8_epi16(
+                    _mm_loadu_si128((const __m128i*)(pTRow + c))));
+            yAcc = _mm256_add_epi32(yAcc, _mm256_madd_epi16(yDiff, yDiff));
+        }
+        for (; c + 8 <= nCols; c += 8) {
+            __m256i yDiff = _mm256_sub_epi16(
+                _mm256_cvtepu8_epi16(
+                    _mm_loadl_epi64((const __m128i*)(pImRow + c))),
+                _mm256_cvtepu8_epi16(
+                    _mm_loadl_epi64((const __m128i*)(pTRow + c))));
+            yAcc = _mm256_add_epi32(yAcc, _mm256_madd_epi16(yDiff, yDiff));
+        }
+        for (; c < nCols; c++) {
+            int nDiff = pImRow[c] - pTRow[c];
+            nTail += nDiff * nDiff;
+        }
+    }
+    return HSum32_AVX2(yAcc) + nTail;
+}
+
+__attribute__((target("avx2"))) static double SSDFloat_AVX2(
+    const float* pA, size_t nAStep, const float* pB, size_t nBStep, int nRows,
+    int nCols) {
+    double dSSD = 0.0;
+    double adSq[4];
+    for (int r = 0; r < nRows; r++) {
+        const float* pARow = (const float*)((const char*)pA + r * nAStep);
+        const float* pBRow = (const float*)((const char*)pB + r * nBStep);
+        int c = 0;
+        for (; c + 4 <= nCols; c += 4) {
+            __m256d yDiff = _mm256_cvtps_pd(
+                _mm_sub_ps(_mm_loadu_ps(pARow + c), _mm_loadu_ps(pBRow + c)));
+            _mm256_storeu_pd(adSq, _mm256_mul_pd(yDiff, yDiff));
+            // In order, as the reference loop adds them (and no FMA, which
+            // would round differently)
+            dSSD += adSq[0];
+            dSSD += adSq[1];
+            dSSD += adSq[2];
+            dSSD += adSq[3];
+        }
+        for (; c < nCols; c++) {
+            double dDiff = pARow[c] - pBRow[c];
+            dSSD += dDiff * dDiff;
+        }
+    }
+    return dSSD;
+}
+
+// Lane sums of four registers at once: returns [sum(a), sum(b), sum(c), sum(d)]
+__attribute__((target("avx2"))) static inline __m128i Reduce4_AVX2(
+    __m256i a, __m256i b, __m256i c, __m256i d) {
+    __m256i y = _mm256_hadd_epi32(_mm256_hadd_epi32(a, b),
+                                  _mm256_hadd_epi32(c, d));
+    return _mm_add_epi32(_mm256_castsi256_si128(y),
+                         _mm256_extracti128_si256(y, 1));
+}
+
+__attribute__((target("avx2"))) static void CrossSumsBatch_AVX2(
+    const unsigned char* const* ppImage, int nCandidates, size_t nImageStep,
+    const unsigned char* pTemplate, size_t nTemplateStep, int nRows, int nCols,
+    int* pnImageSum, int* pnImageSumSq, int* pnCrossSum) {
+    if (nRows != 8 || nCols != 8) {
+        for (int i = 0; i < nCandidates; i++)
+            CrossSums_AVX2(ppImage[i], nImageStep, pTemplate, nTemplateStep,
+                           nRows, nCols, pnImageSum[i], pnImageSumSq[i],
+                           pnCrossSum[i]);
+        return;
+    }
+    // The whole template lives in four registers for the entire batch
+    __m256i ayT[4];
+    for (int i = 0; i < 4; i++)
+        ayT[i] = _mm256_cvtepu8_epi16(
+            LoadTwoRows8(pTemplate + 2 * i * nTemplateStep, nTemplateStep));
+
+    __m256i aySum[4], aySumSq[4], ayCross[4];
+    int anFour[4];
+    const unsigned char* apFour[4];
+    for (int i = 0; i < nCandidates; i += 4) {
+        int nValid = GatherFour(ppImage, nCandidates, i, apFour);
+        for (int k = 0; k < 4; k++) {
+            aySum[k] = aySumSq[k] = ayCross[k] = _mm256_setzero_si256();
+            for (int j = 0; j < 4; j++)
+                CrossSumsBlock16_AVX2(
+                    _mm256_cvtepu8_epi16(LoadTwoRows8(
+                        apFour[k] + 2 * j * nImageStep, nImageStep)),
+                    ayT[j], aySum[k], aySumSq[k], ayCross[k]);
+        }
+        _mm_storeu_si128((__m128i*)anFour, Reduce4_AVX2(aySum[0], aySum[1],
+                                                        aySum[2], aySum[3]));
+        StoreFour(anFour, nValid, pnImageSum + i);
+        _mm_storeu_si128((__m128i*)anFour,
+                         Reduce4_AVX2(aySumSq[0], aySumSq[1], aySumSq[2],
+                                      aySumSq[3]));
+        StoreFour(anFour, nValid, pnImageSumSq + i);
+        _mm_storeu_si128((__m128i*)anFour,
+                         Reduce4_AVX2(ayCross[0], ayCross[1], ayCross[2],
+                                      ayCross[3]));
+        StoreFour(anFour, nValid, pnCrossSum + i);
+    }
+}
+
+// Eight image pixels as floats
+__attribute__((target("avx2"))) static inline __m256 LoadEight_AVX2(
+    const unsigned char* p) {
+    return _mm256_cvtepi32_ps(
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)));
+}
+
+// As the SSE2 version, eight columns per step (an 8x8 patch has 6 interior
+// columns, i.e. a single step per row).
+__attribute__((target("avx2"))) static void SubPixAccumulate_AVX2(
+    const unsigned char* pImage, size_t nImageStep, int nImageReadable,
+    const float* pTemplate, const float* pJacX, const float* pJacY,
+    const float* pMask, int nPlaneStride, int nRows, int nCols,
+    const float afMix[4], float fMeanDiff, float afAccum[3]) {
+    const __m256 yTL = _mm256_set1_ps(afMix[0]), yTR = _mm256_set1_ps(afMix[1]);
+    const __m256 yBL = _mm256_set1_ps(afMix[2]), yBR = _mm256_set1_ps(afMix[3]);
+    const __m256 yMeanDiff = _mm256_set1_ps(fMeanDiff);
+    __m256 yAccX = _mm256_setzero_ps(), yAccY = _mm256_setzero_ps(),
+           yAccE = _mm256_setzero_ps();
+
+    // The byte loads read 8 pixels (and the next one for the right neighbour)
+    int nSIMDCols = 0;
+    while (nSIMDCols < nCols && nSIMDCols + 8 < nImageReadable)
+        nSIMDCols += 8;
+
+    for (int r = 0; r < nRows; r++) {
+        const unsigned char* pImRow = pImage + r * nImageStep;
+        const unsigned char* pImRow1 = pImRow + nImageStep;
+        const int nPlaneOffset = r * nPlaneStride;
+        for (int c = 0; c < nSIMDCols; c += 8) {
+            __m256 yPixel = _mm256_add_ps(
+                _mm256_add_ps(
+                    _mm256_mul_ps(yTL, LoadEight_AVX2(pImRow + c)),
+                    _mm256_mul_ps(yTR, LoadEight_AVX2(pImRow + c + 1))),
+                _mm256_add_ps(
+                    _mm256_mul_ps(yBL, LoadEight_AVX2(pImRow1 + c)),
+                    _mm256_mul_ps(yBR, LoadEight_AVX2(pImRow1 + c + 1))));
+            __m256 yError = _mm256_add_ps(
+                _mm256_sub_ps(yPixel,
+                              _mm256_loadu_ps(pTemplate + nPlaneOffset + c)),
+                yMeanDiff);
+            yAccX = _mm256_add_ps(
+                yAccX, _mm256_mul_ps(yError,
+                                     _mm256_loadu_ps(pJacX + nPlaneOffset + c)));
+            yAccY = _mm256_add_ps(
+                yAccY, _mm256_mul_ps(yError,
+                                     _mm256_loadu_ps(pJacY + nPlaneOffset + c)));
+            yAccE = _mm256_add_ps(
+                yAccE, _mm256_mul_ps(yError,
+                                     _mm256_loadu_ps(pMask + nPlaneOffset + c)));
+        }
+    }
+    afAccum[0] = HSumPS_SSE2(_mm_add_ps(_mm256_castps256_ps128(yAccX),
+                                        _mm256_extractf128_ps(yAccX, 1)));
+    afAccum[1] = HSumPS_SSE2(_mm_add_ps(_mm256_castps256_ps128(yAccY),
+                                        _mm256_extractf128_ps(yAccY, 1)));
+    afAccum[2] = HSumPS_SSE2(_mm_add_ps(_mm256_castps256_ps128(yAccE),
+                                        _mm256_extractf128_ps(yAccE, 1)));
+    // Whatever is left over goes four columns at a time
+    if (nSIMDCols < nCols) {
+        float afRest[3];
+        SubPixAccumulate_SSE2(pImage + nSIMDCols, nImageStep,
+                              nImageReadable - nSIMDCols,
+                              pTemplate + nSIMDCols, pJacX + nSIMDCols,
+                              pJacY + nSIMDCols, pMask + nSIMDCols,
+                              nPlaneStride, nRows, nCols - nSIMDCols, afMix,
+                              fMeanDiff, afRest);
+        afAccum[0] += afRest[0];
+        afAccum[1] += afRest[1];
+        afAccum[2] += afRest[2];
+    }
+}
+
+__attribute__((target("avx2"))) static void CentralGradients_AVX2(
+    const unsigned char* pImage, size_t nStep, int nRows, int nCols,
+    short* pGradX, short* pGradY, size_t nGradStep) {
+    ZeroGradientBorder(nRows, nCols, pGradX, pGradY, nGradStep);
+    for (int r = 1; r < nRows - 1; r++) {
+        const unsigned char* pRow = pImage + r * nStep;
+        short* pGradXRow = (short*)((char*)pGradX + r * nGradStep);
+        short* pGradYRow = (short*)((char*)pGradY + r * nGradStep);
+        int c = 1;
+        // 16 pixels per step; the loads reach one pixel further right
+        for (; c + 17 <= nCols; c += 16) {
+            __m256i yLeft = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(pRow + c - 1)));
+            __m256i yRight = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(pRow + c + 1)));
+            __m256i yUp = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(pRow + c - nStep)));
+            __m256i yDown = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i*)(pRow + c + nStep)));
+            _mm256_storeu_si256((__m256i*)(pGradXRow + c),
+                                _mm256_sub_epi16(yRight, yLeft));
+            _mm256_storeu_si256((__m256i*)(pGradYRow + c),
+                                _mm256_sub_epi16(yDown, yUp));
+        }
+        GradientRowColumns(pRow, nStep, c, nCols, pGradXRow, pGradYRow);
+    }
+}
+
+__attribute__((target("avx2"))) static void AddProducts_AVX2(
+    const short* pGradX, const short* pGradY, int nCols, int nSign,
+    int* pAccXX, int* pAccYY, int* pAccXY) {
+    int c = 0;
+    for (; c + 8 <= nCols; c += 8) {
+        __m256i yX = _mm256_cvtepi16_epi32(
+            _mm_loadu_si128((const __m128i*)(pGradX + c)));
+        __m256i yY = _mm256_cvtepi16_epi32(
+            _mm_loadu_si128((const __m128i*)(pGradY + c)));
+        __m256i yXX = _mm256_mullo_epi32(yX, yX);
+        __m256i yYY = _mm256_mullo_epi32(yY, yY);
+        __m256i yXY = _mm256_mullo_epi32(yX, yY);
+        __m256i* pXX = (__m256i*)(pAccXX + c);
+        __m256i* pYY = (__m256i*)(pAccYY + c);
+        __m256i* pXY = (__m256i*)(pAccXY + c);
+        if (nSign > 0) {
+            _mm256_storeu_si256(pXX, _mm256_add_epi32(_mm256_loadu_si256(pXX), yXX));
+            _mm256_storeu_si256(pYY, _mm256_add_epi32(_mm256_loadu_si256(pYY), yYY));
+            _mm256_storeu_si256(pXY, _mm256_add_epi32(_mm256_loadu_si256(pXY), yXY));
+        } else {
+            _mm256_storeu_si256(pXX, _mm256_sub_epi32(_mm256_loadu_si256(pXX), yXX));
+            _mm256_storeu_si256(pYY, _mm256_sub_epi32(_mm256_loadu_si256(pYY), yYY));
+            _mm256_storeu_si256(pXY, _mm256_sub_epi32(_mm256_loadu_si256(pXY), yXY));
+        }
+    }
+    AddProductsColumns(pGradX, pGradY, c, nCols, nSign, pAccXX, pAccYY,
+                       pAccXY);
+}
+
+__attribute__((target("avx2"))) static void BoxRow_AVX2(const int* pAcc,
+                                                        int nCols,
+                                                        int nHalfBoxSize,
+                                                        int* pOut) {
+    int c = nHalfBoxSize;
+    for (; c + 8 <= nCols - nHalfBoxSize; c += 8) {
+        __m256i ySum =
+            _mm256_loadu_si256((const __m256i*)(pAcc + c - nHalfBoxSize));
+        for (int k = 1 - nHalfBoxSize; k <= nHalfBoxSize; k++)
+            ySum = _mm256_add_epi32(
+                ySum, _mm256_loadu_si256((const __m256i*)(pAcc + c + k)));
+        _mm256_storeu_si256((__m256i*)(pOut + c), ySum);
+    }
+    BoxRowColumns(pAcc, c, nCols, nHalfBoxSize, pOut);
+}
+
+__attribute__((target("avx2"))) static void Max3x3Row_AVX2(
+    const short* pAbove, const short* pRow, const short* pBelow, int nCols,
+    short* pOut) {
+    if (nCols < 2) {
+        Max3x3Columns(pAbove, pRow, pBelow, 0, nCols, nCols, pOut);
+        return;
+    }
+    Max3x3Columns(pAbove, pRow, pBelow, 0, 1, nCols, pOut);
+    int c = 1;
+    // 16 columns per step; the loads reach one column either side
+    for (; c + 17 <= nCols; c += 16) {
+        __m256i yMax = _mm256_setzero_si256();
+        for (int k = -1; k <= 1; k++) {
+            __m256i yCol = _mm256_max_epi16(
+                _mm256_loadu_si256((const __m256i*)(pRow + c + k)),
+                _mm256_max_epi16(
+                    _mm256_loadu_si256((const __m256i*)(pAbove + c + k)),
+                    _mm256_loadu_si256((const __m256i*)(pBelow + c + k))));
+            yMax = k == -1 ? yCol : _mm256_max_epi16(yMax, yCol);
+        }
+        _mm256_storeu_si256((__m256i*)(pOut + c), yMax);
+    }
+    Max3x3Columns(pAbove, pRow, pBelow, c, nCols, nCols, pOut);
+}
+
+#endif  // PATCHKERNELS_X86
+
+/////////////////////////////////////////////////////////////////////
+//
+//              Run-time dispatch
+//
+/////////////////////////////////////////////////////////////////////
+
+struct KernelTable {
+    InstructionSet is;
+    void (*CrossSums)(const unsigned char*, size_t, const unsigned char*,
+                      size_t, int, int, int&, int&, int&);
+    void (*CrossSumsBatch)(const unsigned char* const*, int, size_t,
+                           const unsigned char*, size_t, int, int, int*, int*,
+                           int*);
+    int (*SSD)(const unsigned char*, size_t, const unsigned char*, size_t, int,
+               int);
+    double (*SSDFloat)(const float*, size_t, const float*, size_t, int, int);
+    void (*SubPixAccumulate)(const unsigned char*, size_t, int, const float*,
+                             const float*, const float*, const float*, int,
+                             int, int, const float*, float, float*);
+    void (*CentralGradients)(const unsigned char*, size_t, int, int, short*,
+                             short*, size_t);
+    void (*FloatGradients)(const float*, size_t, int, int, float, float*,
+                           size_t);
+    void (*AddProducts)(const short*, const short*, int, int, int*, int*,
+                        int*);
+    void (*BoxRow)(const int*, int, int, int*);
+    void (*FASTRingScores)(const unsigned char*, const int*, int, const int*,
+                           int, int*);
+    void (*Max3x3Row)(const short*, const short*, const short*, int, short*);
+    void (*AffineWarp)(const unsigned char*, size_t, const int*, const int*,
+                       const int*, int, int, unsigned char*, size_t);
+    void (*AffineWarpFloat)(const float*, size_t, const int*, const int*,
+                            const int*, int, int, float*, size_t);
+};
+
+static KernelTable SelectKernels() {
+    KernelTable table = {IS_SCALAR, CrossSumsScalar, CrossSumsBatchScalar,
+                         SSDScalar,        SSDFloatScalar,
+                         SubPixAccumulateScalar, CentralGradientsScalar,
+                         FloatGradientsScalar,   AddProductsScalar,
+                         BoxRowScalar,           FASTRingScoresScalar,
+                         Max3x3RowScalar,        AffineWarpScalar<unsigned char>,
+                         AffineWarpScalar<float>};
+#if PATCHKERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        table.is = IS_AVX2;
+        table.CrossSums = CrossSums_AVX2;
+        table.CrossSumsBatch = CrossSumsBatch_AVX2;
+        table.SSD = SSD_AVX2;
+        table.SSDFloat = SSDFloat_AVX2;
+        table.SubPixAccumulate = SubPixAccumulate_AVX2;
+        table.CentralGradients = CentralGradients_AVX2;
+        table.FloatGradients = FloatGradients_SSE2;
+        table.AddProducts = AddProducts_AVX2;
+        table.BoxRow = BoxRow_AVX2;
+        table.FASTRingScores = FASTRingScores_SSE2;
+        table.Max3x3Row = Max3x3Row_AVX2;
+        table.AffineWarp = AffineWarp_SSE2;
+        table.AffineWarpFloat = AffineWarpFloat_SSE2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        table.is = IS_SSSE3;
+        table.CrossSums = CrossSums_SSSE3;
+        table.CrossSumsBatch = CrossSumsBatch_SSSE3;
+        table.SSD = SSD_SSSE3;
+        table.SSDFloat = SSDFloat_SSE2;
+        table.SubPixAccumulate = SubPixAccumulate_SSE2;
+        table.CentralGradients = CentralGradients_SSE2;
+        table.FloatGradients = FloatGradients_SSE2;
+        table.AddProducts = AddProducts_SSE2;
+        table.BoxRow = BoxRow_SSE2;
+        table.FASTRingScores = FASTRingScores_SSE2;
+        table.Max3x3Row = Max3x3Row_SSE2;
+        table.AffineWarp = AffineWarp_SSE2;
+        table.AffineWarpFloat = AffineWarpFloat_SSE2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        table.is = IS_SSE2;
+        table.CrossSums = CrossSums_SSE2;
+        table.CrossSumsBatch = CrossSumsBatch_SSE2;
+        table.SSD = SSD_SSE2;
+        table.SSDFloat = SSDFloat_SSE2;
+        table.SubPixAccumulate = SubPixAccumulate_SSE2;
+        table.CentralGradients = CentralGradients_SSE2;
+        table.FloatGradients = FloatGradients_SSE2;
+        table.AddProducts = AddProducts_SSE2;
+        table.BoxRow = BoxRow_SSE2;
+        table.FASTRingScores = FASTRingScores_SSE2;
+        table.Max3x3Row = Max3x3Row_SSE2;
+        table.AffineWarp = AffineWarp_SSE2;
+        table.AffineWarpFloat = AffineWarpFloat_SSE2;
+    }
+#endif
+    return table;
+}
+
+// Selected on first use (thread-safe static initialization)
+static const KernelTable& Kernels() {
+    static const KernelTable table = SelectKernels();
+    return table;
+}
+
+InstructionSet ActiveInstructionSet() {
+    return Kernels().is;
+}
+
+const char* InstructionSetName(InstructionSet is) {
+    switch (is) {
+        case IS_SSE2:
+            return "SSE2";
+        case IS_SSSE3:
+            return "SSSE3";
+        case IS_AVX2:
+            return "AVX2";
+        default:
+            return "scalar";
+    }
+}
+
+void PatchSums(const unsigned char* pPatch, size_t nStep, int nRows, int nCols,
+               int& nSum, int& nSumSq) {
+    // The sums of a patch are the cross sums of the patch with itself...
+    int nCross;
+    Kernels().CrossSums(pPatch, nStep, pPatch, nStep, nRows, nCols, nSum,
+                        nSumSq, nCross);
+}
+
+void CrossSums(const unsigned char* pImage, size_t nImageStep,
+               const unsigned char* pTemplate, size_t nTemplateStep, int nRows,
+               int nCols, int& nImageSum, int& nImageSumSq, int& nCrossSum) {
+    Kernels().CrossSums(pImage, nImageStep, pTemplate, nTemplateStep, nRows,
+                        nCols, nImageSum, nImageSumSq, nCrossSum);
+}
+
+int ZMSSDBatch(const unsigned char* const* ppImage, int nCandidates,
+               size_t nImageStep, const unsigned char* pTemplate,
+               size_t nTemplateStep, int nSize, int nTemplateSum,
+               int nTemplateSumSq, int& nBestSSD, int& nSecondBestSSD,
+               int* pnScores) {
+    // The kernels work on chunks so that the sums can live on the stack
+    const int nChunk = 64;
+    int anImageSum[nChunk], anImageSumSq[nChunk], anCrossSum[nChunk];
+
+    int nBest = -1;
+    nBestSSD = nSecondBestSSD = INT_MAX;
+    for (int nStart = 0; nStart < nCandidates; nStart += nChunk) {
+        int nCount = std::min(nChunk, nCandidates - nStart);
+        Kernels().CrossSumsBatch(ppImage + nStart, nCount, nImageStep,
+                                 pTemplate, nTemplateStep, nSize, nSize,
+                                 anImageSum, anImageSumSq, anCrossSum);
+        for (int i = 0; i < nCount; i++) {
+            int nSSD = ZMSSDFromSums(nTemplateSum, nTemplateSumSq,
+                                     anImageSum[i], anImageSumSq[i],
+                                     anCrossSum[i], nSize * nSize);
+            if (pnScores)
+                pnScores[nStart + i] = nSSD;
+            // Strictly smaller, so the first of equal scores stays the best
+            if (nSSD < nBestSSD) {
+                nSecondBestSSD = nBestSSD;
+                nBestSSD = nSSD;
+                nBest = nStart + i;
+            } else if (nSSD < nSecondBestSSD)
+                nSecondBestSSD = nSSD;
+        }
+    }
+    return nBest;
+}
+
+int SSD(const unsigned char* pImage, size_t nImageStep,
+        const unsigned char* pTemplate, size_t nTemplateStep, int nRows,
+        int nCols) {
+    return Kernels().SSD(pImage, nImageStep, pTemplate, nTemplateStep, nRows,
+                         nCols);
+}
+
+double SSD(const float* pA, size_t nAStep, const float* pB, size_t nBStep,
+           int nRows, int nCols) {
+    return Kernels().SSDFloat(pA, nAStep, pB, nBStep, nRows, nCols);
+}
+
+void SubPixAccumulate(const unsigned char* pImage, size_t nImageStep,
+                      int nImageReadable, const float* pTemplate,
+                      const float* pJacX, const float* pJacY,
+                      const float* pMask, int nPlaneStride, int nRows,
+                      int nCols, const float afMix[4], float fMeanDiff,
+                      float afAccum[3]) {
+    Kernels().SubPixAccumulate(pImage, nImageStep, nImageReadable, pTemplate,
+                               pJacX, pJacY, pMask, nPlaneStride, nRows, nCols,
+                               afMix, fMeanDiff, afAccum);
+}
+
+void CentralGradients(const unsigned char* pImage, size_t nStep, int nRows,
+                      int nCols, short* pGradX, short* pGradY,
+                      size_t nGradStep) {
+    Kernels().CentralGradients(pImage, nStep, nRows, nCols, pGradX, pGradY,
+                               nGradStep);
+}
+
+void CentralGradients(const float* pImage, size_t nStep, int nRows, int nCols,
+                      float fScale, float* pGrad, size_t nGradStep) {
+    Kernels().FloatGradients(pImage, nStep, nRows, nCols, fScale, pGrad,
+                             nGradStep);
+}
+
+void StructureTensorSums(const short* pGradX, const short* pGradY,
+                         size_t nGradStep, int nRows, int nCols,
+                         int nHalfBoxSize, int* pSumXX, int* pSumYY,
+                         int* pSumXY, size_t nSumStep) {
+    StructureTensorSumsWith(Kernels().AddProducts, Kernels().BoxRow, pGradX,
+                            pGradY, nGradStep, nRows, nCols, nHalfBoxSize,
+                            pSumXX, pSumYY, pSumXY, nSumStep);
+}
+
+void FASTRingScores(const unsigned char* pImage, const int* pnCornerOffsets,
+                    int nCorners, const int* pnRingOffsets, int nBarrier,
+                    int* pnScores) {
+    Kernels().FASTRingScores(pImage, pnCornerOffsets, nCorners, pnRingOffsets,
+                             nBarrier, pnScores);
+}
+
+void Max3x3Row(const short* pAbove, const short* pRow, const short* pBelow,
+               int nCols, short* pOut) {
+    Kernels().Max3x3Row(pAbove, pRow, pBelow, nCols, pOut);
+}
+
+void AffineWarp(const unsigned char* pImage, size_t nImageStep,
+                const int anOrigin[2], const int anAcross[2],
+                const int anDown[2], int nRows, int nCols,
+                unsigned char* pOut, size_t nOutStep) {
+    Kernels().AffineWarp(pImage, nImageStep, anOrigin, anAcross, anDown, nRows,
+                         nCols, pOut, nOutStep);
+}
+
+void AffineWarp(const float* pImage, size_t nImageStep, const int anOrigin[2],
+                const int anAcross[2], const int anDown[2], int nRows,
+                int nCols, float* pOut, size_t nOutStep) {
+    Kernels().AffineWarpFloat(pImage, nImageStep, anOrigin, anAcross, anDown,
+                              nRows, nCols, pOut, nOutStep);
+}
+
+}  // namespace PatchKernels
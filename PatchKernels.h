@@ -0,0 +1,202 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+//
+// Patch comparison kernels shared by PatchFinder, MiniPatch and SmallBlurryImage.
+//
+// Every kernel has a plain c++ reference version and SIMD versions for SSE2,
+// SSSE3 and AVX2. The version is picked ONCE at run-time from what the CPU
+// actually supports, so the same binary runs (and runs fast) on any x86 machine,
+// unless it was built with PTAM_NATIVE_ARCH (-march=native) for the build host.
+//
+// All integer kernels are exact, so every instruction set returns precisely
+// the same numbers as the reference loop. The float SSD keeps the reference loop's
+// single accumulator: only the squares are computed in parallel, and they are added
+// in the same order, so it too is bit-exact across instruction sets.
+//
+// Strides are given in BYTES (i.e., exactly what cv::Mat::step holds).
+
+#ifndef __PATCH_KERNELS_H
+#define __PATCH_KERNELS_H
+
+#include <cmath>
+#include <cstddef>
+
+#include "GCVD/Addedutils.h"
+#include "OpenCV.h"
+
+namespace PatchKernels {
+
+enum InstructionSet { IS_SCALAR = 0, IS_SSE2, IS_SSSE3, IS_AVX2 };
+
+// The instruction set the kernels were dispatched to
+InstructionSet ActiveInstructionSet();
+const char* InstructionSetName(InstructionSet is);
+
+// Pixel-sum and pixel-squared sum of an nRows x nCols patch.
+void PatchSums(const unsigned char* pPatch, size_t nStep, int nRows, int nCols,
+               int& nSum, int& nSumSq);
+
+// Image pixel-sum, image pixel-squared sum and image-template cross-product sum
+// over an nRows x nCols patch. 8x8 patches take a dedicated (unrolled) path.
+void CrossSums(const unsigned char* pImage, size_t nImageStep,
+               const unsigned char* pTemplate, size_t nTemplateStep, int nRows,
+               int nCols, int& nImageSum, int& nImageSumSq, int& nCrossSum);
+
+// The zero-mean SSD from the sums above (N is the number of pixels)
+inline int ZMSSDFromSums(int nTemplateSum, int nTemplateSumSq, int nImageSum,
+                         int nImageSumSq, int nCrossSum, int N) {
+    int SA = nTemplateSum;
+    int SB = nImageSum;
+    return ((2 * SA * SB - SA * SA - SB * SB) / N + nImageSumSq +
+            nTemplateSumSq - 2 * nCrossSum);
+}
+
+// Zero-mean SSD of an nSize x nSize template (with pre-computed sums) against an image patch
+inline int ZMSSD(const unsigned char* pImage, size_t nImageStep,
+                 const unsigned char* pTemplate, size_t nTemplateStep,
+                 int nSize, int nTemplateSum, int nTemplateSumSq) {
+    int nImageSum, nImageSumSq, nCrossSum;
+    CrossSums(pImage, nImageStep, pTemplate, nTemplateStep, nSize, nSize,
+              nImageSum, nImageSumSq, nCrossSum);
+    return ZMSSDFromSums(nTemplateSum, nTemplateSumSq, nImageSum, nImageSumSq,
+                         nCrossSum, nSize * nSize);
+}
+
+// Scores ONE nSize x nSize template against many image patches (given by their
+// top-left pixels, all in the same image) in a single call. The template stays
+// in registers and the candidates are processed four at a time.
+// Returns the index of the best (lowest) score; the first one wins ties.
+// nBestSSD / nSecondBestSSD get the two lowest scores (INT_MAX if missing),
+// which is all a ratio test needs. All scores go to pnScores, if given.
+int ZMSSDBatch(const unsigned char* const* ppImage, int nCandidates,
+               size_t nImageStep, const unsigned char* pTemplate,
+               size_t nTemplateStep, int nSize, int nTemplateSum,
+               int nTemplateSumSq, int& nBestSSD, int& nSecondBestSSD,
+               int* pnScores = NULL);
+
+// Plain sum of squared differences of two uchar patches
+int SSD(const unsigned char* pImage, size_t nImageStep,
+        const unsigned char* pTemplate, size_t nTemplateStep, int nRows,
+        int nCols);
+
+// Sum of squared differences of two float images (differences are taken in float,
+// squares are accumulated in double)
+double SSD(const float* pA, size_t nAStep, const float* pB, size_t nBStep,
+           int nRows, int nCols);
+
+// One inverse-compositional (sub-pixel) step accumulation over an nRows x nCols
+// block: each template pixel is compared with the bilinearly interpolated image
+// (weights afMix = {TL, TR, BL, BR}) and the error is accumulated as
+//
+//         afAccum += (pixel - template + fMeanDiff) * [Jx, Jy, 1]
+//
+// pImage is the image pixel under the first template pixel. The template and
+// Jacobians are float planes of nPlaneStride floats per row; nPlaneStride must be
+// a multiple of 8 with zeros (also in pMask, which is 1 elsewhere) in the padding.
+// nImageReadable is how many pixels of each image row (from pImage on, including
+// the right neighbour of the last column) may be read; needs nCols + 1 at least.
+void SubPixAccumulate(const unsigned char* pImage, size_t nImageStep,
+                      int nImageReadable, const float* pTemplate,
+                      const float* pJacX, const float* pJacY,
+                      const float* pMask, int nPlaneStride, int nRows,
+                      int nCols, const float afMix[4], float fMeanDiff,
+                      float afAccum[3]);
+
+// Central-difference gradients of a whole image, I(x+1) - I(x-1) and
+// I(y+1) - I(y-1), WITHOUT the 0.5 factor (so that they stay exact in int16).
+// The one pixel wide image border gets zero gradients.
+void CentralGradients(const unsigned char* pImage, size_t nStep, int nRows,
+                      int nCols, short* pGradX, short* pGradY,
+                      size_t nGradStep);
+
+// Central-difference gradients of an nRows x nCols block of a float image,
+// scaled by fScale and stored interleaved (dx, dy) per pixel. The neighbours
+// of the block's border pixels are read from the surrounding image.
+void CentralGradients(const float* pImage, size_t nStep, int nRows, int nCols,
+                      float fScale, float* pGrad, size_t nGradStep);
+
+// Structure tensor sums of every (2 * nHalfBoxSize + 1)^2 box of a pair of gradient
+// images (e.g., from CentralGradients above): at each pixel, the box sums of gx * gx,
+// gy * gy and gx * gy around it. Exact in 32-bit for 8-bit image gradients and
+// half-box sizes up to 10. Pixels closer than nHalfBoxSize to the border get zeros.
+void StructureTensorSums(const short* pGradX, const short* pGradY,
+                         size_t nGradStep, int nRows, int nCols,
+                         int nHalfBoxSize, int* pSumXX, int* pSumYY,
+                         int* pSumXY, size_t nSumStep);
+
+// "Old style" FAST corner scores (as in FAST::fast_nonmax) of many corners: for each
+// corner the larger of the two sums of how far its 16 ring pixels are above
+// (centre + nBarrier) and below (centre - nBarrier). Corners are given as offsets
+// of their pixel from pImage, the ring as 16 offsets from the corner pixel.
+void FASTRingScores(const unsigned char* pImage, const int* pnCornerOffsets,
+                    int nCorners, const int* pnRingOffsets, int nBarrier,
+                    int* pnScores);
+
+// One row of the 3x3 maximum filter of a (score) image: pOut[c] is the largest of
+// the up to nine values around column c in the rows above, at and below. Pass pRow
+// for a row that does not exist.
+void Max3x3Row(const short* pAbove, const short* pRow, const short* pBelow,
+               int nCols, short* pOut);
+
+// 16.16 fixed point, as used for the sample positions of AffineWarp
+inline int ToFixed16(double dValue) {
+    return (int)std::floor(dValue * 65536.0 + 0.5);
+}
+
+// Affine warp with bilinear interpolation into an nRows x nCols block: output pixel (r, c) is
+// sampled at image position anOrigin + c * anAcross + r * anDown, all given in 16.16 fixed point
+// (ToFixed16). Every sample must lie at least one pixel inside the right and bottom image edges
+// (0 <= x < (cols - 1) << 16 and the same for y), as its right and lower neighbours are read.
+// The 8-bit version blends with weights rounded to 1/128, exactly on every instruction set
+// (and within two grey levels of floating point interpolation); the float version blends
+// in float.
+void AffineWarp(const unsigned char* pImage, size_t nImageStep,
+                const int anOrigin[2], const int anAcross[2],
+                const int anDown[2], int nRows, int nCols,
+                unsigned char* pOut, size_t nOutStep);
+void AffineWarp(const float* pImage, size_t nImageStep, const int anOrigin[2],
+                const int anAcross[2], const int anDown[2], int nRows,
+                int nCols, float* pOut, size_t nOutStep);
+
+// CvUtils::transform for 8-bit and float images, done with AffineWarp above (fixed point
+// positions, SIMD blending) whenever every sample is inside the input image. Otherwise it
+// falls back to the per-pixel checks of CvUtils::transform. Same arguments and return value.
+template <typename T>
+int WarpAffine(const cv::Mat_<T>& in, cv::Mat_<T>& out,
+               const cv::Matx<float, 2, 2>& M, const cv::Vec2f& inOrig,
+               const cv::Vec2f& outOrig) {
+    const int w = out.cols, h = out.rows;
+    const int anOrigin[2] = {
+        ToFixed16(inOrig[0] - (M(0, 0) * outOrig[0] + M(0, 1) * outOrig[1])),
+        ToFixed16(inOrig[1] - (M(1, 0) * outOrig[0] + M(1, 1) * outOrig[1]))};
+    const int anAcross[2] = {ToFixed16(M(0, 0)), ToFixed16(M(1, 0))};
+    const int anDown[2] = {ToFixed16(M(0, 1)), ToFixed16(M(1, 1))};
+
+    // Extents of the samples actually taken (the corner ones), in 64 bits as they are
+    // not known to be in range yet
+    bool bInside = w > 0 && h > 0;
+    for (int i = 0; i < 2 && bInside; i++) {
+        const long long nLimit =
+            (long long)((i == 0 ? in.cols : in.rows) - 1) << 16;
+        long long nMin = anOrigin[i], nMax = anOrigin[i];
+        const long long nAcross = (long long)(w - 1) * anAcross[i];
+        const long long nDown = (long long)(h - 1) * anDown[i];
+        (nAcross < 0 ? nMin : nMax) += nAcross;
+        (nDown < 0 ? nMin : nMax) += nDown;
+        bInside = nMin >= 0 && nMax < nLimit;
+    }
+    if (!bInside)
+        return CvUtils::transform(in, out, M, inOrig, outOrig);
+
+    AffineWarp(in[0], in.step, anOrigin, anAcross, anDown, h, w, out[0],
+               out.step);
+    return 0;
+}
+
+}  // namespace PatchKernels
+
+#endif
@@ -0,0 +1,45 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+#include "PosePublisher.h"
+
+PosePublisher::PosePublisher() : mnSlotVersion(0), mnPublished(0) {}
+
+void PosePublisher::Publish(const SE3<>& se3CamFromWorld, unsigned long nFrame,
+                            double dTimestamp, bool bProvisional,
+                            bool bRecovering, bool bTrackingBad) {
+    Pose pose;
+    pose.se3CamFromWorld = se3CamFromWorld;
+    pose.nFrame = nFrame;
+    pose.nSequence = ++mnPublished;
+    pose.dTimestamp = dTimestamp;
+    pose.bProvisional = bProvisional;
+    pose.bRecovering = bRecovering;
+    pose.bTrackingBad = bTrackingBad;
+
+    unsigned long nVersion = mnSlotVersion.load(std::memory_order_relaxed);
+    mnSlotVersion.store(nVersion + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    mSlot = pose;
+    mnSlotVersion.store(nVersion + 2, std::memory_order_release);
+
+    if (mCallback)
+        mCallback(pose);
+}
+
+bool PosePublisher::Latest(Pose& pose) const {
+    while (true) {
+        unsigned long nBefore = mnSlotVersion.load(std::memory_order_acquire);
+        if (nBefore == 0)
+            return false;
+        if (nBefore & 1)
+            continue;  // Being written right now
+        pose = mSlot;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (mnSlotVersion.load(std::memory_order_relaxed) == nBefore)
+            return true;
+    }
+}
@@ -0,0 +1,66 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+//
+// Hands the tracker's poses to whoever wants them, as early as possible.
+//
+// The tracker publishes every tracked frame's pose twice: a provisional one
+// right after the coarse stage (if there was one), and the refined one once the
+// tracker has judged the frame's tracking quality. Each publication carries the
+// tracker's frame number, so consumers can tell a frame's refined pose from its
+// provisional one and spot skipped frames. Poses tracked from a relocaliser guess
+// (when the tracker was lost) are flagged, and so are refined poses of frames whose
+// tracking the tracker judged bad; neither is to be trusted much.
+//
+// There are two ways to get them: a callback, called on the tracker's thread for
+// every publication (so it had better be quick), or Latest(), which any thread
+// can poll. Latest() reads a sequence-locked slot: the tracker never waits for
+// a reader, and readers just retry if they catch a publication half-written.
+
+#ifndef __POSE_PUBLISHER_H
+#define __POSE_PUBLISHER_H
+
+#include "GCVD/SE3.h"
+
+#include <atomic>
+#include <functional>
+
+using namespace RigidTransforms;
+
+class PosePublisher {
+   public:
+    struct Pose {
+        SE3<> se3CamFromWorld;
+        unsigned long nFrame;     // The tracker's frame number
+        unsigned long nSequence;  // Publications so far, this one included
+        double dTimestamp;        // Capture time of the frame (negative if unknown)
+        bool bProvisional;        // Coarse-stage pose; the refined one follows
+        bool bRecovering;   // Tracked from a relocaliser guess, not from the last frame
+        bool bTrackingBad;  // Refined pose of a frame the tracker judged bad
+    };
+    typedef std::function<void(const Pose&)> Callback;
+
+    PosePublisher();
+
+    // Set before tracking starts; it isn't safe to change while publishing.
+    void SetCallback(const Callback& callback) { mCallback = callback; }
+
+    // Tracker thread only
+    void Publish(const SE3<>& se3CamFromWorld, unsigned long nFrame,
+                 double dTimestamp, bool bProvisional, bool bRecovering,
+                 bool bTrackingBad = false);
+
+    // The most recent publication; false if there hasn't been one yet. Any thread.
+    bool Latest(Pose& pose) const;
+
+   protected:
+    std::atomic<unsigned long> mnSlotVersion;  // Odd while the slot is being written
+    Pose mSlot;
+    unsigned long mnPublished;
+    Callback mCallback;
+};
+
+#endif
@@ -14,7 +14,21 @@ using namespace std;
 using namespace Persistence;
 
 Relocaliser::Relocaliser(Map& map, ATANCamera& camera)
-    : mMap(map), mCamera(camera) {}
+    : mMap(map),
+      mCamera(camera),
+      mnGeneration(0),
+      mbStopWorker(false),
+      mbHaveRecoveredPose(false) {}
+
+Relocaliser::~Relocaliser() {
+    {
+        std::lock_guard<std::mutex> lock(mWorkerMutex);
+        mbStopWorker = true;
+    }
+    mcvWorker.notify_one();
+    if (mWorker.joinable())
+        mWorker.join();
+}
 
 SE3<> Relocaliser::BestPose() {
     return mse3Best;
@@ -30,36 +44,102 @@ bool Relocaliser::AttemptRecovery(KeyFrame::Ptr pKFCurrent) {
     else
         pKFCurrent->pSBI->MakeFromKF(*pKFCurrent);
 
+    return Relocalise(*pKFCurrent->pSBI, mMap.vpKeyFrames,
+                      PV3::get<double>("Reloc2.MaxScore", 9e6, SILENT),
+                      mse3Best);
+}
+
+bool Relocaliser::Relocalise(SmallBlurryImage& sbi,
+                             const vector<KeyFrame::Ptr>& vpKeyFrames,
+                             double dMaxScore, SE3<>& se3Pose) {
     // Find the best ZMSSD match from all keyframes in map
-    ScoreKFs(pKFCurrent);
+    int nBest = ScoreKFs(sbi, vpKeyFrames);
+    if (nBest < 0)
+        return false;
 
     // And estimate a camera rotation from a 3DOF image alignment
-    pair<SE2<>, double> result_pair = pKFCurrent->pSBI->IteratePosRelToTarget(
-        *(mMap.vpKeyFrames[mnBest]->pSBI), 6);
-    mse2 = result_pair.first;
+    pair<SE2<>, double> result_pair =
+        sbi.IteratePosRelToTarget(*(vpKeyFrames[nBest]->pSBI), 6);
+    SE2<> se2 = result_pair.first;
     double dScore = result_pair.second;
 
-    SE3<> se3KeyFramePos = mMap.vpKeyFrames[mnBest]->se3CfromW;
-    mse3Best = SmallBlurryImage::SE3fromSE2(mse2, mCamera) * se3KeyFramePos;
+    SE3<> se3KeyFramePos = vpKeyFrames[nBest]->se3CfromW;
+    se3Pose = SmallBlurryImage::SE3fromSE2(se2, mCamera) * se3KeyFramePos;
 
-    if (dScore < PV3::get<double>("Reloc2.MaxScore", 9e6, SILENT))
-        return true;
-    else
+    return dScore < dMaxScore;
+}
+
+// Compare the SBI to all KFs by Zero-mean SSD; returns the best one's index
+int Relocaliser::ScoreKFs(SmallBlurryImage& sbi,
+                          const vector<KeyFrame::Ptr>& vpKeyFrames) {
+    double dBestScore = 99999999999999.9;
+    int nBest = -1;
+
+    for (unsigned int i = 0; i < vpKeyFrames.size(); i++) {
+        double dSSD = sbi.ZMSSD(*(vpKeyFrames[i]->pSBI));
+        if (dSSD < dBestScore) {
+
+            dBestScore = dSSD;
+            nBest = i;
+        }
+    }
+    return nBest;
+}
+
+void Relocaliser::StartRecovery(KeyFrame& kf) {
+    // The SBI and the keyframe list are made here, in the caller's thread, as the
+    // frame and the map may change under the worker's feet otherwise.
+    std::unique_ptr<Job> pJob(new Job);
+    pJob->pSBI.reset(new SmallBlurryImage(kf));
+    pJob->vpKeyFrames = mMap.vpKeyFrames;
+    pJob->dMaxScore = PV3::get<double>("Reloc2.MaxScore", 9e6, SILENT);
+
+    {
+        std::lock_guard<std::mutex> lock(mWorkerMutex);
+        mpPendingJob = std::move(pJob);  // An older frame still waiting is dropped
+        if (!mWorker.joinable())
+            mWorker = std::thread(&Relocaliser::WorkerLoop, this);
+    }
+    mcvWorker.notify_one();
+}
+
+bool Relocaliser::GetRecoveredPose(SE3<>& se3Pose) {
+    std::lock_guard<std::mutex> lock(mWorkerMutex);
+    if (!mbHaveRecoveredPose)
         return false;
+    se3Pose = mse3Recovered;
+    mbHaveRecoveredPose = false;
+    return true;
 }
 
-// Compare current KF to all KFs stored in map by
-// Zero-mean SSD
-void Relocaliser::ScoreKFs(KeyFrame::Ptr pKFCurrent) {
-    mdBestScore = 99999999999999.9;
-    mnBest = -1;
+void Relocaliser::CancelRecovery() {
+    std::lock_guard<std::mutex> lock(mWorkerMutex);
+    mpPendingJob.reset();
+    mbHaveRecoveredPose = false;
+    mnGeneration++;
+}
+
+// The worker thread: relocalises the newest frame it was given, and waits for the next
+void Relocaliser::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mWorkerMutex);
+    while (true) {
+        mcvWorker.wait(lock, [this] { return mbStopWorker || mpPendingJob; });
+        if (mbStopWorker)
+            return;
+
+        std::unique_ptr<Job> pJob = std::move(mpPendingJob);
+        const unsigned long nGeneration = mnGeneration;
+        lock.unlock();
 
-    for (unsigned int i = 0; i < mMap.vpKeyFrames.size(); i++) {
-        double dSSD = pKFCurrent->pSBI->ZMSSD(*(mMap.vpKeyFrames[i]->pSBI));
-        if (dSSD < mdBestScore) {
+        SE3<> se3Pose;
+        bool bGood = Relocalise(*pJob->pSBI, pJob->vpKeyFrames,
+                                pJob->dMaxScore, se3Pose);
+        pJob.reset();  // Lets go of the keyframes outside the lock
 
-            mdBestScore = dSSD;
-            mnBest = i;
+        lock.lock();
+        if (bGood && nGeneration == mnGeneration) {
+            mse3Recovered = se3Pose;
+            mbHaveRecoveredPose = true;
         }
     }
 }
@@ -11,6 +11,13 @@
 // Just compare a small, blurred version of the input frame to all the KFs,
 // choose the closest match, and then estimate a camera rotation by direct image
 // minimisation.
+//
+// This can run in the caller's thread (AttemptRecovery), or in a worker thread of
+// the relocaliser's own, so that the tracker is not held up on big maps: the tracker
+// hands the worker its newest frame (StartRecovery), and picks up the pose the worker
+// found, if any, a few frames later (GetRecoveredPose). The worker only ever works
+// on the newest frame it was given; frames handed over while it's busy replace each
+// other.
 
 #ifndef __RELOCALISER_H
 #define __RELOCALISER_H
@@ -20,19 +27,54 @@
 
 #include "Map.h"
 
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 class Relocaliser {
    public:
     Relocaliser(Map& map, ATANCamera& camera);
+    ~Relocaliser();  // Stops the worker
+
     bool AttemptRecovery(KeyFrame::Ptr pKF);
     SE3<> BestPose();
 
+    // Background relocalisation:
+    // Gives the worker this frame to relocalise (starts the worker on first use)
+    void StartRecovery(KeyFrame& kf);
+    // Returns true (and the pose) if the worker relocalised a frame since the last call
+    bool GetRecoveredPose(SE3<>& se3Pose);
+    // Drops the frame waiting for the worker, and whatever it finds for the one it's on
+    void CancelRecovery();
+
    protected:
-    void ScoreKFs(KeyFrame::Ptr pKFCurrentF);
+    // Finds the keyframe most like sbi, and the camera pose from aligning sbi to it;
+    // returns false if there is no keyframe, or the alignment scores dMaxScore or worse.
+    bool Relocalise(SmallBlurryImage& sbi,
+                    const std::vector<KeyFrame::Ptr>& vpKeyFrames,
+                    double dMaxScore, SE3<>& se3Pose);
+    int ScoreKFs(SmallBlurryImage& sbi,
+                 const std::vector<KeyFrame::Ptr>& vpKeyFrames);
     Map& mMap;
     ATANCamera mCamera;
-    int mnBest;
-    double mdBestScore;
-    SE2<> mse2;
     SE3<> mse3Best;
+
+    // A frame for the worker, with everything it needs from the tracker's thread
+    struct Job {
+        std::unique_ptr<SmallBlurryImage> pSBI;  // The frame's own SBI
+        std::vector<KeyFrame::Ptr> vpKeyFrames;  // The map's keyframes back then
+        double dMaxScore;                        // Reloc2.MaxScore back then
+    };
+    void WorkerLoop();
+    std::thread mWorker;
+    std::mutex mWorkerMutex;  // Guards everything below
+    std::condition_variable mcvWorker;
+    std::unique_ptr<Job> mpPendingJob;  // The newest frame, if not started on yet
+    unsigned long mnGeneration;  // Bumped by CancelRecovery, to drop stale results
+    bool mbStopWorker;
+    bool mbHaveRecoveredPose;
+    SE3<> mse3Recovered;
 };
 #endif
@@ -10,6 +10,7 @@
 #include <math.h>
 
 #include "OpenCV.h"
+#include "PatchKernels.h"
 
 double FindShiTomasiScoreAtPoint(cv::Mat_<uchar>& image, int nHalfBoxSize,
                                  cv::Point2i irCenter) {
@@ -33,6 +34,10 @@ double FindShiTomasiScoreAtPoint(cv::Mat_<uchar>& image, int nHalfBoxSize,
         }
 
     int nPixels = (irEnd.x - irStart.x + 1) * (irEnd.y - irStart.y + 1);
+    return ShiTomasiScoreFromSums(dXX, dYY, dXY, nPixels);
+}
+
+double ShiTomasiScoreFromSums(double dXX, double dYY, double dXY, int nPixels) {
     dXX = dXX / (2.0 * nPixels);
     dYY = dYY / (2.0 * nPixels);
     dXY = dXY / (2.0 * nPixels);
@@ -42,3 +47,23 @@ double FindShiTomasiScoreAtPoint(cv::Mat_<uchar>& image, int nHalfBoxSize,
            (dXX + dYY -
             sqrt((dXX + dYY) * (dXX + dYY) - 4 * (dXX * dYY - dXY * dXY)));
 }
+
+void ShiTomasiScorer::Prepare(const cv::Mat_<short>& imGradX,
+                              const cv::Mat_<short>& imGradY,
+                              int nHalfBoxSize) {
+    mnHalfBoxSize = nHalfBoxSize;
+    mimSumXX.create(imGradX.rows, imGradX.cols);
+    mimSumYY.create(imGradX.rows, imGradX.cols);
+    mimSumXY.create(imGradX.rows, imGradX.cols);
+    // All three sum images have the same (fresh) layout, hence one step
+    PatchKernels::StructureTensorSums(
+        imGradX.ptr<short>(), imGradY.ptr<short>(), imGradX.step, imGradX.rows,
+        imGradX.cols, nHalfBoxSize, mimSumXX.ptr<int>(), mimSumYY.ptr<int>(),
+        mimSumXY.ptr<int>(), mimSumXX.step);
+}
+
+double ShiTomasiScorer::ScoreAtPoint(const cv::Point2i& irCenter) const {
+    int nBoxSide = 2 * mnHalfBoxSize + 1;
+    return ShiTomasiScoreFromSums(mimSumXX(irCenter), mimSumYY(irCenter),
+                                  mimSumXY(irCenter), nBoxSide * nBoxSide);
+}
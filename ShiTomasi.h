@@ -7,4 +7,23 @@
 double FindShiTomasiScoreAtPoint(cv::Mat_<uchar>& image, int nHalfBoxSize,
                                  cv::Point2i irCenter);
 
+// The score (smaller structure tensor eigenvalue) from the sums of the
+// gradient products over a box of nPixels pixels
+double ShiTomasiScoreFromSums(double dXX, double dYY, double dXY, int nPixels);
+
+// Scores a whole image in one go: the structure tensor box sums of every pixel are
+// made from the image's central-difference gradients (see Level::MakeGradients),
+// and scores are then looked up in O(1). Gives exactly the same numbers as
+// FindShiTomasiScoreAtPoint wherever the box stays clear of the image border.
+class ShiTomasiScorer {
+   public:
+    void Prepare(const cv::Mat_<short>& imGradX,
+                 const cv::Mat_<short>& imGradY, int nHalfBoxSize);
+    double ScoreAtPoint(const cv::Point2i& irCenter) const;
+
+   private:
+    int mnHalfBoxSize;
+    cv::Mat_<int> mimSumXX, mimSumYY, mimSumXY;
+};
+
 #endif
@@ -9,6 +9,8 @@
 #include "GCVD/Addedutils.h"
 #include "GCVD/GraphSLAM.h"
 
+#include "PatchKernels.h"
+
 using namespace RigidTransforms;
 using namespace Optimization;
 using namespace std;
@@ -85,56 +87,32 @@ void SmallBlurryImage::MakeFromKF(KeyFrame& kf, double dBlur) {
 void SmallBlurryImage::MakeGradients() {
 
     mimImageGradients.create(mirSize);
-    // Fill-in the gradient image
-    int r, c;
-    float *tRowPtr00, *tRowPtr10,
-        *tRowPtr_10;  // template row pointers at rows  r, r+1, r-1
-
-    cv::Vec<float, 2>* gRowPtr;  // gradient row pointer
-    for (r = 0; r < mirSize.height; r++) {
-
-        tRowPtr00 = mimTemplate.ptr<float>(r);
-        tRowPtr10 = mimTemplate.ptr<float>(r + 1);
-        tRowPtr_10 = mimTemplate.ptr<float>(r - 1);
-
-        gRowPtr = mimImageGradients.ptr<cv::Vec<float, 2> >(r);
-
-        for (c = 0; c < mirSize.width; c++)
-            // probably all vectors are already zero, but let's be on the safe side
-            if ((r == 0) || (c == 0) || (r == mirSize.height - 1) ||
-                (c == mirSize.width - 1))
-                gRowPtr[c][0] = gRowPtr[c][1] = 0;
-            //otherwise simply compute and store the gradient
-            else {
-                gRowPtr[c][0] = tRowPtr00[c + 1] - tRowPtr00[c - 1];
-                gRowPtr[c][1] = tRowPtr10[c] - tRowPtr_10[c];
-                // N.b. missing 0.5 factor in above - will be added later.
-            }
-    }
+    // The border gets zero gradients...
+    mimImageGradients.row(0).setTo(cv::Vec2f(0, 0));
+    mimImageGradients.row(mirSize.height - 1).setTo(cv::Vec2f(0, 0));
+    mimImageGradients.col(0).setTo(cv::Vec2f(0, 0));
+    mimImageGradients.col(mirSize.width - 1).setTo(cv::Vec2f(0, 0));
+    // ... and the interior the plain central differences (SIMD kernel).
+    // N.b. missing 0.5 factor - will be added later.
+    PatchKernels::CentralGradients(
+        mimTemplate.ptr<float>(1) + 1, mimTemplate.step, mirSize.height - 2,
+        mirSize.width - 2, 1.0f,
+        (float*)(mimImageGradients.ptr<cv::Vec<float, 2> >(1) + 1),
+        mimImageGradients.step);
 
     mbMadeGradients = true;
 }
 
 // Calculate the zero-mean SSD between one image and the next.
 // Since both are zero mean already, just calculate the SSD...
+// (The kernel sums in four interleaved double accumulators, which is also
+// what its plain c++ version does; the result is the same on every CPU.)
 double SmallBlurryImage::ZMSSD(SmallBlurryImage& other) {
 
-    double dSSD = 0.0;
-    int r, c;
-    float *tRowPtr, *oRowPtr;
-    for (r = 0; r < mirSize.height; r++) {
-
-        tRowPtr = mimTemplate.ptr<float>(r);
-        oRowPtr = other.mimTemplate.ptr<float>(r);
-
-        for (c = 0; c < mirSize.width; c++) {
-
-            double dDiff = tRowPtr[c] - oRowPtr[c];
-            dSSD += dDiff * dDiff;
-        }
-    }
-
-    return dSSD;
+    return PatchKernels::SSD((const float*)mimTemplate.data, mimTemplate.step,
+                             (const float*)other.mimTemplate.data,
+                             other.mimTemplate.step, mirSize.height,
+                             mirSize.width);
 }
 
 // Find an SE2 which best aligns an SBI to a target
@@ -17,6 +17,7 @@
 #include "ATANCamera.h"
 #include "MapMaker.h"
 #include "MapViewer.h"
+#include "PatchKernels.h"
 #include "Tracker.h"
 
 using namespace std;
@@ -69,7 +70,10 @@ System::System(int camera_index)
     cout << "c. The Tracker!" << endl;
     mpTracker =
         new Tracker(mVideoSource.getSize(), *mpCamera, *mpMap, *mpMapMaker);
-    cout << "DONE" << endl;
+    cout << "DONE (patch kernels: "
+         << PatchKernels::InstructionSetName(
+                PatchKernels::ActiveInstructionSet())
+         << ")" << endl;
     cout << "d. The The AR Driver!" << endl;
     mpARDriver = new ARDriver(*mpCamera, mGLWindow);
     cout << "DONE" << endl;
@@ -98,7 +102,9 @@ void System::Run() {
         // and one RGB, for drawing.
 
         // Get a new frame
-        mVideoSource.GetAndFillFrameBWandRGB(mimFrameRGB, mimFrameBW);
+        double dTimestamp = -1.0;
+        mVideoSource.GetAndFillFrameBWandRGB(mimFrameRGB, mimFrameBW,
+                                             dTimestamp);
         static bool bFirstFrame = true;
         // its the first frame, initialize the AR driver
         if (bFirstFrame) {
@@ -123,7 +129,8 @@ void System::Run() {
         bool bDrawAR = mpMap->IsGood() && *pvnDrawAR;
 
         // The actual SLAM module is the Tracker...
-        mpTracker->TrackFrame(mimFrameBW, !bDrawAR && !bDrawMap, mimFrameRGB);
+        mpTracker->TrackFrame(mimFrameBW, !bDrawAR && !bDrawMap, mimFrameRGB,
+                              dTimestamp);
 
         if (bDrawMap)
             mpMapViewer->DrawMap(mpTracker->GetCurrentPose());
@@ -136,6 +143,13 @@ void System::Run() {
             sCaption = mpMapViewer->GetMessageForUser();
         else
             sCaption = mpTracker->GetMessageForUser();
+        // Live capture: frames from the camera, and how many of them the tracker
+        // was too busy to see
+        unsigned long nCaptured, nDropped;
+        mVideoSource.GetFrameStats(nCaptured, nDropped);
+        if (nCaptured > 0)
+            sCaption += " Camera: " + to_string(nCaptured) + " frames, " +
+                        to_string(nDropped) + " dropped";
         mGLWindow.DrawCaption(sCaption);
         mGLWindow.DrawMenus();
         mGLWindow.swap_buffers();
@@ -24,8 +24,11 @@
 #include "Persistence/GStringUtil.h"
 #include "Persistence/instances.h"
 
+#include <algorithm>
+#include <chrono>
 #include <fcntl.h>
 #include <fstream>
+#include <limits>
 
 #include <unistd.h>
 
@@ -43,7 +46,7 @@ Tracker::Tracker(cv::Size2i irVideoSize, const ATANCamera& c, Map& m,
       mirSize(irVideoSize) {
 
     //mCurrentKF.bFixed = false;
-    pCurrentKF.reset(new KeyFrame);
+    pCurrentKF = mKeyFramePool.Acquire();
 
     GUI.RegisterCommand("Reset", GUICommandCallBack, this);
     GUI.RegisterCommand("KeyPress", GUICommandCallBack, this);
@@ -66,6 +69,8 @@ void Tracker::Reset() {
     mTrackingQuality = GOOD;
     mnLostFrames = 0;
     mdMSDScaledVelocityMagnitude = 0;
+    mRelocaliser.CancelRecovery();
+    mbRelocalising = false;
 
     pCurrentKF->dSceneDepthMean = 1.0;
     pCurrentKF->dSceneDepthSigma = 1.0;
@@ -80,6 +85,21 @@ void Tracker::Reset() {
     mv6CameraVelocity = cv::Vec<float, 6>(
         0, 0, 0, 0, 0, 0);  // could use all() here, but its just 6 zeros....
     mbJustRecoveredSoUseCoarse = false;
+    mbTrackingFromRecovery = false;
+    mdLastTimestamp = -1.0;
+    mdNominalFrameInterval = 0.0;
+    mvdFirstIntervals.clear();
+    mdFrameIntervalScale = 1.0;
+    mdSearchRangeScale = 1.0;
+    mvPVSCandidates.clear();
+    mbPVSValid = false;
+    mnPVSMapSize = 0;
+    mpPVSLastPoint.reset();
+    mnPVSProjected = 0;
+    mnTemplatesReused = mnTemplatesWarped = 0;
+    mQoS = TrackingQoS();  // Back to full quality for the new map
+    mnFineIterations = mnFineRejectedSteps = 0;
+    mnFineIterationsTotal = mnFineFrames = 0;
 
     // Tell the MapMaker to reset itself..
     // this may take some time, since the mapmaker thread may have to wait
@@ -101,12 +121,18 @@ void Tracker::Reset() {
 // functions. bDraw tells the tracker wether it should output any GL graphics
 // or not (it should not draw, for example, when AR stuff is being shown.)
 void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
-                         cv::Mat& rgbFrame) {
+                         cv::Mat& rgbFrame, double dTimestamp) {
+    const std::chrono::steady_clock::time_point tFrameStart =
+        std::chrono::steady_clock::now();
     mbDraw = bDraw;
     mMessageForUser.str("");  // Wipe the user message clean
+    mFrameArena.Reset();  // Last frame's scratch data are all gone by now
+    UpdateFrameInterval(dTimestamp);
 
-    // allocate a new managed Keyframe
-    pCurrentKF.reset(new KeyFrame());
+    // Get a managed Keyframe from the pool; dropping the last frame first
+    // lets the pool hand its storage straight back, unless someone still holds it.
+    pCurrentKF.reset();
+    pCurrentKF = mKeyFramePool.Acquire();
 
     // clear the measurement list (not very much necessary, but just in case...)
     pCurrentKF->mMeasurements.clear();
@@ -154,8 +180,10 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
         glRasterPos2i(0, 0);
         // draw the image
         GLXInterface::glDrawPixelsBGR(rgbFrame);
-        // draw FAST free lying corners
-        if (PV3::get<int>("Tracker.DrawFASTCorners", 1, SILENT)) {
+        // draw FAST free lying corners. Off by default: this is the only thing that
+        // needs level-0 corners on frames that never search level 0.
+        if (PV3::get<int>("Tracker.DrawFASTCorners", 0, SILENT)) {
+            pCurrentKF->aLevels[0].DetectCorners();
 
             glColor3f(1, 0, 1);
             glPointSize(1);
@@ -171,8 +199,15 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
     // More comments on what "good" means coming up!
 
     if (mMap.IsGood()) {
+        bool bTrackedMap = false;
         // .. but only if we're not lost!
         if (mnLostFrames < 3) {
+            // Back on track: whatever the relocaliser is still up to is moot
+            if (mbRelocalising) {
+                mRelocaliser.CancelRecovery();
+                mbRelocalising = false;
+            }
+
             // the calculation below is simply an optical flow
             // estimation routine applied to a very small, blurred version of the entire frame.
             // The result is questionable, but its there, so whjy not use it for starters?
@@ -184,6 +219,7 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
             // Now we need to predict the camera pose
             // based on its previous motion. A bit of help...
             ApplyMotionModel();  //
+            mbTrackingFromRecovery = false;
             //
             //cout <<"DEBUG: Tracking map !!!!"<<endl;
             //cout <<"DEBUG: The map currently has "<<mMap.vpPoints.size()<<" points "<<endl;
@@ -193,6 +229,8 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
             UpdateMotionModel();  //
 
             AssessTrackingQuality();  //  Check if we're lost or if tracking is poor.
+            mPosePublisher.Publish(mse3CamFromWorld, mnFrame, mdLastTimestamp,
+                                   false, false, mTrackingQuality == BAD);
 
             {  // Provide some feedback for the user: cute..
                 mMessageForUser << "Tracking Map, quality ";
@@ -209,6 +247,30 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
                 //	    mMessageForUser << " Found " << mnMeasFound << " of " << mnMeasAttempted <<". (";
                 mMessageForUser << " Map: " << mMap.vpPoints.size() << "P, "
                                 << mMap.vpKeyFrames.size() << "KF";
+                // How many of this frame's templates didn't need re-warping
+                if (mnTemplatesReused + mnTemplatesWarped > 0)
+                    mMessageForUser << " Reused: "
+                                    << (100 * mnTemplatesReused) /
+                                           (mnTemplatesReused +
+                                            mnTemplatesWarped)
+                                    << "%";
+                // Fine stage pose iterations, this frame and on average
+                mMessageForUser << " Its: " << mnFineIterations;
+                if (mnFineRejectedSteps > 0)
+                    mMessageForUser << " (" << mnFineRejectedSteps
+                                    << " damped)";
+                if (mnFineFrames > 0)
+                    mMessageForUser << " avg "
+                                    << 0.1 * (int)(10.0 * mnFineIterationsTotal /
+                                                       mnFineFrames +
+                                                   0.5);
+                // How much of the map the PVS had to project
+                if (!mMap.vpPoints.empty())
+                    mMessageForUser << " Projected: "
+                                    << (100 * mnPVSProjected) /
+                                           mMap.vpPoints.size()
+                                    << "%";
+                mMessageForUser << " " << mQoS.Status();
             }
 
             // Heuristics to check if a key-frame should be added to the map:
@@ -221,6 +283,7 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
                 //cout <<"Adding keyframe! "<<endl;
                 AddNewKeyFrame();
             }
+            bTrackedMap = true;
         }
         // (lost frames > 3): many frames where discarded. need to recover!!!!!
         else {
@@ -228,12 +291,22 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
             mMessageForUser << "** Attempting recovery **.";
             if (AttemptRecovery()) {
 
+                mbTrackingFromRecovery = true;
                 TrackMap();
                 AssessTrackingQuality();
+                mPosePublisher.Publish(mse3CamFromWorld, mnFrame,
+                                       mdLastTimestamp, false, true,
+                                       mTrackingQuality == BAD);
             }
         }
         if (mbDraw)
             RenderGrid();
+
+        // The QoS controller only learns from frames that tracked the map normally
+        if (bTrackedMap)
+            mQoS.FrameDone(std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - tFrameStart)
+                               .count());
     }
     // If there is no map, try to make one.
     else
@@ -254,17 +327,35 @@ void Tracker::TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw,
 // it has no idea where it is, so graphics will go a bit
 // crazy when lost. Could use a tighter SSD threshold and return more false,
 // but the way it is now gives a snappier response and I prefer it.
+// With Tracker.AsyncRelocalisation, the relocaliser works in the background
+// (see Relocaliser.h) so that lost frames don't hold the tracker up: each lost
+// frame either picks up the pose the relocaliser found for an earlier one
+// (which TrackMap then verifies on this frame), or hands itself over to be
+// relocalised instead of whatever frame was still waiting.
 bool Tracker::AttemptRecovery() {
-    bool bRelocGood = mRelocaliser.AttemptRecovery(pCurrentKF);
+    static pvar3<int> gvnAsync("Tracker.AsyncRelocalisation", 1, SILENT);
+
+    SE3<> se3Best;
+    if (*gvnAsync) {
+        if (!mRelocaliser.GetRecoveredPose(se3Best)) {
+            mRelocaliser.StartRecovery(*pCurrentKF);
+            mbRelocalising = true;
+            return false;
+        }
+    } else {
+        bool bRelocGood = mRelocaliser.AttemptRecovery(pCurrentKF);
 
-    if (!bRelocGood)
-        return false;
+        if (!bRelocGood)
+            return false;
+
+        se3Best = mRelocaliser.BestPose();
+    }
 
-    SE3<> se3Best = mRelocaliser.BestPose();
     mse3CamFromWorld = mse3StartPos = se3Best;
     mv6CameraVelocity = cv::Vec<float, 6>(
         0, 0, 0, 0, 0, 0);  // avoiding the ::all(0) static method
     mbJustRecoveredSoUseCoarse = true;
+    mbPVSValid = false;  // The candidates were picked somewhere else entirely
 
     return true;
 }
@@ -423,6 +514,9 @@ void Tracker::TrackForInitialMap() {
             // NOTE: Using the new templated InitFronStereo with the Essential Matrix Initializer
             ///      Feel free to change back to homography, but it really works better!
             //
+            // Both frames become map keyframes: they now belong to the MapMaker
+            mKeyFramePool.Release(pFirstKF);
+            mKeyFramePool.Release(pCurrentKF);
             mMapMaker.InitFromStereo<EssentialInit>(pFirstKF, pCurrentKF,
                                                     vMatches, mse3CamFromWorld);
             mnInitialStage = TRAIL_TRACKING_COMPLETE;
@@ -523,6 +617,8 @@ int Tracker::TrailTracking_Advance() {
         pCurrentKF
             ->aLevels[0];  // The eth version has parametrized this 0-level...
     Level& lPreviousFrame = pPreviousFrameKF->aLevels[0];
+    lCurrentFrame.DetectCorners();  // Trail tracking matches level-0 corners
+    lPreviousFrame.DetectCorners();
     //cout <<" Initial number of trail matches : "<<mlTrails.size()<<endl;
     for (list<Trail>::iterator i = mlTrails.begin(); i != mlTrails.end();) {
 
@@ -616,76 +712,25 @@ void Tracker::TrackMap() {
     // Some accounting which will be used for tracking quality assessment:
     for (int i = 0; i < LEVELS; i++)
         manMeasAttempted[i] = manMeasFound[i] = 0;
+    mnTemplatesReused = mnTemplatesWarped = 0;
 
     // The Potentially-Visible-Set (PVS) is split into pyramid levels.
     // 记录地图点被对应金字塔图层跟踪到的信息
-    vector<TrackerData::Ptr> avPVS[LEVELS];
+    // All the point lists below are scratch data of this frame, so they live in the frame arena.
+    ArenaAllocator<TrackerData::Ptr> arenaAlloc(mFrameArena);
+
+    // Reduced-resolution tracking: nothing is searched below this pyramid level, so
+    // the frame's finer levels (still there for mapping) cost no FAST or searches.
+    // Trades sub-pixel accuracy for speed on high resolution cameras.
+    static pvar3<int> gvnBaseLevel("Tracker.BaseLevel", 0, SILENT);
+    ArenaVector<ArenaVector<TrackerData::Ptr> > avPVS(
+        LEVELS, ArenaVector<TrackerData::Ptr>(arenaAlloc),
+        ArenaAllocator<ArenaVector<TrackerData::Ptr> >(mFrameArena));
     for (int i = 0; i < LEVELS; i++)
         avPVS[i].reserve(
             500);  // preallocating - reserve 500 bytes for each trackerdata entry per level
 
-    //cout <<"DEBUG: Scanning mappoints ... Map size : "<<mMap.vpPoints.size()<<endl;
-    //cout <<"DEBUG: trashed mappoints: "<<mMap.vpPointsTrash.size()<<endl;
-    // For each point in the map...
-    //std::vector<MapPoint>::iterator ipMP;
-    
-    // 遍历每一个地图点，根据当前帧初始位姿估计，将地图点投影到当前帧
-    for (unsigned int pointIndex = 0; pointIndex < mMap.vpPoints.size();
-         pointIndex++) {
-        //for (ipMP = mMap.vpPoints.begin(); ipMP != mMap.vpPoints.end(); ++ipMP)
-        // Every mappoint should have a TrackerData member.
-        // We want to allocate and populate this member...
-        // 需要为每一个地图点都分配一个 TrackerData结构来记录信息
-        MapPoint::Ptr pMP = mMap.vpPoints[pointIndex];
-        // Ensure that this map point has an associated TrackerData struct.
-        // The TrackerData structure constructor simply assigns the mappoint pointer internally.
-        // The rest of the data fields are populated in due time...
-        //cout <<"DEBUG: Mappoint TrackerData structure : "<<p->pTData<<endl;
-
-        // 如果地图点没有 TrackerData类型，那就为其分配一个
-        if (!pMP->pTData)
-            pMP->pTData.reset(new TrackerData(pMP));
-        // 获取引用而已
-        TrackerData::Ptr pTData =
-            pMP->pTData;  // just store a reference to avoid long names
-
-        // Project according to current view
-        // pTData记录了其指向的地图点的位置Pw，这俩是一一对应的关系，
-        // 你中有我，我中有你
-        // 这里记录下当前地图点投影到当前帧下的投影信息
-        pTData->Project(mse3CamFromWorld, mCamera);
-        // if out of the image (out-of-bounds OR beyond the maximum image radius
-        // in the Euclidean z = 1 plane), skip to next point.
-        if (!pTData->bInImage)
-            continue;
-
-        // Calculate camera projection derivatives of this point.
-        // This is simply the derivatives of the point provided by the camera.
-        // The reason G.K calls it "Unsafe" is probably because the camera frame
-        // is very unreliable at this stage (we just got it from "ApplyMotionModel" which is a very "noisy" prediction so to speak...)
-        // 根据当前帧的初始位姿计算雅可比，这肯定是不可信的，
-        // 因为当前帧初始估计位姿不准确
-        // 雅可比的作用是线性化投影过程(这也是计算单个像素引起的3D空间位置扰动，而不是计算其空间位置值的原因)
-        // 以计算仿射矩阵
-        pTData->GetDerivsUnsafe(mCamera);
-
-        // And check what the PatchFinder (included in TrackerData) makes of the mappoint in this view..
-        // 计算匹配的仿射矩阵，并根据行列式的值确定匹配点在当前帧的哪一个图层上
-        // 行列式绝对值表明了面积的放大倍数，理论上越接近于1越好匹配上
-        pTData->nSearchLevel = pTData->Finder.CalcSearchLevelAndWarpMatrix(
-            pTData->Point, mse3CamFromWorld, pTData->m2CamDerivs);
-
-        // a negative search pyramid level indicates an inappropriate warp for this view, so skip.
-        if (pTData->nSearchLevel == -1)
-            continue;
-        //cout <<"nSearchLevel in trackmap loop for PVS: "<<pTData->nSearchLevel<<endl;
-
-        // Otherwise, this point is suitable to be searched in the current image! Add to the PVS.
-        pTData->bSearched = false;
-        pTData->bFound = false;
-        // 添加一个地图点
-        avPVS[pTData->nSearchLevel].push_back(pTData);
-    }
+    FindPotentiallyVisiblePoints(avPVS, *gvnBaseLevel);
 
     // Next: A large degree of faffing about and deciding which points are going to be measured!
     // First, randomly shuffle the individual levels of the PVS.
@@ -698,8 +743,8 @@ void Tracker::TrackMap() {
 
     // The next two data structs contain the list of points which will next
     // be searched for in the image, and then used in pose update.
-    vector<TrackerData::Ptr> vNextToSearch;
-    vector<TrackerData::Ptr> vIterationSet;
+    ArenaVector<TrackerData::Ptr> vNextToSearch(arenaAlloc);
+    ArenaVector<TrackerData::Ptr> vIterationSet(arenaAlloc);
 
     // Tunable parameters to do with the coarse tracking stage:
     static pvar3<unsigned int> gvnCoarseMin(
@@ -721,14 +766,23 @@ void Tracker::TrackMap() {
         "Tracker.CoarseMinVelocity", 0.006,
         SILENT);  // Speed above which coarse stage is used.
 
-    unsigned int nCoarseMax = *gvnCoarseMax;
-    unsigned int nCoarseRange = *gvnCoarseRange;
+    // (the pvars are the full-quality settings, which the QoS controller may turn down)
+    unsigned int nCoarseMax =
+        mQoS.Value(TrackingQoS::COARSE_MAX, *gvnCoarseMax);
+    unsigned int nCoarseRange = (unsigned int)(
+        mQoS.Value(TrackingQoS::COARSE_RANGE, *gvnCoarseRange) *
+            mdSearchRangeScale +
+        0.5);
+    int nCoarseSubPixIts =
+        mQoS.Value(TrackingQoS::SUBPIX_ITS, *gvnCoarseSubPixIts);
 
     mbDidCoarse = false;
 
     // Set of heuristics to check if we should do a coarse tracking stage.
     bool bTryCoarse = true;
-    if (*gvnCoarseDisabled || mdMSDScaledVelocityMagnitude < *gvdCoarseMinVel ||
+    if (*gvnCoarseDisabled ||
+        mdMSDScaledVelocityMagnitude * mdFrameIntervalScale <
+            *gvdCoarseMinVel ||
         nCoarseMax == 0)
         bTryCoarse = false;
 
@@ -793,7 +847,7 @@ void Tracker::TrackMap() {
         // Now go and attempt to find these points in the image!
         //cout <<"Searching for "<<vNextToSearch.size()<< " points!"<<endl;
         unsigned int nFound =
-            SearchForPoints(vNextToSearch, nCoarseRange, *gvnCoarseSubPixIts);
+            SearchForPoints(vNextToSearch, nCoarseRange, nCoarseSubPixIts);
         vIterationSet =
             vNextToSearch;  // Copy over into the to-be-optimised list.
         //cout <<"DEBUG: Size of iteration set " <<vIterationSet.size()<<" found... "<<endl;
@@ -830,6 +884,9 @@ void Tracker::TrackMap() {
                     CalcPoseUpdate(vIterationSet, dOverrideSigma /*, true*/);
                 mse3CamFromWorld = SE3<>::exp(v6Update) * mse3CamFromWorld;
             }
+            // Good enough for a first guess: let it out before the fine stage
+            mPosePublisher.Publish(mse3CamFromWorld, mnFrame, mdLastTimestamp,
+                                   true, mbTrackingFromRecovery);
         }
     }
 
@@ -839,8 +896,10 @@ void Tracker::TrackMap() {
     // So, at this stage, we may or may not have done a coarse tracking stage.
     // Now do the fine tracking stage. This needs many more points!
 
-    int nFineRange = 10;  // Pixel search range for the fine stage.
-    // Can use a tighter search if the coarse stage was already done.
+    int nFineRange = (int)(10 * mdSearchRangeScale +
+                           0.5);  // Pixel search range for the fine stage.
+    // Can use a tighter search if the coarse stage was already done
+    // (the pose no longer comes from the motion model then).
     if (mbDidCoarse)
         nFineRange = 5;
 
@@ -856,7 +915,8 @@ void Tracker::TrackMap() {
             avPVS[levelIndex][TrackerDataIndex]->ProjectAndDerivs(
                 mse3CamFromWorld, mCamera);
         // Now Search for these points
-        SearchForPoints(avPVS[levelIndex], nFineRange, 8);
+        SearchForPoints(avPVS[levelIndex], nFineRange,
+                        mQoS.Value(TrackingQoS::SUBPIX_ITS, 8));
 
         // After the search, pick ALL the tracker data entries in the potentialy visible list
         // non linear iteration
@@ -875,29 +935,38 @@ void Tracker::TrackMap() {
              TrackerDataIndex < avPVS[levelIndex].size(); TrackerDataIndex++)
             vNextToSearch.push_back(avPVS[levelIndex][TrackerDataIndex]);
 
+    // If we did a coarse tracking stage: re-project and find derivs of fine points
+    // (before choosing them, so that they are chosen by where they'll be searched)
+    if (mbDidCoarse)
+        for (unsigned int TrackerDataIndex = 0;
+             TrackerDataIndex < vNextToSearch.size(); TrackerDataIndex++)
+            vNextToSearch[TrackerDataIndex]->ProjectAndDerivs(mse3CamFromWorld,
+                                                              mCamera);
+
     // But we haven't got CPU to track _all_ patches in the map - arbitrarily limit
     // ourselves to 1000, and choose these randomly.
     static pvar3<int> gvnMaxPatchesPerFrame("Tracker.MaxPatchesPerFrame", 1000,
                                             SILENT);
-    int nFinePatchesToUse = *gvnMaxPatchesPerFrame - vIterationSet.size();
+    int nFinePatchesToUse =
+        mQoS.Value(TrackingQoS::FINE_PATCHES, *gvnMaxPatchesPerFrame) -
+        vIterationSet.size();
 
     if (nFinePatchesToUse < 0)
         nFinePatchesToUse = 0;
 
-    // If we have more than we bargained for, random shuffle and pick the maximum allowable number
+    // If we have more than we bargained for, pick the maximum allowable number: those
+    // that tell the most about the pose, spread over the image (or just at random)
+    static pvar3<int> gvnInformationSelection("Tracker.InformationSelection", 1,
+                                              SILENT);
     if ((int)vNextToSearch.size() > nFinePatchesToUse) {
 
-        random_shuffle(vNextToSearch.begin(), vNextToSearch.end());
+        if (*gvnInformationSelection)
+            SelectFinePoints(vNextToSearch, nFinePatchesToUse);
+        else
+            random_shuffle(vNextToSearch.begin(), vNextToSearch.end());
         vNextToSearch.resize(nFinePatchesToUse);  // Chop!
     }
 
-    // If we did a coarse tracking stage: re-project and find derivs of fine points
-    if (mbDidCoarse)
-        for (unsigned int TrackerDataIndex = 0;
-             TrackerDataIndex < vNextToSearch.size(); TrackerDataIndex++)
-            vNextToSearch[TrackerDataIndex]->ProjectAndDerivs(mse3CamFromWorld,
-                                                              mCamera);
-
     // Find fine points in image:
     SearchForPoints(vNextToSearch, nFineRange, 0);
     // And attach them all to the end of the optimisation-set.
@@ -905,60 +974,122 @@ void Tracker::TrackMap() {
          TrackerDataIndex < vNextToSearch.size(); TrackerDataIndex++)
         vIterationSet.push_back(vNextToSearch[TrackerDataIndex]);
     //cout <<"DEBUG: vIterationSet size before optimization : "<<vIterationSet.size()<<endl;
-    // Again, ten gauss-newton pose update iterations.
-    cv::Vec<float, 6> v6LastUpdate(0, 0, 0, 0, 0, 0);
 
     // **************************** Iterative Tracking Now! *****************************************
 
-    for (int iter = 0; iter < 10; iter++) {
-        // For a bit of time-saving: don't do full nonlinear
-        // reprojection at every iteration - it really isn't necessary!
-        bool bNonLinearIteration;
-
-        // Even this is probably overkill, the reason we do many
-        // iterations is for M-Estimator convergence rather than
-        // linearization effects
-        bNonLinearIteration = (iter == 0 || iter == 4 || iter == 9);
-
-        // Either way: first iteration doesn't need projection update.
-        if (iter != 0) {
-
-            if (bNonLinearIteration) {
-
-                for (unsigned int TrackerDataIndex = 0;
-                     TrackerDataIndex < vIterationSet.size();
-                     TrackerDataIndex++)
-                    if (vIterationSet[TrackerDataIndex]->bFound)
-                        vIterationSet[TrackerDataIndex]->ProjectAndDerivs(
-                            mse3CamFromWorld, mCamera);
-            } else {
-
-                for (unsigned int i = 0; i < vIterationSet.size(); i++)
-                    if (vIterationSet[i]->bFound)
-                        vIterationSet[i]->LinearUpdate(v6LastUpdate);
-            }
-        }
-
-        if (bNonLinearIteration)
+    // Gauss-Newton pose updates, until they stop making a difference. The many
+    // iterations are mostly for M-Estimator convergence rather than linearization
+    // effects, so (as ever) most of them just update the projections linearly;
+    // only every Tracker.FineCheckEvery-th one reprojects the points. That is when
+    // the steps since the last reprojection are checked against the robust cost:
+    // if they made it worse, they are undone and tried again with Levenberg-Marquardt
+    // damping (relaxed again as steps succeed). Once Tracker.FineMinIts iterations
+    // have run, a check also ends the loop if the steps moved the points by less
+    // than Tracker.FineStopPixels, or improved the robust cost by less than the
+    // fraction Tracker.FineStopCost. One last iteration, with the M-Estimator
+    // sigma fixed as always, then marks the outliers.
+    static pvar3<int> gvnFineMaxIts("Tracker.FineMaxIts", 10, SILENT);
+    static pvar3<int> gvnFineMinIts("Tracker.FineMinIts", 3, SILENT);
+    static pvar3<int> gvnFineCheckEvery("Tracker.FineCheckEvery", 5, SILENT);
+    static pvar3<double> gvdFineStopPixels("Tracker.FineStopPixels", 0.05,
+                                           SILENT);
+    static pvar3<double> gvdFineStopCost("Tracker.FineStopCost", 1e-3, SILENT);
+    static pvar3<double> gvdFineLambda(
+        "Tracker.FineLambda", 1e-2,
+        SILENT);  // Damping (relative to the diagonal) after the first bad step
+
+    const int nMaxIts = max(*gvnFineMaxIts, 1);
+    const int nCheckEvery = max(*gvnFineCheckEvery, 1);
+    double dLambda = 0.0;
+    bool bConverged = false;
+    // Where the points were last projected, and the cost and sigma-squared there
+    SE3<> se3Checked = mse3CamFromWorld;
+    double dCheckedCost = 0, dCheckedSigmaSquared = 0;
+    double dStepPixels = 0;  // RMS image motion of the steps since then (L0)
+    int nSinceCheck = 0;     // Steps since then
+    mnFineIterations = mnFineRejectedSteps = 0;
+    for (int iter = 0; iter < nMaxIts; iter++) {
+        const bool bLastIteration = bConverged || iter == nMaxIts - 1;
+        mnFineIterations++;
+
+        if (nSinceCheck == 0)
             for (unsigned int TrackerDataIndex = 0;
                  TrackerDataIndex < vIterationSet.size(); TrackerDataIndex++)
                 if (vIterationSet[TrackerDataIndex]->bFound)
                     vIterationSet[TrackerDataIndex]->CalcJacobian();
 
-        // Again, an M-Estimator hack beyond the fifth iteration.
+        // Again, an M-Estimator hack beyond the fifth iteration (and for the last).
         double dOverrideSigma = 0.0;
 
-        if (iter > 5)
+        if (iter > 5 || bLastIteration)
             dOverrideSigma = 16.0;
 
-        // Calculate and update pose; also store update vector for linear iteration updates.
+        // Calculate and update pose
+        double dSigmaSquared, dCost;
         cv::Vec<float, 6> v6Update =
-            CalcPoseUpdate(vIterationSet, dOverrideSigma, iter == 9);
-
+            CalcPoseUpdate(vIterationSet, dOverrideSigma, bLastIteration,
+                           dLambda, &dSigmaSquared, &dCost);
+        if (nSinceCheck == 0) {
+            dCheckedCost = dCost;
+            dCheckedSigmaSquared = dSigmaSquared;
+            dStepPixels = 0;
+        }
         mse3CamFromWorld = SE3<>::exp(v6Update) * mse3CamFromWorld;
+        if (bLastIteration)
+            break;
+        nSinceCheck++;
+
+        // How far the update moves the points in the image
+        double dStepSquared = 0;
+        int nFound = 0;
+        for (unsigned int i = 0; i < vIterationSet.size(); i++)
+            if (vIterationSet[i]->bFound) {
+                const cv::Vec<float, 2> v2Step =
+                    vIterationSet[i]->m26Jacobian * v6Update;
+                dStepSquared += v2Step.dot(v2Step);
+                nFound++;
+            }
+        if (nFound > 0)
+            dStepPixels += sqrt(dStepSquared / nFound);
 
-        v6LastUpdate = v6Update;
+        // For a bit of time-saving: don't do full nonlinear
+        // reprojection at every iteration - it really isn't necessary!
+        // (But do before the last one.)
+        if (nSinceCheck < nCheckEvery && iter + 1 < nMaxIts - 1) {
+            for (unsigned int i = 0; i < vIterationSet.size(); i++)
+                if (vIterationSet[i]->bFound)
+                    vIterationSet[i]->LinearUpdate(v6Update);
+            continue;
+        }
+
+        for (unsigned int i = 0; i < vIterationSet.size(); i++)
+            if (vIterationSet[i]->bFound)
+                vIterationSet[i]->ProjectAndDerivs(mse3CamFromWorld, mCamera);
+        nSinceCheck = 0;
+
+        // Did the steps pay off?
+        const double dNewCost =
+            RobustCost(vIterationSet, dCheckedSigmaSquared);
+        if (dNewCost > dCheckedCost) {
+            // No: back to where we were, and damp the next steps more
+            mnFineRejectedSteps++;
+            mse3CamFromWorld = se3Checked;
+            for (unsigned int i = 0; i < vIterationSet.size(); i++)
+                if (vIterationSet[i]->bFound)
+                    vIterationSet[i]->ProjectAndDerivs(mse3CamFromWorld,
+                                                       mCamera);
+            dLambda = dLambda > 0 ? 10 * dLambda : *gvdFineLambda;
+            continue;
+        }
+        se3Checked = mse3CamFromWorld;
+        dLambda = dLambda > 1e-6 ? 0.1 * dLambda : 0.0;
+
+        bConverged = iter + 1 >= *gvnFineMinIts &&
+                     (dStepPixels < *gvdFineStopPixels ||
+                      dCheckedCost - dNewCost < *gvdFineStopCost * dCheckedCost);
     }
+    mnFineIterationsTotal += mnFineIterations;
+    mnFineFrames++;
 
     if (mbDraw) {
 
@@ -967,7 +1098,7 @@ void Tracker::TrackMap() {
         glEnable(GL_POINT_SMOOTH);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
         glBegin(GL_POINTS);
-        for (vector<TrackerData::Ptr>::reverse_iterator it =
+        for (ArenaVector<TrackerData::Ptr>::reverse_iterator it =
                  vIterationSet.rbegin();
              it != vIterationSet.rend(); it++) {
             if (!(*it)->bFound)
@@ -992,7 +1123,7 @@ void Tracker::TrackMap() {
     double dSumSq = 0;
     int nNum = 0;
 
-    vector<TrackerData::Ptr>::iterator ipTData;
+    ArenaVector<TrackerData::Ptr>::iterator ipTData;
     for (ipTData = vIterationSet.begin(); ipTData != vIterationSet.end();
          ipTData++) {
 
@@ -1019,20 +1150,242 @@ void Tracker::TrackMap() {
     }
 }
 
+// Builds the PVS: projects map points into the current view and files the ones that
+// can be searched for by search level (ProjectToPVS).
+//
+// Projecting the whole map every frame is mostly wasted effort, as the points well
+// outside the view stay outside it from one frame to the next. So the tracker keeps a
+// list of candidates (the points within Tracker.PVS.Margin degrees of the view, plus the
+// ones too close to the camera for angles to say much) and, as long as the camera stays
+// close to where the list was made, only projects the candidates and whatever points the
+// map maker has added since. Camera motion turns a point's viewing direction by at most
+// the rotation angle plus asin(translation / distance), so the list holds until that
+// could add up to the margin for a point outside it. It is rebuilt from the whole map
+// then, and also after relocalisation, when map points were removed, and every
+// Tracker.PVS.RebuildFrames frames anyway (bundle adjustment moves points around).
+void Tracker::FindPotentiallyVisiblePoints(
+    ArenaVector<ArenaVector<TrackerData::Ptr> >& avPVS, int nBaseLevel) {
+    static pvar3<int> gvnIncremental("Tracker.IncrementalPVS", 1, SILENT);
+    static pvar3<double> gvdMargin("Tracker.PVS.Margin", 10.0,
+                                   SILENT);  // In degrees
+    static pvar3<int> gvnRebuildFrames("Tracker.PVS.RebuildFrames", 30, SILENT);
+    static pvar3<double> gvdNearDepth(
+        "Tracker.PVS.NearDepth", 0.2,
+        SILENT);  // Fraction of the mean depth in view; nearer points are always candidates
+
+    const double dMargin = *gvdMargin * M_PI / 180.0;
+    vector<MapPoint::Ptr>& vpPoints = mMap.vpPoints;
+    // The map maker appends points as it pleases, so this pass sticks to the ones
+    // there now; any others are new ones for the next frame.
+    const size_t nPoints = vpPoints.size();
+    mnPVSProjected = 0;
+
+    // Points are only ever appended to the map, unless some were removed
+    bool bRebuild = !*gvnIncremental || !mbPVSValid ||
+                    mnFrame - mnPVSRebuildFrame >= *gvnRebuildFrames ||
+                    nPoints < mnPVSMapSize ||
+                    (mnPVSMapSize > 0 &&
+                     vpPoints[mnPVSMapSize - 1] != mpPVSLastPoint);
+    if (!bRebuild) {
+        // Camera motion since the rebuild, in the current camera frame
+        const SE3<> se3Motion = mse3CamFromWorld * mse3PVSPose.inverse();
+        const double dRotation = cv::norm(se3Motion.get_rotation().ln());
+        const double dShift =
+            cv::norm(se3Motion.get_translation()) / mdPVSNearDepth;
+        bRebuild = dRotation + asin(min(1.0, dShift)) > dMargin;
+    }
+
+    if (!bRebuild) {
+        for (unsigned int i = 0; i < mvPVSCandidates.size(); i++)
+            ProjectToPVS(mvPVSCandidates[i], avPVS, nBaseLevel);
+        // New points stay candidates until the next rebuild
+        for (size_t i = mnPVSMapSize; i < nPoints; i++) {
+            MapPoint::Ptr pMP = vpPoints[i];
+            // 如果地图点没有 TrackerData类型，那就为其分配一个
+            if (!pMP->pTData)
+                pMP->pTData.reset(new TrackerData(pMP));
+            ProjectToPVS(pMP->pTData, avPVS, nBaseLevel);
+            mvPVSCandidates.push_back(pMP->pTData);
+        }
+    } else {
+        // Project the whole map...
+        double dDepthSum = 0;
+        int nInImage = 0;
+        for (size_t pointIndex = 0; pointIndex < nPoints; pointIndex++) {
+            // Every mappoint should have a TrackerData member.
+            // We want to allocate and populate this member...
+            // 需要为每一个地图点都分配一个 TrackerData结构来记录信息
+            MapPoint::Ptr pMP = vpPoints[pointIndex];
+            // Ensure that this map point has an associated TrackerData struct.
+            // The TrackerData structure constructor simply assigns the mappoint pointer internally.
+            // The rest of the data fields are populated in due time...
+            //cout <<"DEBUG: Mappoint TrackerData structure : "<<p->pTData<<endl;
+
+            // 如果地图点没有 TrackerData类型，那就为其分配一个
+            if (!pMP->pTData)
+                pMP->pTData.reset(new TrackerData(pMP));
+            ProjectToPVS(pMP->pTData, avPVS, nBaseLevel);
+            if (pMP->pTData->bInImage) {
+                dDepthSum += pMP->pTData->v3Cam[2];
+                nInImage++;
+            }
+        }
+
+        // ... and pick the candidates from where it projected (TrackerData::v3Cam)
+        mdPVSNearDepth = nInImage > 0 ? *gvdNearDepth * dDepthSum / nInImage
+                                      : numeric_limits<double>::max();
+        const double dCosMaxAngle =
+            cos(min(M_PI, atan(mCamera.LargestRadiusInImage()) + dMargin));
+        mvPVSCandidates.clear();
+        for (size_t pointIndex = 0; pointIndex < nPoints; pointIndex++) {
+            const TrackerData::Ptr& pTData = vpPoints[pointIndex]->pTData;
+            if (!pTData)
+                continue;
+            const double dDistance = cv::norm(pTData->v3Cam);
+            if (dDistance < mdPVSNearDepth ||
+                pTData->v3Cam[2] >= dDistance * dCosMaxAngle)
+                mvPVSCandidates.push_back(pTData);
+        }
+        mbPVSValid = true;
+        mse3PVSPose = mse3CamFromWorld;
+        mnPVSRebuildFrame = mnFrame;
+    }
+
+    mnPVSMapSize = nPoints;
+    mpPVSLastPoint = nPoints > 0 ? vpPoints[nPoints - 1] : MapPoint::Ptr();
+}
+
+// Projects a map point into the current view and, if it can be searched for there,
+// adds it to the PVS at the level it should be searched at.
+void Tracker::ProjectToPVS(const TrackerData::Ptr& pTData,
+                           ArenaVector<ArenaVector<TrackerData::Ptr> >& avPVS,
+                           int nBaseLevel) {
+    mnPVSProjected++;
+    // Project according to current view
+    // pTData记录了其指向的地图点的位置Pw，这俩是一一对应的关系，
+    // 你中有我，我中有你
+    // 这里记录下当前地图点投影到当前帧下的投影信息
+    pTData->Project(mse3CamFromWorld, mCamera);
+    // if out of the image (out-of-bounds OR beyond the maximum image radius
+    // in the Euclidean z = 1 plane), skip to next point.
+    if (!pTData->bInImage)
+        return;
+
+    // Calculate camera projection derivatives of this point.
+    // This is simply the derivatives of the point provided by the camera.
+    // The reason G.K calls it "Unsafe" is probably because the camera frame
+    // is very unreliable at this stage (we just got it from "ApplyMotionModel" which is a very "noisy" prediction so to speak...)
+    // 根据当前帧的初始位姿计算雅可比，这肯定是不可信的，
+    // 因为当前帧初始估计位姿不准确
+    // 雅可比的作用是线性化投影过程(这也是计算单个像素引起的3D空间位置扰动，而不是计算其空间位置值的原因)
+    // 以计算仿射矩阵
+    pTData->GetDerivsUnsafe(mCamera);
+
+    // And check what the PatchFinder (included in TrackerData) makes of the mappoint in this view..
+    // 计算匹配的仿射矩阵，并根据行列式的值确定匹配点在当前帧的哪一个图层上
+    // 行列式绝对值表明了面积的放大倍数，理论上越接近于1越好匹配上
+    pTData->nSearchLevel = pTData->Finder.CalcSearchLevelAndWarpMatrix(
+        pTData->Point, mse3CamFromWorld, pTData->m2CamDerivs, nBaseLevel);
+
+    // a negative search pyramid level indicates an inappropriate warp for this view, so skip.
+    if (pTData->nSearchLevel == -1)
+        return;
+    //cout <<"nSearchLevel in trackmap loop for PVS: "<<pTData->nSearchLevel<<endl;
+
+    // Otherwise, this point is suitable to be searched in the current image! Add to the PVS.
+    pTData->bSearched = false;
+    pTData->bFound = false;
+    // 添加一个地图点
+    avPVS[pTData->nSearchLevel].push_back(pTData);
+}
+
+// Orders the fine-stage candidates so that the first nBudget of them are the ones to
+// search: the image is divided into a grid of buckets, and the buckets take turns
+// giving up their most informative point, i.e., the one whose measurement would
+// constrain the pose the most (largest trace of J^T J over the noise, from its
+// pose Jacobian at the predicted pose). Spatial coverage comes first, information second.
+void Tracker::SelectFinePoints(ArenaVector<TrackerData::Ptr>& vTD,
+                               int nBudget) {
+    static pvar3<int> gvnGridCols("Tracker.SelectionGridCols", 8, SILENT);
+    static pvar3<int> gvnGridRows("Tracker.SelectionGridRows", 6, SILENT);
+    const int nCols = max(*gvnGridCols, 1), nRows = max(*gvnGridRows, 1);
+
+    struct Ranked {
+        int nBucket;
+        int nRank;  // Position within its bucket (0 = the best)
+        float fInformation;
+        unsigned int nIndex;
+    };
+    ArenaVector<Ranked> vRanked((ArenaAllocator<Ranked>(mFrameArena)));
+    vRanked.reserve(vTD.size());
+    for (unsigned int i = 0; i < vTD.size(); i++) {
+        TrackerData& td = *vTD[i];
+        td.CalcJacobian();
+        double dInformation = 0;
+        for (int r = 0; r < 2; r++)
+            for (int c = 0; c < 6; c++)
+                dInformation += td.m26Jacobian(r, c) * td.m26Jacobian(r, c);
+        const int nScale = LevelScale(td.nSearchLevel);
+        dInformation /= nScale * nScale;
+
+        int nBucketX =
+            min((int)(td.v2Image[0] * nCols / mirSize.width), nCols - 1);
+        int nBucketY =
+            min((int)(td.v2Image[1] * nRows / mirSize.height), nRows - 1);
+        Ranked ranked = {max(nBucketY, 0) * nCols + max(nBucketX, 0), 0,
+                         (float)dInformation, i};
+        vRanked.push_back(ranked);
+    }
+
+    // Rank within the buckets...
+    sort(vRanked.begin(), vRanked.end(), [](const Ranked& a, const Ranked& b) {
+        return a.nBucket != b.nBucket ? a.nBucket < b.nBucket
+                                      : a.fInformation > b.fInformation;
+    });
+    for (unsigned int i = 1; i < vRanked.size(); i++)
+        if (vRanked[i].nBucket == vRanked[i - 1].nBucket)
+            vRanked[i].nRank = vRanked[i - 1].nRank + 1;
+    // ... then take the buckets' best, their second best, and so on.
+    unsigned int nSelect =
+        min((unsigned int)max(nBudget, 0), (unsigned int)vRanked.size());
+    partial_sort(vRanked.begin(), vRanked.begin() + nSelect, vRanked.end(),
+                 [](const Ranked& a, const Ranked& b) {
+                     return a.nRank != b.nRank
+                                ? a.nRank < b.nRank
+                                : a.fInformation > b.fInformation;
+                 });
+
+    ArenaVector<TrackerData::Ptr> vSelected(vTD.get_allocator());
+    vSelected.reserve(vTD.size());
+    for (unsigned int i = 0; i < vRanked.size(); i++)
+        vSelected.push_back(vTD[vRanked[i].nIndex]);
+    vTD.swap(vSelected);
+}
+
 // Find points in the image. Uses the PatchFiner struct stored in TrackerData
-int Tracker::SearchForPoints(vector<TrackerData::Ptr>& vTD, int nRange,
+int Tracker::SearchForPoints(ArenaVector<TrackerData::Ptr>& vTD, int nRange,
                              int nSubPixIts) {
+    // Seed the search with where each point was seen last frame (see TrackerData::SearchSeed)
+    static pvar3<int> gvnUseCoherence("Tracker.UseTemporalCoherence", 1,
+                                      SILENT);
+    static pvar3<int> gvnCoherenceMargin(
+        "Tracker.CoherenceMargin", 3,
+        SILENT);  // Slack around the seeded circle, in search level pixels
+
     int nFound = 0;
     for (unsigned int i = 0; i < vTD.size(); i++) {  // for each point..
 
         // First, attempt a search at pixel locations which are FAST corners.
         // (PatchFinder::FindPatchCoarse)
-        TrackerData::Ptr pTD = vTD[i];
-        PatchFinder& Finder = pTD->Finder;
+        const TrackerData::Ptr& pTD = vTD[i];
+        PatchFinder<>& Finder = pTD->Finder;
         // 计算地图点在当前帧经过仿射变换的模板，并由 mimTemplate 变量存储
         // 这里传入的是地图点pMp而不是普通帧pKF，所以可以料想，
         // 这里计算的是源关键帧的模板
-        Finder.MakeTemplateCoarseCont(pTD->Point);
+        if (Finder.MakeTemplateCoarseCont(pTD->Point))
+            mnTemplatesReused++;
+        else
+            mnTemplatesWarped++;
         if (Finder.TemplateBad()) {
 
             pTD->bInImage = pTD->bPotentiallyVisible = pTD->bFound = false;
@@ -1047,7 +1400,14 @@ int Tracker::SearchForPoints(vector<TrackerData::Ptr>& vTD, int nRange,
         // 根据仿射矩阵模板，寻找当前帧与源关键帧的匹配点
         // 注意：PTAM中，没有普通帧的概念，因此，所有函数参数pKF都是指的当前帧，
         //  只有地图点pMp才有ORBSLAM中的关键帧的含义
-        bool bFound = Finder.FindPatchCoarse(pTD->v2Image, pCurrentKF, nRange);
+        cv::Vec<float, 2> v2SearchCenter = pTD->v2Image;
+        int nSearchRange = nRange;
+        if (*gvnUseCoherence)
+            nSearchRange = pTD->SearchSeed(
+                mnFrame, nRange, *gvnCoherenceMargin * Finder.GetLevelScale(),
+                mdFrameIntervalScale, v2SearchCenter);
+        bool bFound =
+            Finder.FindPatchCoarse(v2SearchCenter, pCurrentKF, nSearchRange);
 
         pTD->bSearched = true;
 
@@ -1083,11 +1443,39 @@ int Tracker::SearchForPoints(vector<TrackerData::Ptr>& vTD, int nRange,
             pTD->v2Found = Finder.GetCoarsePosAsVector();
             pTD->bDidSubPix = false;
         }
+        pTD->UpdateCoherence(mnFrame, mdFrameIntervalScale);
     }
     //cout <<"DEBUG: Number of points found : "<<nFound<<endl;
     return nFound;
 }
 
+// Which M-estimator are we using? 0: Tukey, 1: Cauchy, 2: Huber.
+static int TrackerMEstimator() {
+    static pvar3<string> pvsEstimator("TrackerMEstimator", "Tukey", SILENT);
+
+    if (*pvsEstimator == "Tukey")
+        return 0;
+    else if (*pvsEstimator == "Cauchy")
+        return 1;
+    else if (*pvsEstimator == "Huber")
+        return 2;
+
+    cout << "Invalid TrackerMEstimator, choices are Tukey, Cauchy, Huber"
+         << endl;
+    *pvsEstimator = "Tukey";
+    return 0;
+}
+
+static inline double TrackerMEstimatorScore(int nEstimator, double dErrorSq,
+                                            double dSigmaSquared) {
+    if (nEstimator == 0)
+        return Tukey::ObjectiveScore(dErrorSq, dSigmaSquared);
+    else if (nEstimator == 1)
+        return Cauchy::ObjectiveScore(dErrorSq, dSigmaSquared);
+    else
+        return Huber::ObjectiveScore(dErrorSq, dSigmaSquared);
+}
+
 //Calculate a pose update 6-vector from a bunch of image measurements.
 //User-selectable M-Estimator.
 //Normally this robustly estimates a sigma-squared for all the measurements
@@ -1095,35 +1483,30 @@ int Tracker::SearchForPoints(vector<TrackerData::Ptr>& vTD, int nRange,
 //dOverrideSigma is positive. Also, bMarkOutliers set to true
 //records any instances of a point being marked an outlier measurement
 //by the Tukey MEstimator.
-cv::Vec<float, 6> Tracker::CalcPoseUpdate(vector<TrackerData::Ptr> vTD,
-                                          double dOverrideSigma,
-                                          bool bMarkOutliers) {
-
-    // Which M-estimator are we using?
-    int nEstimator = 0;
-    static pvar3<string> pvsEstimator("TrackerMEstimator", "Tukey", SILENT);
-
-    if (*pvsEstimator == "Tukey")
-        nEstimator = 0;
-    else if (*pvsEstimator == "Cauchy")
-        nEstimator = 1;
-    else if (*pvsEstimator == "Huber")
-        nEstimator = 2;
-    else {
-
-        cout << "Invalid TrackerMEstimator, choices are Tukey, Cauchy, Huber"
-             << endl;
-        nEstimator = 0;
-        *pvsEstimator = "Tukey";
-    }
+//A positive dLambda damps the update (Levenberg-Marquardt, relative to the
+//diagonal). The sigma-squared used and the robust cost of the measurements
+//at the current pose can be returned in pdSigmaSquared and pdCost (both zero
+//if there were too few measurements for an update).
+cv::Vec<float, 6> Tracker::CalcPoseUpdate(
+    const ArenaVector<TrackerData::Ptr>& vTD, double dOverrideSigma,
+    bool bMarkOutliers, double dLambda, double* pdSigmaSquared,
+    double* pdCost) {
+
+    const int nEstimator = TrackerMEstimator();
+    if (pdSigmaSquared)
+        *pdSigmaSquared = 0;
+    if (pdCost)
+        *pdCost = 0;
 
     // Find the covariance-scaled reprojection error for each measurement.
     // Also, store the square of these quantities for M-Estimator sigma squared estimation.
-    vector<double> vdErrorSquared;
+    ArenaAllocator<double> arenaAlloc(mFrameArena);
+    ArenaVector<double> vdErrorSquared(arenaAlloc);
+    vdErrorSquared.reserve(vTD.size());
     for (unsigned int TrackerDataIndex = 0; TrackerDataIndex < vTD.size();
          TrackerDataIndex++) {
 
-        TrackerData::Ptr pTD = vTD[TrackerDataIndex];
+        const TrackerData::Ptr& pTD = vTD[TrackerDataIndex];
         if (!pTD->bFound)
             continue;
 
@@ -1153,6 +1536,9 @@ cv::Vec<float, 6> Tracker::CalcPoseUpdate(vector<TrackerData::Ptr> vTD,
         else
             dSigmaSquared = Huber::FindSigmaSquared(vdErrorSquared);
     }
+    if (pdSigmaSquared)
+        *pdSigmaSquared = dSigmaSquared;
+    double dCost = 0;
 
     // nonlinear LS step
     cv::Matx<float, 6, 6> m6Omega =
@@ -1165,7 +1551,7 @@ cv::Vec<float, 6> Tracker::CalcPoseUpdate(vector<TrackerData::Ptr> vTD,
     for (unsigned int TrackerDataIndex = 0; TrackerDataIndex < vTD.size();
          TrackerDataIndex++) {
 
-        TrackerData::Ptr pTD = vTD[TrackerDataIndex];
+        const TrackerData::Ptr& pTD = vTD[TrackerDataIndex];
 
         if (!pTD->bFound) {
 
@@ -1183,6 +1569,7 @@ cv::Vec<float, 6> Tracker::CalcPoseUpdate(vector<TrackerData::Ptr> vTD,
             dWeight = Cauchy::Weight(dErrorSq, dSigmaSquared);
         else
             dWeight = Huber::Weight(dErrorSq, dSigmaSquared);
+        dCost += TrackerMEstimatorScore(nEstimator, dErrorSq, dSigmaSquared);
 
         // Inlier/outlier accounting, only really works for cut-off estimators such as Tukey.
         // George: Or with a manual threshold... But we already have RANSAC for this...
@@ -1209,6 +1596,12 @@ cv::Vec<float, 6> Tracker::CalcPoseUpdate(vector<TrackerData::Ptr> vTD,
         //cout <<"Previous Error : "<<v2<<endl;
     }
 
+    if (pdCost)
+        *pdCost = dCost;
+    if (dLambda > 0)
+        for (int i = 0; i < 6; i++)
+            m6Omega(i, i) *= 1.0 + dLambda;
+
     cv::Vec<float, 6> v6Update;
     //cout <<"DEBUG: Pose Update Omega : "<<m6Omega<<endl<<"And ksi:"<<v6ksi <<endl;
     cv::solve(m6Omega, v6ksi, v6Update, cv::DECOMP_CHOLESKY);
@@ -1216,15 +1609,35 @@ cv::Vec<float, 6> Tracker::CalcPoseUpdate(vector<TrackerData::Ptr> vTD,
     return v6Update;
 }
 
-// Just add the current velocity to the current pose.
-// N.b. this doesn't actually use time in any way, i.e. it assumes
-// a one-frame-per-second camera. Skipped frames etc
-// are not handled properly here.
+// The robust cost of the measurements at their current projections, for a given
+// sigma-squared (the one a CalcPoseUpdate used, to compare poses with)
+double Tracker::RobustCost(const ArenaVector<TrackerData::Ptr>& vTD,
+                           double dSigmaSquared) {
+    if (dSigmaSquared <= 0)
+        return 0;
+
+    const int nEstimator = TrackerMEstimator();
+    double dCost = 0;
+    for (unsigned int i = 0; i < vTD.size(); i++) {
+        const TrackerData& td = *vTD[i];
+        if (!td.bFound)
+            continue;
+        const cv::Vec<float, 2> v2Error =
+            td.dSqrtInvNoise * (td.v2Found - td.v2Image);
+        dCost += TrackerMEstimatorScore(nEstimator, v2Error.dot(v2Error),
+                                        dSigmaSquared);
+    }
+    return dCost;
+}
+
+// Just add the current velocity to the current pose. The velocity is per usual
+// frame interval, so it's scaled by how many of those have passed since the last
+// frame (see UpdateFrameInterval): skipped frames are extrapolated over.
 void Tracker::ApplyMotionModel() {
     // Start from our last known pose...
     mse3StartPos = mse3CamFromWorld;
-    // store cvamera velocity
-    cv::Vec<float, 6> v6Velocity = mv6CameraVelocity;
+    // store cvamera velocity, scaled to the time since the last frame
+    cv::Vec<float, 6> v6Velocity = mdFrameIntervalScale * mv6CameraVelocity;
     // if we have enabled the use of SBIs,
     // then start from that rotation estimate and assume zero translational velocity
     if (mbUseSBIInit) {
@@ -1242,11 +1655,64 @@ void Tracker::ApplyMotionModel() {
     // and that's all folks!
 }
 
+// Works out how long it's been since the last frame, in usual frame intervals, and
+// how much that widens (or narrows) the search for this frame.
+void Tracker::UpdateFrameInterval(double dTimestamp) {
+    static pvar3<double> gvdMaxFrameGap(
+        "Tracker.MaxFrameGap", 10.0,
+        SILENT);  // Longest gap (in frames) the motion model extrapolates over
+    static pvar3<double> gvdMinRangeScale("Tracker.MinSearchRangeScale", 0.5,
+                                          SILENT);
+    static pvar3<double> gvdMaxRangeScale("Tracker.MaxSearchRangeScale", 3.0,
+                                          SILENT);
+
+    mdFrameIntervalScale = 1.0;
+    // Missing, repeated or out-of-order (e.g., a looping dataset) timestamps
+    // just count as one usual interval.
+    if (dTimestamp >= 0 && mdLastTimestamp >= 0 &&
+        dTimestamp > mdLastTimestamp) {
+        double dInterval = dTimestamp - mdLastTimestamp;
+        if (mvdFirstIntervals.size() < 5) {
+            // The usual interval starts out as the median of the first few, so that
+            // a start-up burst of buffered frames (or a stall) doesn't set it.
+            mvdFirstIntervals.push_back(dInterval);
+            vector<double> vdSorted = mvdFirstIntervals;
+            nth_element(vdSorted.begin(), vdSorted.begin() + vdSorted.size() / 2,
+                        vdSorted.end());
+            mdNominalFrameInterval = vdSorted[vdSorted.size() / 2];
+            mdFrameIntervalScale = dInterval / mdNominalFrameInterval;
+        } else {
+            mdFrameIntervalScale = dInterval / mdNominalFrameInterval;
+            // Regular intervals update the usual one; the others (dropped frames) only
+            // pull it slowly, so that they don't drag it along, but a poor start
+            // still comes right eventually.
+            double dWeight =
+                (mdFrameIntervalScale > 0.5 && mdFrameIntervalScale < 2.0) ? 0.05
+                                                                           : 0.01;
+            mdNominalFrameInterval =
+                (1.0 - dWeight) * mdNominalFrameInterval + dWeight * dInterval;
+        }
+    }
+    mdLastTimestamp = dTimestamp;
+    // The motion model and the coherence velocities divide by the scale, so two nearly
+    // simultaneous timestamps mustn't bring it anywhere near zero.
+    mdFrameIntervalScale = max(*gvdMinRangeScale,
+                               min(mdFrameIntervalScale, *gvdMaxFrameGap));
+
+    // With the velocity uncertain by about the same amount every frame, the error of
+    // the predicted pose grows in proportion to the time predicted over.
+    mdSearchRangeScale = max(*gvdMinRangeScale,
+                             min(*gvdMaxRangeScale, mdFrameIntervalScale));
+}
+
 // The motion model is entirely the tracker's, and is kept as a decaying
-// constant velocity model.
+// constant velocity model: this frame's motion (per usual frame interval) is
+// averaged into the velocity, which then decays a little.
 void Tracker::UpdateMotionModel() {
     SE3<> se3NewFromOld = mse3CamFromWorld * mse3StartPos.inverse();
-    cv::Vec<float, 6> v6Motion = SE3<>::ln(se3NewFromOld);
+    // The motion of this frame, per usual frame interval
+    cv::Vec<float, 6> v6Motion =
+        (1.0 / mdFrameIntervalScale) * SE3<>::ln(se3NewFromOld);
     cv::Vec<float, 6> v6OldVel = mv6CameraVelocity;
 
     mv6CameraVelocity = 0.9 * (0.5 * v6Motion + 0.5 * v6OldVel);
@@ -1266,7 +1732,9 @@ void Tracker::UpdateMotionModel() {
 
 // Time to add a new keyframe? The MapMaker handles most of this.
 void Tracker::AddNewKeyFrame() {
-
+    // The levels the tracker never needed still lack their corners; the MapMaker's
+    // finisher detects them (KeyFrame::MakeKeyFrame_Rest), off the tracker's thread.
+    mKeyFramePool.Release(pCurrentKF);  // The MapMaker owns it from now on
     mMapMaker.AddKeyFrame(pCurrentKF);
     mnLastKeyFrameDropped = mnFrame;
 }
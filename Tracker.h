@@ -9,9 +9,12 @@
 #define __TRACKER_H
 
 #include "ATANCamera.h"
+#include "FrameArena.h"
 #include "MapMaker.h"
 #include "MiniPatch.h"
+#include "PosePublisher.h"
 #include "Relocaliser.h"
+#include "TrackingQoS.h"
 
 #include "GCVD/GLHelpers.h"
 
@@ -34,15 +37,23 @@ class Tracker {
     Tracker(cv::Size2i irVideoSize, const ATANCamera& c, Map& m, MapMaker& mm);
 
     // TrackFrame is the main working part of the tracker: call this every frame.
-    void TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw, cv::Mat& rgbFrame);
+    // dTimestamp is the frame's capture time in seconds (from any origin); if it's
+    // negative (unknown), the frame is taken to be one usual frame interval after the last.
+    void TrackFrame(cv::Mat_<uchar>& imFrame, bool bDraw, cv::Mat& rgbFrame,
+                    double dTimestamp = -1.0);
 
     inline SE3<> GetCurrentPose() { return mse3CamFromWorld; }
 
+    // Every tracked frame's pose, provisional (after the coarse stage) and refined,
+    // as soon as each is ready (see PosePublisher.h)
+    inline PosePublisher& GetPosePublisher() { return mPosePublisher; }
+
     // Gets messages to be printed on-screen for the user.
     std::string GetMessageForUser();
 
    protected:
     KeyFrame::Ptr pCurrentKF;  // The current KF as a managed pointer
+    KeyFramePool mKeyFramePool;  // Recycles the per-frame KFs (see KeyFrame.h)
 
     // The major components to which the tracker needs access:
     Map& mMap;                 // The map, consisting of points and keyframes
@@ -84,13 +95,25 @@ class Tracker {
     void
     ApplyMotionModel();  // Decaying velocity motion model applied prior to TrackMap
     void UpdateMotionModel();  // Motion model is updated after TrackMap
-    int SearchForPoints(std::vector<std::shared_ptr<TrackerData> >& vTD,
+    void FindPotentiallyVisiblePoints(
+        ArenaVector<ArenaVector<std::shared_ptr<TrackerData> > >& avPVS,
+        int nBaseLevel);  // Fills the PVS, by level
+    void ProjectToPVS(
+        const std::shared_ptr<TrackerData>& pTData,
+        ArenaVector<ArenaVector<std::shared_ptr<TrackerData> > >& avPVS,
+        int nBaseLevel);  // Projects one point and adds it to the PVS if searchable
+    void SelectFinePoints(ArenaVector<std::shared_ptr<TrackerData> >& vTD,
+                          int nBudget);  // Puts the nBudget points to search first
+    int SearchForPoints(ArenaVector<std::shared_ptr<TrackerData> >& vTD,
                         int nRange,
                         int nFineIts);  // Finds points in the image
     cv::Vec<float, 6> CalcPoseUpdate(
-        std::vector<std::shared_ptr<TrackerData> > vTD,
-        double dOverrideSigma = 0.0,
-        bool bMarkOutliers = false);  // Updates pose from found points.
+        const ArenaVector<std::shared_ptr<TrackerData> >& vTD,
+        double dOverrideSigma = 0.0, bool bMarkOutliers = false,
+        double dLambda = 0.0, double* pdSigmaSquared = NULL,
+        double* pdCost = NULL);  // Updates pose from found points.
+    double RobustCost(const ArenaVector<std::shared_ptr<TrackerData> >& vTD,
+                      double dSigmaSquared);  // M-Estimator cost of found points
     SE3<>
         mse3CamFromWorld;  // Camera pose: this is what the tracker updates every frame.
     SE3<> mse3StartPos;  // What the camera pose was at the start of the frame.
@@ -100,8 +123,39 @@ class Tracker {
         mdMSDScaledVelocityMagnitude;  // Velocity magnitude scaled by relative scene depth.
     bool mbDidCoarse;  // Did tracking use the coarse tracking stage?
 
+    // Fine stage pose iteration statistics
+    int mnFineIterations;     // Iterations this frame
+    int mnFineRejectedSteps;  // Reprojections this frame that undid steps (see TrackMap)
+    unsigned long mnFineIterationsTotal;  // Iterations since the last reset...
+    unsigned long mnFineFrames;           // ... over this many frames
+
+    // The PVS candidates: the map points that could be in view while the camera stays
+    // near the pose they were picked at (see FindPotentiallyVisiblePoints)
+    std::vector<std::shared_ptr<TrackerData> > mvPVSCandidates;
+    bool mbPVSValid;               // False forces a rebuild from the whole map
+    SE3<> mse3PVSPose;             // The pose the candidates were picked at
+    double mdPVSNearDepth;         // Points nearer than this are always candidates
+    int mnPVSRebuildFrame;         // The frame they were picked in
+    unsigned int mnPVSMapSize;     // Map points seen so far (new ones are appended)
+    MapPoint::Ptr mpPVSLastPoint;  // The last of those
+    unsigned int mnPVSProjected;   // How many points this frame's PVS projected
+
+    // Frame timing. The motion model velocity is per usual frame interval, and is scaled
+    // by how many of those really passed since the last frame; the prediction gets less
+    // certain the further it extrapolates, and the search radii are scaled to match.
+    void UpdateFrameInterval(double dTimestamp);  // Called first thing in TrackFrame
+    double mdLastTimestamp;         // Capture time of the last frame (negative if unknown)
+    double mdNominalFrameInterval;  // The usual time between frames (0 until known)
+    std::vector<double> mvdFirstIntervals;  // The first few intervals, to seed the above
+    double mdFrameIntervalScale;    // Time since the last frame, in usual intervals
+    double mdSearchRangeScale;      // Scale of the search radii for this frame
+
     bool mbDraw;  // Should the tracker draw anything to OpenGL?
 
+    FrameArena mFrameArena;  // Scratch memory of the current frame (rewound in TrackFrame)
+    TrackingQoS mQoS;  // Trades tracking workload for frame time (see TrackingQoS.h)
+    PosePublisher mPosePublisher;  // Publishes the tracked poses
+
     // Interface with map maker:
     int mnFrame;                // Frames processed since last reset
     int mnLastKeyFrameDropped;  // Counter of last keyframe inserted.
@@ -111,13 +165,18 @@ class Tracker {
     // Tracking quality control:
     int manMeasAttempted[LEVELS];
     int manMeasFound[LEVELS];
+    // Coarse templates this frame that were kept from the last frame, and re-warped
+    unsigned int mnTemplatesReused;
+    unsigned int mnTemplatesWarped;
     enum { BAD, DODGY, GOOD } mTrackingQuality;
     int mnLostFrames;
 
     // Relocalisation functions:
     bool AttemptRecovery();  // Called by TrackFrame if tracking is lost.
+    bool mbRelocalising;  // Has the relocaliser been given frames to work on?
     bool
         mbJustRecoveredSoUseCoarse;  // Always use coarse tracking after recovery!
+    bool mbTrackingFromRecovery;  // Is TrackMap starting from a relocaliser guess?
 
     // Frame-to-frame motion init:
     SmallBlurryImage* mpSBILastFrame;
@@ -18,12 +18,16 @@ struct TrackerData {
 
     typedef std::shared_ptr<TrackerData> Ptr;
 
-    TrackerData(MapPoint::Ptr pMapPoint) : Point(pMapPoint){};
+    TrackerData(MapPoint::Ptr pMapPoint)
+        : Point(pMapPoint),
+          nLastFoundFrame(-1),
+          v2LastFound(0, 0),
+          v2ImageVelocity(0, 0){};
 
     // 当前TrackerData、PatchFinder映射的地图点
     MapPoint::Ptr Point;
     // 块匹配器，包含仿射矩阵计算，记录了地图点的模板信息
-    PatchFinder Finder;
+    PatchFinder<> Finder;
 
     // Projection itermediates:
     // 记录地图点投影到当前帧的 Pc, Pc_norm，以及在当前帧的像素坐标
@@ -43,6 +47,14 @@ struct TrackerData {
     cv::Vec<float, 2> v2Found;  // Pixel coords of found patch (L0)
     double dSqrtInvNoise;       // Only depends on search level..
 
+    // Temporal coherence, kept from frame to frame: where the point was last found (L0)
+    // and in which frame, and how far it moved between its last two consecutive
+    // sightings, per usual frame interval like the tracker's motion model (zero if it
+    // hasn't been found twice in a row).
+    int nLastFoundFrame;
+    cv::Vec<float, 2> v2LastFound;
+    cv::Vec<float, 2> v2ImageVelocity;
+
     // Stuff for pose update:
     cv::Vec<float, 2> v2Error_CovScaled;
     cv::Matx<float, 2, 6> m26Jacobian;  // 2x6 Jacobian wrt camera position
@@ -130,6 +142,41 @@ struct TrackerData {
         }
     }
 
+    // Where to search for the point in frame nFrame, and how far (L0 pixels). If it was
+    // found in the previous frame, its last position moved on by its image velocity is a
+    // second prediction, independent of the pose; when that agrees with the projection,
+    // a circle around the two of them (plus nMargin) is searched instead of nRange.
+    // dIntervalScale is the time since the previous frame, in usual frame intervals.
+    inline int SearchSeed(int nFrame, int nRange, int nMargin,
+                          double dIntervalScale,
+                          cv::Vec<float, 2>& v2Center) const {
+        v2Center = v2Image;
+        if (nLastFoundFrame < 0 || nLastFoundFrame != nFrame - 1)
+            return nRange;
+
+        cv::Vec<float, 2> v2Coherent =
+            v2LastFound + (float)dIntervalScale * v2ImageVelocity;
+        cv::Vec<float, 2> v2Diff = v2Coherent - v2Image;
+        int nSeedRange = (int)ceil(0.5 * cv::norm(v2Diff)) + nMargin;
+        if (nSeedRange >= nRange)  // They don't agree; trust the projection
+            return nRange;
+
+        v2Center = 0.5f * (v2Image + v2Coherent);
+        return nSeedRange;
+    }
+
+    // Records that the point was found (at v2Found) in frame nFrame, dIntervalScale
+    // usual frame intervals after the previous frame
+    inline void UpdateCoherence(int nFrame, double dIntervalScale) {
+        if (nLastFoundFrame >= 0 && nLastFoundFrame == nFrame - 1)
+            v2ImageVelocity =
+                (float)(1.0 / dIntervalScale) * (v2Found - v2LastFound);
+        else
+            v2ImageVelocity = cv::Vec<float, 2>(0, 0);
+        v2LastFound = v2Found;
+        nLastFoundFrame = nFrame;
+    }
+
     // Sometimes in tracker instead of reprojecting, just update the error linearly!
     inline void LinearUpdate(const cv::Vec<float, 6>& v6) {
 
@@ -0,0 +1,123 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+#include "TrackingQoS.h"
+
+#include "Persistence/instances.h"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+using namespace Persistence;
+
+TrackingQoS::TrackingQoS() {
+    for (int k = 0; k < NUM_KNOBS; k++) {
+        madQuality[k] = 1.0;
+        manLastValue[k] = 0;
+        manMoves[k] = 0;
+    }
+    mdSmoothedMs = 0;
+    mnFramesSinceMove = 0;
+    mnFrames = 0;
+    mnLastMovedKnob = -1;
+    mbLastMoveDown = false;
+    mnLastMoveFrame = 0;
+}
+
+const char* TrackingQoS::KnobName(Knob k) {
+    static const char* aszNames[NUM_KNOBS] = {"fine points", "subpix its",
+                                              "coarse points", "coarse range"};
+    return aszNames[k];
+}
+
+int TrackingQoS::Value(Knob k, int nFull) {
+    static pvar3<int> gvnQoSEnable("Tracker.QoS.Enable", 0, SILENT);
+    // The lowest each knob may be turned down to
+    static pvar3<int> gvnMinPatches("Tracker.QoS.MinPatchesPerFrame", 300,
+                                    SILENT);
+    static pvar3<int> gvnMinSubPixIts("Tracker.QoS.MinSubPixIts", 3, SILENT);
+    static pvar3<int> gvnMinCoarseMax("Tracker.QoS.MinCoarseMax", 30, SILENT);
+    static pvar3<int> gvnMinCoarseRange("Tracker.QoS.MinCoarseRange", 15,
+                                        SILENT);
+
+    int nValue = nFull;
+    if (*gvnQoSEnable) {
+        const int anMin[NUM_KNOBS] = {*gvnMinPatches, *gvnMinSubPixIts,
+                                      *gvnMinCoarseMax, *gvnMinCoarseRange};
+        int nMin = min(anMin[k], nFull);
+        nValue = nMin + (int)(madQuality[k] * (nFull - nMin) + 0.5);
+    }
+    manLastValue[k] = nValue;
+    return nValue;
+}
+
+void TrackingQoS::FrameDone(double dMilliseconds) {
+    static pvar3<double> gvdTargetMs("Tracker.QoS.TargetFrameMs", 33.0,
+                                     SILENT);
+    static pvar3<double> gvdHeadroom(
+        "Tracker.QoS.Headroom", 0.75,
+        SILENT);  // Restore quality below this fraction of the target
+    static pvar3<int> gvnHoldFrames(
+        "Tracker.QoS.HoldFrames", 5,
+        SILENT);  // Frames to watch the effect of a move before the next one
+    static pvar3<int> gvnQoSEnable("Tracker.QoS.Enable", 0, SILENT);
+
+    mnFrames++;
+    mnFramesSinceMove++;
+    if (mnFrames == 1)
+        mdSmoothedMs = dMilliseconds;
+    else
+        mdSmoothedMs = 0.8 * mdSmoothedMs + 0.2 * dMilliseconds;
+
+    if (!*gvnQoSEnable)
+        return;
+
+    // A very late frame (e.g., a burst of new map points or texture) backs off at once
+    const double dTarget = *gvdTargetMs;
+    bool bSpike = dMilliseconds > 1.5 * dTarget;
+    if (mnFramesSinceMove < *gvnHoldFrames && !bSpike)
+        return;
+
+    int nMoved = -1;
+    if (mdSmoothedMs > dTarget || bSpike) {
+        // Back off the first knob that still can, by how late we are
+        double dStep = max(mdSmoothedMs, dMilliseconds) / dTarget - 1.0;
+        dStep = max(0.1, min(0.5, dStep));
+        for (int k = 0; k < NUM_KNOBS && nMoved < 0; k++)
+            if (madQuality[k] > 0) {
+                madQuality[k] = max(0.0, madQuality[k] - dStep);
+                nMoved = k;
+            }
+    } else if (mdSmoothedMs < *gvdHeadroom * dTarget) {
+        // Restore the last knob that was backed off, a step at a time
+        for (int k = NUM_KNOBS - 1; k >= 0 && nMoved < 0; k--)
+            if (madQuality[k] < 1) {
+                madQuality[k] = min(1.0, madQuality[k] + 0.1);
+                nMoved = k;
+            }
+    }
+
+    if (nMoved < 0)
+        return;
+    mbLastMoveDown = mdSmoothedMs > dTarget || bSpike;
+    mnLastMovedKnob = nMoved;
+    mnLastMoveFrame = mnFrames;
+    manMoves[nMoved]++;
+    mnFramesSinceMove = 0;
+}
+
+string TrackingQoS::Status() const {
+    ostringstream os;
+    os << "QoS: " << (int)(mdSmoothedMs + 0.5) << "ms";
+    if (mnLastMovedKnob >= 0)
+        os << ", " << KnobName((Knob)mnLastMovedKnob)
+           << (mbLastMoveDown ? " down" : " up") << " to "
+           << manLastValue[mnLastMovedKnob] << " "
+           << mnFrames - mnLastMoveFrame << " frames ago ("
+           << manMoves[mnLastMovedKnob] << " moves)";
+    return os.str();
+}
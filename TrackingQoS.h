@@ -0,0 +1,68 @@
+// George Terzakis 2016
+//
+// University of Portsmouth
+//
+// Code based on PTAM by Klein and Murray (Copyright 2008 Isis Innovation Limited)
+
+//
+// A quality-of-service controller for the tracker.
+//
+// The tracker's workload is set by a handful of knobs: how many fine points it
+// measures per frame, how many sub-pixel iterations it spends per point, and how
+// many coarse points it searches for, and how far. Their pvars hold the full-quality
+// settings. TrackingQoS times each tracked frame against a target frame time and,
+// when the frames run late, backs the knobs off one at a time (in that order, down
+// to configured minimums); when there is headroom again, it restores them in the
+// reverse order. Only one knob moves per decision, and decisions are a few frames
+// apart, so that the effect of each move can be seen before the next.
+//
+// The tracker asks for every knob's value with Value(knob, full-quality setting)
+// and reports each tracked frame's time with FrameDone. Status() is a short summary
+// for the user (the smoothed frame time and the last knob that moved).
+//
+// The controller is off unless Tracker.QoS.Enable is set; Value() then returns the
+// full-quality settings unchanged.
+
+#ifndef __TRACKING_QOS_H
+#define __TRACKING_QOS_H
+
+#include <string>
+
+class TrackingQoS {
+   public:
+    enum Knob {
+        FINE_PATCHES,  // Tracker.MaxPatchesPerFrame
+        SUBPIX_ITS,    // Sub-pixel iterations of the coarse and top-level points
+        COARSE_MAX,    // Tracker.CoarseMax
+        COARSE_RANGE,  // Tracker.CoarseRange
+        NUM_KNOBS
+    };
+
+    TrackingQoS();
+
+    // The value of knob k for this frame, given its full-quality setting nFull
+    int Value(Knob k, int nFull);
+
+    // Reports the time a tracked frame took (ms); may move one knob.
+    void FrameDone(double dMilliseconds);
+
+    std::string Status() const;
+
+    static const char* KnobName(Knob k);
+
+   protected:
+    double madQuality[NUM_KNOBS];  // 0 = at its minimum, 1 = at full quality
+    int manLastValue[NUM_KNOBS];   // What Value() last returned, for the stats
+    unsigned int manMoves[NUM_KNOBS];  // How many times each knob has moved
+
+    double mdSmoothedMs;  // Running average of the frame time
+    int mnFramesSinceMove;
+    unsigned long mnFrames;
+
+    // The last move: which knob, which way, and when (in FrameDone calls)
+    int mnLastMovedKnob;  // -1 if none yet
+    bool mbLastMoveDown;
+    unsigned long mnLastMoveFrame;
+};
+
+#endif
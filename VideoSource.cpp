@@ -3,10 +3,86 @@
 
 #include "Persistence/instances.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 using namespace std;
+using namespace Persistence;
+
+struct VideoSourceData {
+    struct Frame {
+        cv::Mat imBGR;
+        double dTimestamp;
+    };
+
+    std::thread captureThread;
+    std::mutex mutex;  // Guards everything below
+    std::condition_variable cvFrameReady;
+    std::deque<Frame> qFrames;
+    unsigned int nQueueDepth;
+    bool bStop;
+    bool bCaptureFailed;
+    unsigned long nCaptured;
+    unsigned long nDropped;
+
+    VideoSourceData(unsigned int nDepth)
+        : nQueueDepth(nDepth),
+          bStop(false),
+          bCaptureFailed(false),
+          nCaptured(0),
+          nDropped(0) {}
+
+    ~VideoSourceData() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bStop = true;
+        }
+        if (captureThread.joinable())
+            captureThread.join();
+    }
+};
+
+// The capture thread: grabs frames as fast as the camera delivers them
+static void CaptureLoop(cv::VideoCapture* pcap, VideoSourceData* pData) {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(pData->mutex);
+            if (pData->bStop)
+                return;
+        }
+
+        bool bGrabbed = pcap->grab();
+        double dTimestamp =
+            std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        VideoSourceData::Frame frame;
+        if (bGrabbed) {
+            pcap->retrieve(frame.imBGR);
+            frame.dTimestamp = dTimestamp;
+        }
+
+        std::lock_guard<std::mutex> lock(pData->mutex);
+        if (!bGrabbed) {
+            pData->bCaptureFailed = true;
+            pData->cvFrameReady.notify_all();
+            return;
+        }
+        pData->qFrames.push_back(frame);
+        pData->nCaptured++;
+        // Latest frames win
+        while (pData->qFrames.size() > pData->nQueueDepth) {
+            pData->qFrames.pop_front();
+            pData->nDropped++;
+        }
+        pData->cvFrameReady.notify_one();
+    }
+}
 
 // For the time being, I am implementing webcam live capture.... All being well, more will follow...
 constexpr double distortionParameter[5] = {0.2312, -0.7849, -0.0033, -0.0001,
@@ -40,14 +116,28 @@ cv::Size2i VideoSource::getSize() {
 };
 
 void VideoSource::GetAndFillFrameBWandRGB(cv::Mat_<uchar>& imBW,
-                                          cv::Mat& imRGB) {
-    if (!pcap->grab()) {
-        cout << " Could not even grab the first frame! exiting..." << endl;
-        exit(-1);
+                                          cv::Mat& imRGB, double& dTimestamp) {
+    if (!mpData) {
+        static pvar3<int> gvnQueueDepth("VideoSource.QueueDepth", 1, SILENT);
+        mpData.reset(new VideoSourceData(max(*gvnQueueDepth, 1)));
+        mpData->captureThread = std::thread(CaptureLoop, pcap, mpData.get());
     }
 
+    // Wait for the capture thread, then take the oldest frame it has kept
     cv::Mat capFrame;
-    pcap->retrieve(capFrame);
+    {
+        std::unique_lock<std::mutex> lock(mpData->mutex);
+        mpData->cvFrameReady.wait(lock, [this] {
+            return !mpData->qFrames.empty() || mpData->bCaptureFailed;
+        });
+        if (mpData->qFrames.empty()) {
+            cout << " Could not grab a frame! exiting..." << endl;
+            exit(-1);
+        }
+        capFrame = mpData->qFrames.front().imBGR;
+        dTimestamp = mpData->qFrames.front().dTimestamp;
+        mpData->qFrames.pop_front();
+    }
     /*cv::namedWindow("framed");
   cv::imshow("framed", capFrame);
   cv::waitKey(-1);*/
@@ -97,7 +187,18 @@ void ImageDataSet::ReadImagesAssociationFile() {
     cout << "get image nmu: " << mvstrImageFilenamesD.size() << endl;
 }
 
-void ImageDataSet::GetAndFillFrameBWandRGB(cv::Mat& imgRGB, cv::Mat& imgBW) {
+void VideoSource::GetFrameStats(unsigned long& nCaptured,
+                                unsigned long& nDropped) {
+    nCaptured = nDropped = 0;
+    if (!mpData)
+        return;
+    std::lock_guard<std::mutex> lock(mpData->mutex);
+    nCaptured = mpData->nCaptured;
+    nDropped = mpData->nDropped;
+}
+
+void ImageDataSet::GetAndFillFrameBWandRGB(cv::Mat& imgRGB, cv::Mat& imgBW,
+                                           double& dTimestamp) {
     static bool isInited = false;
     if (!isInited) {
         ReadImagesAssociationFile();
@@ -113,6 +214,7 @@ void ImageDataSet::GetAndFillFrameBWandRGB(cv::Mat& imgRGB, cv::Mat& imgBW) {
              << endl;
         return;
     }
+    dTimestamp = mvTimestamps[index];
 
     const cv::Mat oldK = (cv::Mat_<float>(3, 3) << 520.9, 0.0, 325.1, 0.0,
                           521.0, 249.7, 0.0, 0.0, 1.0);
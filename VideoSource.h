@@ -11,10 +11,17 @@
 // format as an ImageRef, and GetAndFillFrameBWandRGB should wait for
 // a new frame and then overwrite the passed-as-reference images with
 // GreyScale and Colour versions of the new frame.
+//
+// Live capture runs in a thread of its own (started by the first
+// GetAndFillFrameBWandRGB), which keeps grabbing frames into a short queue
+// (VideoSource.QueueDepth frames, default 1) and drops the oldest when it's full.
+// So a slow consumer always gets the latest frame(s) instead of falling ever
+// further behind the camera; the timestamps tell it how much time it skipped.
 
 #include "OpenCV.h"
 
 #include <fstream>
+#include <memory>
 
 //using namespace cv;
 
@@ -24,15 +31,24 @@ class VideoSource {
    public:
     VideoSource(int camera_index = -1);
 
-    void GetAndFillFrameBWandRGB(cv::Mat_<uchar>& imBW, cv::Mat& imRGB);
+    // dTimestamp gets the capture time in seconds (steady clock, arbitrary origin)
+    void GetAndFillFrameBWandRGB(cv::Mat_<uchar>& imBW, cv::Mat& imRGB,
+                                 double& dTimestamp);
 
     cv::Size2i getSize();
 
+    // Frames grabbed by the capture thread so far, and how many of them were
+    // dropped (overwritten in the queue before anyone asked for them)
+    void GetFrameStats(unsigned long& nCaptured, unsigned long& nDropped);
+
     // private:
     int camera_index_;
     cv::VideoCapture* pcap;
 
     cv::Size2i mirSize;
+
+    // The capture thread and its frame queue (shared by copies of this object)
+    std::shared_ptr<VideoSourceData> mpData;
 };
 
 class ImageDataSet : public VideoSource {
@@ -41,7 +57,9 @@ class ImageDataSet : public VideoSource {
                  const std::string& strAssociationFilePath);
     ~ImageDataSet() {}
     void ReadImagesAssociationFile();
-    void GetAndFillFrameBWandRGB(cv::Mat& imgRGB, cv::Mat& imgBW);
+    // dTimestamp gets the image's timestamp from the association file
+    void GetAndFillFrameBWandRGB(cv::Mat& imgRGB, cv::Mat& imgBW,
+                                 double& dTimestamp);
 
    private:
     std::string mStrDatasetDir;